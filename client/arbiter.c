@@ -0,0 +1,83 @@
+#include <string.h>
+
+#include "arbiter.h"
+#include "common.h"
+
+void
+arbiter_init(arbiter_t* arb, arbiter_out_fptr output, void* arg)
+{
+  memset(arb, 0, sizeof(arbiter_t));
+  arb->output = output;
+  arb->arg = arg;
+  arb->contender_id = -1;
+}
+
+static void
+arbiter_lock(arbiter_t* arb, int stream_id, unsigned long long now)
+{
+  arb->locked = TRUE;
+  arb->stream_id = stream_id;
+  arb->last_us = now;
+  arb->streams++;
+  if (stream_id == arb->contender_id) {
+    arb->contender_id = -1;
+  }
+}
+
+void
+arbiter_put(arbiter_t* arb, unsigned char* buf, int buf_bytes)
+{
+  unsigned long long now = now_us();
+  unsigned int header;
+  int stream_id;
+
+  if (buf_bytes < 4) {
+    arb->output(arb->arg, buf, buf_bytes);
+    return;
+  }
+  header = (buf[1] << 8) + buf[0];
+  if (header != 0xA02F && header != 0xC012) {
+    arb->output(arb->arg, buf, buf_bytes);
+    return;
+  }
+  stream_id = (buf[3] << 8) + buf[2];
+
+  // Nobody downstream sees an end for a stream that just stops, its
+  // hold on the radio runs out instead
+  if (arb->locked && now - arb->last_us >= ARBITER_HANG_MS * 1000ULL) {
+    arb->locked = FALSE;
+    arb->hangs++;
+  }
+
+  if (!arb->locked) {
+    if (header == 0xA02F) {
+      arbiter_lock(arb, stream_id, now);
+    }
+    else if (stream_id == arb->contender_id) {
+      // Joined part way through, replay the header we turned away
+      arb->output(arb->arg, arb->contender, GMSK_HEADER_BYTES);
+      arbiter_lock(arb, stream_id, now);
+      arb->takeovers++;
+    }
+  }
+
+  if (!arb->locked || stream_id != arb->stream_id) {
+    if (header == 0xA02F && buf_bytes == GMSK_HEADER_BYTES) {
+      memcpy(arb->contender, buf, GMSK_HEADER_BYTES);
+      arb->contender_id = stream_id;
+    }
+    else if (stream_id == arb->contender_id && (buf[4] & 0x40)) {
+      arb->contender_id = -1;
+    }
+    arb->discarded++;
+    return;
+  }
+
+  arb->last_us = now;
+  arb->output(arb->arg, buf, buf_bytes);
+
+  // End of stream flag, the radio is free for the next header
+  if (header == 0xC012 && (buf[4] & 0x40)) {
+    arb->locked = FALSE;
+  }
+}
@@ -0,0 +1,39 @@
+// Picks one GMSK stream at a time from the network so frames from
+// stations keying up together are not interleaved on the radio
+#ifndef ARBITER_H
+#define ARBITER_H
+
+#include "device_gmsk.h"
+
+#define ARBITER_HANG_MS 500	// release a stream silent this long
+
+// Called with each frame that is let through
+typedef void (*arbiter_out_fptr)(void* arg, unsigned char* buf, int buf_bytes);
+
+// Not thread safe, call arbiter_put from one thread
+typedef struct {
+  arbiter_out_fptr output;
+  void* arg;
+
+  int locked;			// a stream holds the radio
+  int stream_id;
+  unsigned long long last_us;	// last frame from the locked stream
+
+  // Header of the latest stream turned away, it takes over if it is
+  // still sending once the locked stream ends
+  unsigned char contender[GMSK_HEADER_BYTES];
+  int contender_id;		// -1 when none
+
+  unsigned long streams;	// streams that got the radio
+  unsigned long takeovers;	// of those, turned away first
+  unsigned long hangs;		// locks released by ARBITER_HANG_MS
+  unsigned long discarded;	// frames from other streams
+} arbiter_t;
+
+void arbiter_init(arbiter_t* arb, arbiter_out_fptr output, void* arg);
+
+// Pass a packet from the network through, GMSK frames are dropped
+// unless they belong to the locked stream
+void arbiter_put(arbiter_t* arb, unsigned char* buf, int buf_bytes);
+
+#endif
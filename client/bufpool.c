@@ -0,0 +1,164 @@
+// A pool of preallocated, reference counted byte buffers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+#include "common.h"
+
+static const int bufpool_bytes[BUFPOOL_CLASSES] = {
+  BUFPOOL_SMALL_BYTES, BUFPOOL_MEDIUM_BYTES, BUFPOOL_LARGE_BYTES
+};
+static const int bufpool_count[BUFPOOL_CLASSES] = {
+  BUFPOOL_SMALL_COUNT, BUFPOOL_MEDIUM_COUNT, BUFPOOL_LARGE_COUNT
+};
+
+static bufpool_t default_pool;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+// Keep every buffer header aligned within the backing store
+static int
+bufpool_stride(int pool_class)
+{
+  int bytes = sizeof(buf_t) + bufpool_bytes[pool_class];
+  return (bytes + 15) & ~15;
+}
+
+int
+bufpool_init(bufpool_t* pool)
+{
+  unsigned char* p;
+  buf_t* buf;
+  size_t total = 0;
+  int c, i;
+
+  if (!pool) return FALSE;
+  memset(pool, 0, sizeof(bufpool_t));
+  pthread_mutex_init(&(pool->mutex), NULL);
+
+  for (c = 0; c < BUFPOOL_CLASSES; c++) {
+    total += (size_t)bufpool_stride(c) * bufpool_count[c];
+  }
+  pool->memory = malloc(total);
+  if (!pool->memory) {
+    fprintf(stderr, "bufpool_init - error allocating %zu bytes\n", total);
+    return FALSE;
+  }
+
+  p = pool->memory;
+  for (c = 0; c < BUFPOOL_CLASSES; c++) {
+    for (i = 0; i < bufpool_count[c]; i++) {
+      buf = (buf_t *)p;
+      buf->pool = pool;
+      buf->pool_class = c;
+      buf->size = bufpool_bytes[c];
+      buf->next = pool->free[c];
+      pool->free[c] = buf;
+      p += bufpool_stride(c);
+    }
+  }
+
+  return TRUE;
+}
+
+void
+bufpool_delete(bufpool_t* pool)
+{
+  if (!pool || !pool->memory) return;
+  if (pool->in_use > 0) {
+    fprintf(stderr, "bufpool_delete - %d buffers still in use\n",
+            pool->in_use);
+  }
+  free(pool->memory);
+  pool->memory = NULL;
+  pthread_mutex_destroy(&(pool->mutex));
+}
+
+static void
+bufpool_default_init(void)
+{
+  bufpool_init(&default_pool);
+}
+
+bufpool_t*
+bufpool_default(void)
+{
+  pthread_once(&default_pool_once, bufpool_default_init);
+  return &default_pool;
+}
+
+buf_t*
+buf_alloc(bufpool_t* pool, int len)
+{
+  buf_t* buf = NULL;
+  int c;
+
+  if (!pool || len < 0) return NULL;
+
+  pthread_mutex_lock(&(pool->mutex));
+  for (c = 0; c < BUFPOOL_CLASSES; c++) {
+    if (len <= bufpool_bytes[c] && pool->free[c]) {
+      buf = pool->free[c];
+      pool->free[c] = buf->next;
+      break;
+    }
+  }
+  if (buf) {
+    pool->in_use += 1;
+    if (pool->in_use > pool->high_water) {
+      pool->high_water = pool->in_use;
+    }
+  }
+  else {
+    pool->fallbacks += 1;
+  }
+  pool->allocs += 1;
+  pthread_mutex_unlock(&(pool->mutex));
+
+  // Exhausted or oversized, still serve the request but off the pool
+  if (!buf) {
+    buf = malloc(sizeof(buf_t) + len);
+    if (!buf) {
+      fprintf(stderr, "buf_alloc - error allocating %d bytes\n", len);
+      return NULL;
+    }
+    buf->pool = pool;
+    buf->pool_class = -1;
+    buf->size = len;
+  }
+
+  buf->next = NULL;
+  buf->refs = 1;
+  buf->len = 0;
+  return buf;
+}
+
+buf_t*
+buf_ref(buf_t* buf)
+{
+  if (buf) {
+    __atomic_add_fetch(&(buf->refs), 1, __ATOMIC_RELAXED);
+  }
+  return buf;
+}
+
+void
+buf_release(buf_t* buf)
+{
+  bufpool_t* pool;
+
+  if (!buf) return;
+  if (__atomic_sub_fetch(&(buf->refs), 1, __ATOMIC_ACQ_REL) > 0) return;
+
+  if (buf->pool_class < 0) {
+    free(buf);
+    return;
+  }
+
+  pool = buf->pool;
+  pthread_mutex_lock(&(pool->mutex));
+  buf->next = pool->free[buf->pool_class];
+  pool->free[buf->pool_class] = buf;
+  pool->in_use -= 1;
+  pthread_mutex_unlock(&(pool->mutex));
+}
@@ -0,0 +1,57 @@
+// A pool of preallocated, reference counted byte buffers that can be
+// handed between threads without copying
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <pthread.h>
+
+// Size classes, most DVAP frames fit in the smallest
+#define BUFPOOL_CLASSES		3
+#define BUFPOOL_SMALL_BYTES	64
+#define BUFPOOL_SMALL_COUNT	256
+#define BUFPOOL_MEDIUM_BYTES	512
+#define BUFPOOL_MEDIUM_COUNT	32
+#define BUFPOOL_LARGE_BYTES	8192
+#define BUFPOOL_LARGE_COUNT	4
+
+struct bufpool_s;
+
+typedef struct buf_s {
+  struct buf_s* next;		// free list link, only while in the pool
+  struct bufpool_s* pool;	// pool to return to
+  int pool_class;		// size class, -1 if allocated outside the pool
+  int refs;			// reference count, atomic
+  int size;			// capacity of data
+  int len;			// bytes of data in use
+  unsigned char data[];
+} buf_t;
+
+typedef struct bufpool_s {
+  unsigned char* memory;	// backing store for every pooled buffer
+  buf_t* free[BUFPOOL_CLASSES];
+  int in_use;			// buffers handed out
+  int high_water;		// most buffers ever handed out at once
+  unsigned long allocs;		// buffers handed out in total
+  unsigned long fallbacks;	// requests the pool could not serve
+
+  // acquire before using free lists or counters
+  pthread_mutex_t mutex;
+} bufpool_t;
+
+int bufpool_init(bufpool_t* pool);
+void bufpool_delete(bufpool_t* pool);
+
+// Process wide pool shared by every queue
+bufpool_t* bufpool_default(void);
+
+// Returns a buffer of at least len bytes holding one reference, NULL on
+// failure. Only falls back to malloc when the size class is exhausted.
+buf_t* buf_alloc(bufpool_t* pool, int len);
+
+// Take another reference to buf, returns buf
+buf_t* buf_ref(buf_t* buf);
+
+// Drop a reference, the last one returns buf to its pool
+void buf_release(buf_t* buf);
+
+#endif
@@ -0,0 +1,422 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "common.h"
+#include "device_gmsk.h"
+
+static void
+capture_put(unsigned char* buf, unsigned long long value, int bytes)
+{
+  int i;
+
+  for (i = 0; i < bytes; i++) {
+    buf[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static unsigned long long
+capture_get(unsigned char* buf, int bytes)
+{
+  unsigned long long value = 0;
+  int i;
+
+  for (i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+// Add a stream for each GMSK header and count the frames of each
+// stream, looking back only a few streams since data follows its header
+static int
+capture_index_frame(capture_stream_t** streams, int* count, int* alloc,
+                    unsigned long long offset, unsigned long long time_us,
+                    unsigned char* buf, int buf_bytes)
+{
+  capture_stream_t* s;
+  unsigned int header;
+  int stream_id;
+  int i;
+
+  if (buf_bytes < 4) return TRUE;
+  header = (buf[1] << 8) + buf[0];
+  stream_id = (buf[3] << 8) + buf[2];
+
+  if (header == 0xA02F && buf_bytes == GMSK_HEADER_BYTES) {
+    if (*count == *alloc) {
+      *alloc = *alloc ? *alloc * 2 : 64;
+      s = realloc(*streams, *alloc * sizeof(capture_stream_t));
+      if (!s) {
+        fprintf(stderr, "capture_index_frame - out of memory\n");
+        return FALSE;
+      }
+      *streams = s;
+    }
+    s = &((*streams)[(*count)++]);
+    s->offset = offset;
+    s->time_us = time_us;
+    s->stream_id = stream_id;
+    s->frames = 1;
+  }
+  else if (header == 0xC012 && buf_bytes == GMSK_DATA_BYTES) {
+    for (i = *count - 1; i >= 0 && i >= *count - 8; i--) {
+      if ((*streams)[i].stream_id == stream_id) {
+        (*streams)[i].frames++;
+        break;
+      }
+    }
+  }
+  return TRUE;
+}
+
+static int
+capture_write_all(int fd, unsigned char* buf, int buf_bytes)
+{
+  int written = 0;
+  int n;
+
+  while (written < buf_bytes) {
+    n = write(fd, &buf[written], buf_bytes - written);
+    if (n <= 0) {
+      fprintf(stderr, "capture_write_all - error writing capture\n");
+      return FALSE;
+    }
+    written += n;
+  }
+  return TRUE;
+}
+
+int
+capture_create(capture_writer_t* w, char* path)
+{
+  struct timespec ts;
+
+  memset(w, 0, sizeof(capture_writer_t));
+  w->buf = malloc(CAPTURE_BUFFER_BYTES);
+  if (!w->buf) {
+    fprintf(stderr, "capture_create - out of memory\n");
+    return FALSE;
+  }
+
+  w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w->fd < 0) {
+    fprintf(stderr, "capture_create - error opening %s\n", path);
+    free(w->buf);
+    return FALSE;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  w->start_us = now_us();
+  memcpy(w->buf, CAPTURE_MAGIC, 8);
+  capture_put(&(w->buf[8]), (unsigned long long)ts.tv_sec * 1000000ULL +
+              ts.tv_nsec / 1000, 8);
+  capture_put(&(w->buf[16]), w->start_us, 8);
+  w->buf_bytes = CAPTURE_HEADER_BYTES;
+  w->offset = CAPTURE_HEADER_BYTES;
+  return TRUE;
+}
+
+int
+capture_flush(capture_writer_t* w)
+{
+  int ok = capture_write_all(w->fd, w->buf, w->buf_bytes);
+
+  w->buf_bytes = 0;
+  return ok;
+}
+
+int
+capture_write(capture_writer_t* w, int source, unsigned char* buf,
+              int buf_bytes)
+{
+  unsigned long long time_us = now_us() - w->start_us;
+  unsigned char* rec;
+
+  if (buf_bytes <= 0 || buf_bytes > CAPTURE_MAX_FRAME) {
+    return FALSE;
+  }
+
+  // Frames are appended to the buffer and written out in large blocks
+  if (w->buf_bytes + CAPTURE_RECORD_BYTES + buf_bytes > CAPTURE_BUFFER_BYTES) {
+    if (!capture_flush(w)) {
+      return FALSE;
+    }
+  }
+
+  rec = &(w->buf[w->buf_bytes]);
+  capture_put(rec, time_us, 8);
+  capture_put(&rec[8], buf_bytes, 2);
+  rec[10] = source;
+  rec[11] = 0;
+  capture_put(&rec[12], w->records, 4);
+  memcpy(&rec[CAPTURE_RECORD_BYTES], buf, buf_bytes);
+  w->buf_bytes += CAPTURE_RECORD_BYTES + buf_bytes;
+
+  if (!capture_index_frame(&(w->streams), &(w->stream_count),
+                           &(w->stream_alloc), w->offset, time_us, buf,
+                           buf_bytes)) {
+    return FALSE;
+  }
+  w->offset += CAPTURE_RECORD_BYTES + buf_bytes;
+  w->records++;
+  return TRUE;
+}
+
+int
+capture_close(capture_writer_t* w)
+{
+  unsigned long long index_offset = w->offset;
+  unsigned char* e;
+  int ok = TRUE;
+  int i;
+
+  for (i = 0; i < w->stream_count && ok; i++) {
+    if (w->buf_bytes + CAPTURE_INDEX_BYTES > CAPTURE_BUFFER_BYTES) {
+      ok = capture_flush(w);
+    }
+    e = &(w->buf[w->buf_bytes]);
+    capture_put(e, w->streams[i].offset, 8);
+    capture_put(&e[8], w->streams[i].time_us, 8);
+    capture_put(&e[16], w->streams[i].stream_id, 2);
+    capture_put(&e[18], 0, 2);
+    capture_put(&e[20], w->streams[i].frames, 4);
+    w->buf_bytes += CAPTURE_INDEX_BYTES;
+  }
+
+  if (ok && w->buf_bytes + CAPTURE_FOOTER_BYTES > CAPTURE_BUFFER_BYTES) {
+    ok = capture_flush(w);
+  }
+  if (ok) {
+    e = &(w->buf[w->buf_bytes]);
+    memcpy(e, CAPTURE_INDEX_MAGIC, 8);
+    capture_put(&e[8], index_offset, 8);
+    capture_put(&e[16], w->stream_count, 4);
+    capture_put(&e[20], 0, 4);
+    w->buf_bytes += CAPTURE_FOOTER_BYTES;
+    ok = capture_flush(w);
+  }
+
+  close(w->fd);
+  free(w->buf);
+  free(w->streams);
+  w->buf = NULL;
+  w->streams = NULL;
+  return ok;
+}
+
+// Use the index written by capture_close if the footer agrees with the
+// size of the file
+static int
+capture_load_index(capture_reader_t* r)
+{
+  unsigned char* footer;
+  unsigned char* e;
+  unsigned long long index_offset;
+  unsigned long entries;
+  int i;
+
+  if (r->map_bytes < CAPTURE_HEADER_BYTES + CAPTURE_FOOTER_BYTES) {
+    return FALSE;
+  }
+  footer = &(r->map[r->map_bytes - CAPTURE_FOOTER_BYTES]);
+  if (memcmp(footer, CAPTURE_INDEX_MAGIC, 8)) {
+    return FALSE;
+  }
+  index_offset = capture_get(&footer[8], 8);
+  entries = capture_get(&footer[16], 4);
+  if (index_offset < CAPTURE_HEADER_BYTES ||
+      index_offset + (unsigned long long)entries * CAPTURE_INDEX_BYTES +
+      CAPTURE_FOOTER_BYTES != r->map_bytes) {
+    return FALSE;
+  }
+
+  r->streams = calloc(entries ? entries : 1, sizeof(capture_stream_t));
+  if (!r->streams) {
+    return FALSE;
+  }
+  for (i = 0; i < entries; i++) {
+    e = &(r->map[index_offset + (unsigned long long)i * CAPTURE_INDEX_BYTES]);
+    r->streams[i].offset = capture_get(e, 8);
+    r->streams[i].time_us = capture_get(&e[8], 8);
+    r->streams[i].stream_id = capture_get(&e[16], 2);
+    r->streams[i].frames = capture_get(&e[20], 4);
+  }
+  r->stream_count = entries;
+  r->data_end = index_offset;
+  return TRUE;
+}
+
+static int
+capture_build_index(capture_reader_t* r)
+{
+  capture_frame_t frame;
+  int alloc = 0;
+
+  r->streams = NULL;
+  r->stream_count = 0;
+  while (capture_next(r, &frame)) {
+    if (!capture_index_frame(&(r->streams), &(r->stream_count), &alloc,
+                             frame.offset, frame.time_us, frame.buf,
+                             frame.buf_bytes)) {
+      return FALSE;
+    }
+  }
+  return capture_seek(r, r->data_start);
+}
+
+int
+capture_open(capture_reader_t* r, char* path)
+{
+  struct stat st;
+  int fd;
+
+  memset(r, 0, sizeof(capture_reader_t));
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "capture_open - error opening %s\n", path);
+    return FALSE;
+  }
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "capture_open - error reading size of %s\n", path);
+    close(fd);
+    return FALSE;
+  }
+
+  r->map_bytes = st.st_size;
+  if (r->map_bytes > 0) {
+    r->map = mmap(NULL, r->map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (r->map == MAP_FAILED) {
+      fprintf(stderr, "capture_open - error mapping %s\n", path);
+      r->map = NULL;
+      close(fd);
+      return FALSE;
+    }
+  }
+  close(fd);
+
+  r->data_end = r->map_bytes;
+  if (r->map_bytes >= CAPTURE_HEADER_BYTES &&
+      !memcmp(r->map, CAPTURE_MAGIC, 8)) {
+    r->start_realtime_us = capture_get(&(r->map[8]), 8);
+    r->data_start = CAPTURE_HEADER_BYTES;
+  }
+  else {
+    r->raw = TRUE;
+  }
+  r->pos = r->data_start;
+
+  if (!r->raw && capture_load_index(r)) {
+    return TRUE;
+  }
+  if (!capture_build_index(r)) {
+    capture_unmap(r);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void
+capture_unmap(capture_reader_t* r)
+{
+  if (r->map) {
+    munmap(r->map, r->map_bytes);
+  }
+  free(r->streams);
+  r->map = NULL;
+  r->streams = NULL;
+  r->stream_count = 0;
+}
+
+int
+capture_next(capture_reader_t* r, capture_frame_t* frame)
+{
+  unsigned char* rec = &(r->map[r->pos]);
+  int len;
+
+  if (r->raw) {
+    if (r->pos + 2 > r->data_end) return FALSE;
+    len = rec[0] + ((rec[1] & 0x1F) << 8);
+    if (len < 2 || r->pos + len > r->data_end) return FALSE;
+
+    frame->offset = r->pos;
+    frame->time_us = 0;
+    frame->source = CAPTURE_SRC_UNKNOWN;
+    frame->sender = 0;
+    frame->record = r->record++;
+    frame->buf = rec;
+    frame->buf_bytes = len;
+    r->pos += len;
+    return TRUE;
+  }
+
+  if (r->pos + CAPTURE_RECORD_BYTES > r->data_end) return FALSE;
+  len = capture_get(&rec[8], 2);
+  if (len <= 0 || r->pos + CAPTURE_RECORD_BYTES + len > r->data_end) {
+    return FALSE;
+  }
+
+  frame->offset = r->pos;
+  frame->time_us = capture_get(rec, 8);
+  frame->source = rec[10];
+  frame->sender = rec[11];
+  frame->record = capture_get(&rec[12], 4);
+  frame->buf = &rec[CAPTURE_RECORD_BYTES];
+  frame->buf_bytes = len;
+  r->pos += CAPTURE_RECORD_BYTES + len;
+  r->record = frame->record + 1;
+  return TRUE;
+}
+
+int
+capture_seek(capture_reader_t* r, unsigned long long offset)
+{
+  if (offset < r->data_start || offset > r->data_end) {
+    fprintf(stderr, "capture_seek - offset %llu outside the capture\n",
+            offset);
+    return FALSE;
+  }
+  r->pos = offset;
+  if (r->raw) {
+    r->record = 0;
+  }
+  return TRUE;
+}
+
+capture_stream_t*
+capture_find_stream(capture_reader_t* r, int stream_id)
+{
+  int i;
+
+  for (i = r->stream_count - 1; i >= 0; i--) {
+    if (r->streams[i].stream_id == stream_id) {
+      return &(r->streams[i]);
+    }
+  }
+  return NULL;
+}
+
+char*
+capture_source_name(int source)
+{
+  switch (source) {
+  case CAPTURE_SRC_DVAP_RX:
+    return "dvap rx";
+  case CAPTURE_SRC_DVAP_TX:
+    return "dvap tx";
+  case CAPTURE_SRC_NET_RX:
+    return "net rx";
+  case CAPTURE_SRC_NET_TX:
+    return "net tx";
+  case CAPTURE_SRC_SERVER:
+    return "server";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,111 @@
+// Capture files of DVAP frames. A file header is followed by one
+// record per frame, each with a monotonic timestamp and a tag saying
+// where the frame was seen, and closed by an index of the streams in
+// the file. Files are read through mmap so tools can seek straight to
+// a stream. Raw dumps of concatenated frames from older tools can
+// still be read, without timestamps.
+//
+// All fields are little endian.
+//   file header  "DVCAPTR1", u64 start realtime us, u64 start monotonic us
+//   record       u64 us since start, u16 frame bytes, u8 source,
+//                u8 sender, u32 record number, frame
+//   index entry  u64 record offset, u64 us since start, u16 stream_id,
+//                u16 reserved, u32 frames
+//   footer       "DVINDEX1", u64 index offset, u32 entries, u32 reserved
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+
+#define CAPTURE_MAGIC "DVCAPTR1"
+#define CAPTURE_INDEX_MAGIC "DVINDEX1"
+
+#define CAPTURE_HEADER_BYTES 24
+#define CAPTURE_RECORD_BYTES 16
+#define CAPTURE_INDEX_BYTES 24
+#define CAPTURE_FOOTER_BYTES 24
+
+#define CAPTURE_BUFFER_BYTES (256 * 1024)	// writes are batched this large
+#define CAPTURE_MAX_FRAME 8191
+
+// Where a frame was captured
+#define CAPTURE_SRC_UNKNOWN  0
+#define CAPTURE_SRC_DVAP_RX  1
+#define CAPTURE_SRC_DVAP_TX  2
+#define CAPTURE_SRC_NET_RX   3
+#define CAPTURE_SRC_NET_TX   4
+#define CAPTURE_SRC_SERVER   5	// archived by the server
+
+// One stream, located by the offset of its header record
+typedef struct {
+  unsigned long long offset;
+  unsigned long long time_us;
+  int stream_id;
+  unsigned long frames;			// header and data records
+} capture_stream_t;
+
+typedef struct {
+  int fd;
+  unsigned long long start_us;		// now_us() when the file was created
+  unsigned long long offset;		// file offset of the next record
+  unsigned long records;
+
+  unsigned char* buf;
+  int buf_bytes;
+
+  capture_stream_t* streams;
+  int stream_count;
+  int stream_alloc;
+} capture_writer_t;
+
+typedef struct {
+  unsigned char* map;
+  size_t map_bytes;
+  int raw;				// no header, records or timestamps
+  unsigned long long start_realtime_us;
+
+  size_t data_start;			// offset of the first record
+  size_t data_end;			// offset of the index or end of file
+  size_t pos;				// offset of the next record
+  unsigned long record;			// number of the next record
+
+  capture_stream_t* streams;
+  int stream_count;
+} capture_reader_t;
+
+typedef struct {
+  unsigned long long offset;		// of the record
+  unsigned long long time_us;		// since the start of the capture
+  int source;
+  int sender;				// numbered by the writer, 0 if unknown
+  unsigned long record;
+  unsigned char* buf;			// points into the mapped file
+  int buf_bytes;
+} capture_frame_t;
+
+// Writers are not locked, use one from a single thread
+int capture_create(capture_writer_t* w, char* path);
+int capture_write(capture_writer_t* w, int source, unsigned char* buf,
+                  int buf_bytes);
+int capture_flush(capture_writer_t* w);
+
+// Flush, append the stream index and close the file
+int capture_close(capture_writer_t* w);
+
+// Map a capture or raw dump. The stream index is read from the footer,
+// or rebuilt by scanning when the file was not closed cleanly.
+int capture_open(capture_reader_t* r, char* path);
+void capture_unmap(capture_reader_t* r);
+
+// Next frame in file order, FALSE at the end or on a corrupt record
+int capture_next(capture_reader_t* r, capture_frame_t* frame);
+
+// Continue reading from a record offset, such as one from the index
+int capture_seek(capture_reader_t* r, unsigned long long offset);
+
+// Last stream in the file with this stream_id, or NULL
+capture_stream_t* capture_find_stream(capture_reader_t* r, int stream_id);
+
+char* capture_source_name(int source);
+
+#endif
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include "common.h"
 
@@ -7,6 +9,44 @@ void sleep_ms(int milliseconds)
   usleep(milliseconds * 1000);
 }
 
+unsigned long long
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+cond_wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                unsigned long long deadline_us)
+{
+  struct timespec ts;
+  unsigned long long now = now_us();
+  unsigned long long nsec;
+
+  if (now >= deadline_us) return FALSE;
+
+  // Condition variables time out against the realtime clock
+  clock_gettime(CLOCK_REALTIME, &ts);
+  nsec = ts.tv_nsec + (deadline_us - now) * 1000ULL;
+  ts.tv_sec += nsec / 1000000000ULL;
+  ts.tv_nsec = nsec % 1000000000ULL;
+
+  if (pthread_cond_timedwait(cond, mutex, &ts) == ETIMEDOUT) {
+    return (now_us() < deadline_us);
+  }
+  return TRUE;
+}
+
 void
 hex_dump(char* prefix, unsigned char* buf, int buf_len)
 {
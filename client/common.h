@@ -1,15 +1,16 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <pthread.h>
 #include <stdio.h>
 
-// Set to 0 to disable, 1 to enable
-#define DEBUG 0
+#include "log.h"
 
+// Enabled at runtime with log_set_level(LOG_DEBUG)
 // http://stackoverflow.com/questions/1644868/c-define-macro-for-debug-printing
 #define debug_print(fmt, ...) \
-  do { if (DEBUG) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__,         \
-                          __LINE__, __func__, __VA_ARGS__); } while (0)
+  LOG(LOG_DEBUG, "%s:%d:%s(): " fmt, __FILE__, __LINE__, __func__,     \
+      __VA_ARGS__)
 
 #ifndef FALSE
 #define FALSE (0)
@@ -19,6 +20,17 @@
 #endif
 
 void sleep_ms(int milliseconds);
+
+// Monotonic clock in microseconds, used for pacing and timeouts
+unsigned long long now_us(void);
+
+// Monotonic clock in nanoseconds, for timing short calls
+unsigned long long now_ns(void);
+
+// Wait on cond until signalled or the now_us() deadline passes, returns
+// FALSE once the deadline has passed
+int cond_wait_until(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                    unsigned long long deadline_us);
 void hex_dump(char* prefix, unsigned char* buf, int buf_len);
 
 // Read DVAP packet - shared by device and network code
@@ -1,30 +1,32 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "device.h"
+#include "metrics.h"
 #include "serial.h"
 
+static void dvap_evloop_expire(void* arg);
+
 int
 get_name(device_t* ctx, char* name, int name_len)
 {
-  int sent, ret;
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  int ret;
+  unsigned char buf[DVAP_CMD_MAX_RESP_BYTES];
 
   if (!ctx) return FALSE;
 
-  sent = dvap_write(ctx, DVAP_MSG_HOST_REQ_CTRL_ITEM,
-                    DVAP_CTRL_TARGET_NAME, NULL, 0);
-  if (sent <= 0) {
-    debug_print("%s\n", "get_name: error on dvap_write");
+  if (dvap_cmd(ctx, DVAP_MSG_HOST_REQ_CTRL_ITEM, DVAP_CTRL_TARGET_NAME,
+               NULL, 0, buf, &ret) != DVAP_CMD_OK) {
+    debug_print("%s\n", "get_name: no response from device");
     return FALSE;
   }
 
-  queue_remove(&(ctx->rxq), buf, &ret);
   ret -= 2;
   ret = (ret <= name_len) ? ret : name_len;
   strncpy(name, (const char *)&buf[2], ret);
@@ -32,211 +34,312 @@ get_name(device_t* ctx, char* name, int name_len)
   return TRUE;
 }
 
-int
-set_run_state(device_t* ctx, char state)
+// Send a setting and wait for the device to echo it back
+static int
+dvap_cmd_set(device_t* ctx, int command, unsigned char* payload,
+             int payload_bytes)
 {
-  int sent, ret;
-  unsigned char payload[1];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
-
   if (!ctx) return FALSE;
 
-  payload[0] = state;
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_RUN_STATE,
-                    payload, 1);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_run_state: error on dvap_write");
+  if (dvap_cmd(ctx, DVAP_MSG_HOST_SET_CTRL, command, payload, payload_bytes,
+               NULL, NULL) != DVAP_CMD_OK) {
+    debug_print("no response to command 0x%04X\n", command);
     return FALSE;
   }
+  return TRUE;
+}
 
-  queue_remove(&(ctx->rxq), buf, &ret);
+int
+set_run_state(device_t* ctx, char state)
+{
+  unsigned char payload[1];
 
-  return TRUE;
+  payload[0] = state;
+  return dvap_cmd_set(ctx, DVAP_CTRL_RUN_STATE, payload, 1);
 }
 
 int
 set_modulation_type(device_t* ctx, char modulation)
 {
-  int sent, ret;
   unsigned char payload[1];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
-
-  if (!ctx) return FALSE;
 
   payload[0] = modulation;
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_MODULATION_TYPE,
-                    payload, 1);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_modulation_type: error on dvap_write");
-    return FALSE;
-  }
-
-  queue_remove(&(ctx->rxq), buf, &ret);
-
-  return TRUE;
+  return dvap_cmd_set(ctx, DVAP_CTRL_MODULATION_TYPE, payload, 1);
 }
 
 int
 set_operation_mode(device_t* ctx, char mode)
 {
-  int sent, ret;
   unsigned char payload[1];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
-
-  if (!ctx) return FALSE;
 
   payload[0] = mode;
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_OPERATION_MODE,
-                    payload, 1);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_operation_mode: error on dvap_write");
-    return FALSE;
-  }
-
-  queue_remove(&(ctx->rxq), buf, &ret);
-
-  return TRUE;
+  return dvap_cmd_set(ctx, DVAP_CTRL_OPERATION_MODE, payload, 1);
 }
 
 int
 set_squelch_threshold(device_t* ctx, int dbm)
 {
-  int sent, ret;
   int squelch = dbm;
   unsigned char payload[1];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
-
-  if (!ctx) return FALSE;
 
   squelch = (dbm < DVAP_SQUELCH_MIN) ? DVAP_SQUELCH_MIN : squelch;
   squelch = (dbm < DVAP_SQUELCH_MAX) ? DVAP_SQUELCH_MAX : squelch;
 
   payload[0] = squelch & 0xFF;
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_SQUELCH_THRESH,
-                    payload, 1);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_squelch_threshold: error on dvap_write");
-    return FALSE;
-  }
-
-  queue_remove(&(ctx->rxq), buf, &ret);
+  return dvap_cmd_set(ctx, DVAP_CTRL_SQUELCH_THRESH, payload, 1);
+}
 
-  return TRUE;
+static void
+dvap_put_freq(unsigned char* payload, unsigned int hz)
+{
+  payload[0] = hz & 0xFF;
+  payload[1] = (hz >> 8) & 0xFF;
+  payload[2] = (hz >> 16) & 0xFF;
+  payload[3] = (hz >> 24) & 0xFF;
 }
 
 int
 set_rx_frequency(device_t* ctx, unsigned int hz)
 {
-  int sent, ret;
   unsigned char payload[4];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
 
-  if (!ctx) return FALSE;
+  dvap_put_freq(payload, hz);
+  return dvap_cmd_set(ctx, DVAP_CTRL_RX_FREQ, payload, 4);
+}
 
-  payload[0] = hz & 0xFF;
-  payload[1] = (hz >> 8) & 0xFF;
-  payload[2] = (hz >> 16) & 0xFF;
-  payload[3] = (hz >> 24) & 0xFF;
+int
+set_tx_frequency(device_t* ctx, unsigned int hz)
+{
+  unsigned char payload[4];
 
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_RX_FREQ,
-                    payload, 4);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_rx_frequency: error on dvap_write");
-    return FALSE;
-  }
+  dvap_put_freq(payload, hz);
+  return dvap_cmd_set(ctx, DVAP_CTRL_TX_FREQ, payload, 4);
+}
 
-  queue_remove(&(ctx->rxq), buf, &ret);
+int
+set_rxtx_frequency(device_t* ctx, unsigned int hz)
+{
+  unsigned char payload[4];
 
-  return TRUE;
+  dvap_put_freq(payload, hz);
+  return dvap_cmd_set(ctx, DVAP_CTRL_TX_RX_FREQ, payload, 4);
 }
 
 int
-set_tx_frequency(device_t* ctx, unsigned int hz)
+set_tx_power(device_t* ctx, int dbm)
 {
-  int sent, ret;
-  unsigned char payload[4];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  int power;
+  unsigned char payload[2];
 
-  if (!ctx) return FALSE;
+  power = (dbm < DVAP_TX_POWER_MIN) ? DVAP_TX_POWER_MIN : dbm;
+  power = (dbm > DVAP_TX_POWER_MAX) ? DVAP_TX_POWER_MAX : dbm;
 
-  payload[0] = hz & 0xFF;
-  payload[1] = (hz >> 8) & 0xFF;
-  payload[2] = (hz >> 16) & 0xFF;
-  payload[3] = (hz >> 24) & 0xFF;
+  payload[0] = power & 0xFF;
+  payload[1] = (power >> 8) & 0xFF;
+  return dvap_cmd_set(ctx, DVAP_CTRL_TX_POWER, payload, 2);
+}
 
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_TX_FREQ,
-                    payload, 4);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_tx_frequency: error on dvap_write");
-    return FALSE;
-  }
+dvap_cmd_t*
+dvap_cmd_send(device_t* ctx, char msg_type, int command,
+              unsigned char* payload, int payload_bytes, int timeout_ms,
+              dvap_cmd_fptr callback, void* arg)
+{
+  dvap_cmd_t* cmd = NULL;
+  int i;
 
-  queue_remove(&(ctx->rxq), buf, &ret);
+  if (!ctx) return NULL;
 
-  return TRUE;
+  // Register before writing so a fast reply can't beat us to the table
+  pthread_mutex_lock(&(ctx->cmd_mutex));
+  for (i = 0; i < DVAP_CMD_MAX_PENDING; i++) {
+    if (!ctx->cmds[i].in_use) {
+      cmd = &(ctx->cmds[i]);
+      break;
+    }
+  }
+  if (!cmd) {
+    pthread_mutex_unlock(&(ctx->cmd_mutex));
+    fprintf(stderr, "dvap_cmd_send - too many commands in flight\n");
+    return NULL;
+  }
+  cmd->in_use = TRUE;
+  cmd->command = command;
+  cmd->seq = ctx->cmd_seq++;
+  cmd->deadline_us = now_us() + timeout_ms * 1000ULL;
+  cmd->callback = callback;
+  cmd->arg = arg;
+  cmd->status = DVAP_CMD_PENDING;
+  cmd->resp_len = 0;
+  pthread_mutex_unlock(&(ctx->cmd_mutex));
+
+  if (dvap_write(ctx, msg_type, command, payload, payload_bytes) <= 0) {
+    debug_print("dvap_cmd_send: error writing command 0x%04X\n", command);
+    pthread_mutex_lock(&(ctx->cmd_mutex));
+    cmd->in_use = FALSE;
+    pthread_mutex_unlock(&(ctx->cmd_mutex));
+    return NULL;
+  }
+
+  // With an event loop nothing polls for timeouts, so wake up for them.
+  // Callers of dvap_cmd_wait() time out on their own.
+  if (callback && ctx->loop && ctx->cmd_timer >= 0) {
+    dvap_evloop_expire(ctx);
+  }
+  return cmd;
 }
 
 int
-set_rxtx_frequency(device_t* ctx, unsigned int hz)
+dvap_cmd_wait(device_t* ctx, dvap_cmd_t* cmd, unsigned char* buf,
+              int* buf_len)
 {
-  int sent, ret;
-  unsigned char payload[4];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  int status;
 
-  if (!ctx) return FALSE;
-
-  payload[0] = hz & 0xFF;
-  payload[1] = (hz >> 8) & 0xFF;
-  payload[2] = (hz >> 16) & 0xFF;
-  payload[3] = (hz >> 24) & 0xFF;
+  if (!ctx || !cmd) return DVAP_CMD_ERROR;
 
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_TX_RX_FREQ,
-                    payload, 4);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_rxtx_frequency: error on dvap_write");
-    return FALSE;
+  pthread_mutex_lock(&(ctx->cmd_mutex));
+  while (cmd->status == DVAP_CMD_PENDING) {
+    if (!cond_wait_until(&(ctx->cmd_done), &(ctx->cmd_mutex),
+                         cmd->deadline_us)) {
+      cmd->status = DVAP_CMD_TIMEOUT;
+      ctx->cmd_timeouts += 1;
+    }
   }
 
-  queue_remove(&(ctx->rxq), buf, &ret);
+  status = cmd->status;
+  if (status == DVAP_CMD_OK && buf) {
+    memcpy(buf, cmd->resp, cmd->resp_len);
+  }
+  if (buf_len) {
+    *buf_len = (status == DVAP_CMD_OK) ? cmd->resp_len : 0;
+  }
+  cmd->in_use = FALSE;
+  pthread_mutex_unlock(&(ctx->cmd_mutex));
 
-  return TRUE;
+  return status;
 }
 
 int
-set_tx_power(device_t* ctx, int dbm)
+dvap_cmd(device_t* ctx, char msg_type, int command, unsigned char* payload,
+         int payload_bytes, unsigned char* buf, int* buf_len)
 {
-  int sent, ret;
-  int power;
-  unsigned char payload[2];
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  dvap_cmd_t* cmd;
 
-  if (!ctx) return FALSE;
+  cmd = dvap_cmd_send(ctx, msg_type, command, payload, payload_bytes,
+                      DVAP_CMD_TIMEOUT_MS, NULL, NULL);
+  if (!cmd) return DVAP_CMD_ERROR;
+  return dvap_cmd_wait(ctx, cmd, buf, buf_len);
+}
 
-  power = (dbm < DVAP_TX_POWER_MIN) ? DVAP_TX_POWER_MIN : dbm;
-  power = (dbm > DVAP_TX_POWER_MAX) ? DVAP_TX_POWER_MAX : dbm;
+void
+dvap_cmd_complete(device_t* ctx, unsigned char* buf, int buf_len)
+{
+  dvap_cmd_t* cmd = NULL;
+  dvap_cmd_fptr callback;
+  void* arg;
+  int command, i;
+
+  if (buf_len < 2) return;
+  command = buf[0] + (buf[1] << 8);
+
+  pthread_mutex_lock(&(ctx->cmd_mutex));
+  for (i = 0; i < DVAP_CMD_MAX_PENDING; i++) {
+    if (ctx->cmds[i].in_use && ctx->cmds[i].status == DVAP_CMD_PENDING &&
+        ctx->cmds[i].command == command &&
+        (!cmd || ctx->cmds[i].seq < cmd->seq)) {
+      cmd = &(ctx->cmds[i]);
+    }
+  }
+  if (!cmd) {
+    pthread_mutex_unlock(&(ctx->cmd_mutex));
+    debug_print("unexpected response to command 0x%04X\n", command);
+    return;
+  }
 
-  payload[0] = power & 0xFF;
-  payload[1] = (power >> 8) & 0xFF;
+  if (buf_len > DVAP_CMD_MAX_RESP_BYTES) {
+    fprintf(stderr, "dvap_cmd_complete - response truncated to %d bytes\n",
+            DVAP_CMD_MAX_RESP_BYTES);
+    buf_len = DVAP_CMD_MAX_RESP_BYTES;
+  }
+  memcpy(cmd->resp, buf, buf_len);
+  cmd->resp_len = buf_len;
+  cmd->status = DVAP_CMD_OK;
+
+  callback = cmd->callback;
+  arg = cmd->arg;
+  if (callback) {
+    // Nobody will wait on this one, free the slot before calling back
+    cmd->in_use = FALSE;
+  }
+  pthread_cond_broadcast(&(ctx->cmd_done));
+  pthread_mutex_unlock(&(ctx->cmd_mutex));
 
-  sent = dvap_write(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_TX_RX_FREQ,
-                    payload, 2);
-  if (sent <= 0) {
-    debug_print("%s\n", "set_tx_power: error on dvap_write");
-    return FALSE;
+  if (callback) {
+    (callback)(arg, DVAP_CMD_OK, buf, buf_len);
   }
+}
 
-  queue_remove(&(ctx->rxq), buf, &ret);
+unsigned long long
+dvap_cmd_expire(device_t* ctx)
+{
+  dvap_cmd_fptr callbacks[DVAP_CMD_MAX_PENDING];
+  void* args[DVAP_CMD_MAX_PENDING];
+  unsigned long long now = now_us();
+  unsigned long long next = 0;
+  int expired = 0;
+  int i;
+
+  pthread_mutex_lock(&(ctx->cmd_mutex));
+  for (i = 0; i < DVAP_CMD_MAX_PENDING; i++) {
+    dvap_cmd_t* cmd = &(ctx->cmds[i]);
+    if (!cmd->in_use || cmd->status != DVAP_CMD_PENDING) continue;
+
+    if (cmd->deadline_us > now) {
+      if (!next || cmd->deadline_us < next) {
+        next = cmd->deadline_us;
+      }
+      continue;
+    }
 
-  return TRUE;
+    // Waiters notice their own deadline, only finish callback commands
+    if (cmd->callback) {
+      callbacks[expired] = cmd->callback;
+      args[expired] = cmd->arg;
+      expired += 1;
+      cmd->status = DVAP_CMD_TIMEOUT;
+      cmd->in_use = FALSE;
+      ctx->cmd_timeouts += 1;
+    }
+  }
+  pthread_mutex_unlock(&(ctx->cmd_mutex));
+
+  for (i = 0; i < expired; i++) {
+    (callbacks[i])(args[i], DVAP_CMD_TIMEOUT, NULL, 0);
+  }
+  return next;
 }
 
+static void dvap_evloop_read(void* arg);
+static void dvap_evloop_watchdog(void* arg);
+static void dvap_evloop_flush(void* arg);
+
 int
 dvap_init(device_t* ctx, char* portname, dvap_rx_fptr callback)
+{
+  return dvap_init_evloop(ctx, portname, callback, NULL);
+}
+
+int
+dvap_init_evloop(device_t* ctx, char* portname, dvap_rx_fptr callback,
+                 evloop_t* loop)
 {
   int fd;
   if (!ctx) return FALSE;
 
   ctx->callback = callback;
+  ctx->loop = loop;
+  ctx->watchdog_timer = -1;
+  ctx->flush_timer = -1;
+  ctx->cmd_timer = -1;
 
   // serial port
   fd = serial_open(portname, DVAP_BAUD);
@@ -244,6 +347,7 @@ dvap_init(device_t* ctx, char* portname, dvap_rx_fptr callback)
     return FALSE;
   }
   ctx->fd = fd;
+  framer_init(&(ctx->framer), fd);
 
   // shutdown variables
   ctx->shutdown = FALSE;
@@ -251,12 +355,46 @@ dvap_init(device_t* ctx, char* portname, dvap_rx_fptr callback)
 
   // transmitter variables
   pthread_mutex_init(&(ctx->tx_mutex), NULL);
+  ctx->tx_pending_len = 0;
+  ctx->tx_corked = FALSE;
+  ctx->tx_writes = 0;
+  ctx->tx_msgs = 0;
   pthread_mutex_init(&(ctx->ptt_mutex), NULL);
   ctx->ptt_active = FALSE;
 
-  // receive queue
-  queue_init(&(ctx->rxq));
-  pthread_create(&(ctx->rx_thread), NULL, dvap_read_loop, ctx);
+  // transmit flow control. Not SPSC, dvap_pkt_write has two producers:
+  // the jitter ticker, and the network reader for the non-GMSK frames
+  // the arbiter and jitter buffer pass straight through.
+  queue_init_backend(&(ctx->txq), QUEUE_BACKEND_MUTEX);
+  pthread_mutex_init(&(ctx->credit_mutex), NULL);
+  ctx->tx_credits = DVAP_TX_WINDOW_FRAMES;
+  ctx->tx_since_status = 0;
+  ctx->tx_credit_us = now_us();
+  ctx->tx_hdr_us = 0;
+  ctx->tx_dropped = 0;
+  ctx->tx_written = NULL;
+  ctx->tx_written_arg = NULL;
+
+  // control commands
+  memset(ctx->cmds, 0, sizeof(ctx->cmds));
+  pthread_mutex_init(&(ctx->cmd_mutex), NULL);
+  pthread_cond_init(&(ctx->cmd_done), NULL);
+  ctx->cmd_seq = 0;
+  ctx->cmd_timeouts = 0;
+
+  if (ctx->loop) {
+    ctx->flush_timer = evloop_add_timer(ctx->loop, 0, FALSE,
+                                        dvap_evloop_flush, ctx);
+    ctx->cmd_timer = evloop_add_timer(ctx->loop, 0, FALSE,
+                                      dvap_evloop_expire, ctx);
+    if (ctx->flush_timer < 0 || ctx->cmd_timer < 0 ||
+        !evloop_add_fd(ctx->loop, ctx->fd, dvap_evloop_read, ctx)) {
+      return FALSE;
+    }
+  }
+  else {
+    pthread_create(&(ctx->rx_thread), NULL, dvap_read_loop, ctx);
+  }
 
   return TRUE;
 }
@@ -271,7 +409,23 @@ dvap_start(device_t* ctx)
     return FALSE;
   }
 
-  pthread_create(&(ctx->watchdog_thread), NULL, dvap_watchdog_loop, ctx);
+  return dvap_start_watchdog(ctx);
+}
+
+int
+dvap_start_watchdog(device_t* ctx)
+{
+  if (!ctx) return FALSE;
+
+  if (ctx->loop) {
+    ctx->watchdog_timer = evloop_add_timer(ctx->loop,
+                                           DVAP_WATCHDOG_SECS * 1000, TRUE,
+                                           dvap_evloop_watchdog, ctx);
+    if (ctx->watchdog_timer < 0) return FALSE;
+  }
+  else {
+    pthread_create(&(ctx->watchdog_thread), NULL, dvap_watchdog_loop, ctx);
+  }
   return TRUE;
 }
 
@@ -279,12 +433,24 @@ void
 dvap_wait(device_t* ctx)
 {
   if (!ctx) return;
-  pthread_join(ctx->rx_thread, NULL);
-  pthread_join(ctx->watchdog_thread, NULL);
+  if (ctx->loop) {
+    evloop_remove_fd(ctx->loop, ctx->fd);
+    evloop_remove_fd(ctx->loop, ctx->watchdog_timer);
+    evloop_remove_fd(ctx->loop, ctx->flush_timer);
+    evloop_remove_fd(ctx->loop, ctx->cmd_timer);
+  }
+  else {
+    pthread_join(ctx->rx_thread, NULL);
+    pthread_join(ctx->watchdog_thread, NULL);
+  }
   close(ctx->fd);
 
+  queue_delete(&(ctx->txq));
   pthread_mutex_destroy(&(ctx->shutdown_mutex));
   pthread_mutex_destroy(&(ctx->tx_mutex));
+  pthread_mutex_destroy(&(ctx->credit_mutex));
+  pthread_mutex_destroy(&(ctx->cmd_mutex));
+  pthread_cond_destroy(&(ctx->cmd_done));
 }
 
 int
@@ -303,38 +469,255 @@ dvap_stop(device_t* ctx)
   return TRUE;
 }
 
-int
-dvap_pkt_write(device_t* ctx, unsigned char* buf, int buf_bytes)
+// Write staged control messages followed by iov in as few write calls
+// as the serial driver allows. Call with tx_mutex held.
+static int
+dvap_tx_writev(device_t* ctx, struct iovec* iov, int iovcnt, int msgs)
+{
+  struct iovec vec[DVAP_TX_WINDOW_FRAMES + 2];
+  struct iovec* v = vec;
+  int total = 0;
+  int cnt = 0;
+  int i, n;
+
+  if (iovcnt > DVAP_TX_WINDOW_FRAMES + 1) return -1;
+
+  if (ctx->tx_pending_len > 0) {
+    vec[cnt].iov_base = ctx->tx_pending;
+    vec[cnt].iov_len = ctx->tx_pending_len;
+    total += ctx->tx_pending_len;
+    cnt += 1;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    vec[cnt] = iov[i];
+    total += iov[i].iov_len;
+    cnt += 1;
+  }
+  if (total == 0) return 0;
+
+  n = total;
+  while (cnt > 0) {
+    i = writev(ctx->fd, v, cnt);
+    if (i <= 0) {
+      fprintf(stderr, "dvap_tx_writev - error writing to device\n");
+      ctx->tx_pending_len = 0;
+      return -1;
+    }
+    ctx->tx_writes += 1;
+
+    // Skip whatever the driver took and retry the rest
+    while (cnt > 0 && i >= v->iov_len) {
+      i -= v->iov_len;
+      v++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      v->iov_base = (unsigned char *)v->iov_base + i;
+      v->iov_len -= i;
+    }
+  }
+
+  ctx->tx_pending_len = 0;
+  ctx->tx_msgs += msgs;
+  METRIC_ADD(serial_tx_bytes, n);
+  return n;
+}
+
+// Write a raw message now, along with anything staged, unless corked
+static int
+dvap_tx_send(device_t* ctx, unsigned char* hdr, int hdr_bytes,
+             unsigned char* payload, int payload_bytes)
 {
+  struct iovec iov[2];
+  int bytes = hdr_bytes + payload_bytes;
   int n;
-  int sent_bytes = 0;
 
   pthread_mutex_lock(&(ctx->tx_mutex));
-  while (sent_bytes < buf_bytes) {
-    n = write(ctx->fd, &buf[sent_bytes], buf_bytes-sent_bytes);
-    if (DEBUG) {
-      printf("[%ld] dvap_pkt_write: %d bytes\n", time(NULL), buf_bytes);
-    }
-    if (n <= 0) {
+  if (ctx->tx_corked) {
+    if (ctx->tx_pending_len + bytes > DVAP_TX_PENDING_BYTES &&
+        dvap_tx_writev(ctx, NULL, 0, 0) < 0) {
       pthread_mutex_unlock(&(ctx->tx_mutex));
-      fprintf(stderr, "dvap_pkt_write - error writing to device\n");
       return -1;
     }
-    sent_bytes += n;
+    if (ctx->tx_pending_len + bytes <= DVAP_TX_PENDING_BYTES) {
+      memcpy(&(ctx->tx_pending[ctx->tx_pending_len]), hdr, hdr_bytes);
+      if (payload_bytes > 0) {
+        memcpy(&(ctx->tx_pending[ctx->tx_pending_len + hdr_bytes]), payload,
+               payload_bytes);
+      }
+      ctx->tx_pending_len += bytes;
+      ctx->tx_msgs += 1;
+      pthread_mutex_unlock(&(ctx->tx_mutex));
+      return bytes;
+    }
   }
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = hdr_bytes;
+  iov[1].iov_base = payload;
+  iov[1].iov_len = payload_bytes;
+  n = dvap_tx_writev(ctx, iov, (payload_bytes > 0) ? 2 : 1, 1);
   pthread_mutex_unlock(&(ctx->tx_mutex));
-  return sent_bytes;
+  return (n < 0) ? -1 : bytes;
+}
+
+void
+dvap_tx_cork(device_t* ctx)
+{
+  if (!ctx) return;
+  pthread_mutex_lock(&(ctx->tx_mutex));
+  ctx->tx_corked = TRUE;
+  pthread_mutex_unlock(&(ctx->tx_mutex));
+}
+
+int
+dvap_tx_uncork(device_t* ctx)
+{
+  int n;
+
+  if (!ctx) return -1;
+  pthread_mutex_lock(&(ctx->tx_mutex));
+  ctx->tx_corked = FALSE;
+  n = dvap_tx_writev(ctx, NULL, 0, 0);
+  pthread_mutex_unlock(&(ctx->tx_mutex));
+  return n;
+}
+
+int
+dvap_pkt_write(device_t* ctx, unsigned char* buf, int buf_bytes)
+{
+  unsigned long long start = now_ns();
+  buf_t* pkt;
+  int ret = -1;
+
+  if (!ctx) return -1;
+  if (buf_bytes > DVAP_MSG_MAX_BYTES) return -1;
+
+  // The caller's buffer is reused for the next read, so this is the
+  // only copy the frame gets on its way to the serial port
+  pkt = buf_alloc(ctx->txq.pool, buf_bytes);
+  if (!pkt) goto done;
+  memcpy(pkt->data, buf, buf_bytes);
+  pkt->len = buf_bytes;
+
+  // Drop rather than block the caller when the device has fallen behind
+  if (!queue_try_insert_buf(&(ctx->txq), pkt)) {
+    buf_release(pkt);
+    pthread_mutex_lock(&(ctx->credit_mutex));
+    ctx->tx_dropped += 1;
+    pthread_mutex_unlock(&(ctx->credit_mutex));
+    METRIC_ADD(dvap_tx_dropped, 1);
+    debug_print("%s\n", "dvap_pkt_write: tx queue full, dropping packet");
+    goto done;
+  }
+  METRIC_SET(dvap_txq_depth, queue_count(&(ctx->txq)));
+
+  dvap_tx_flush(ctx);
+  ret = buf_bytes;
+
+done:
+  metrics_pkt_write(now_ns() - start);
+  return ret;
+}
+
+void
+dvap_set_tx_callback(device_t* ctx, dvap_tx_fptr callback, void* arg)
+{
+  if (!ctx) return;
+  pthread_mutex_lock(&(ctx->credit_mutex));
+  ctx->tx_written = callback;
+  ctx->tx_written_arg = arg;
+  pthread_mutex_unlock(&(ctx->credit_mutex));
+}
+
+void
+dvap_tx_flush(device_t* ctx)
+{
+  struct iovec iov[DVAP_TX_WINDOW_FRAMES];
+  buf_t* pkts[DVAP_TX_WINDOW_FRAMES];
+  unsigned long long now;
+  buf_t* pkt;
+  int header, i;
+  int count = 0;
+  int bytes = 0;
+
+  if (!ctx) return;
+
+  pthread_mutex_lock(&(ctx->credit_mutex));
+  now = now_us();
+
+  // Without fifo status from the device assume it drains one frame
+  // per frame period
+  if (ctx->tx_credits <= 0 &&
+      now - ctx->tx_credit_us >= DVAP_TX_STATUS_TIMEOUT_MS * 1000ULL) {
+    ctx->tx_credits = 1;
+    ctx->tx_credit_us = now - (DVAP_TX_STATUS_TIMEOUT_MS - DVAP_FRAME_MS) *
+      1000ULL;
+  }
+
+  if (ctx->tx_hdr_us &&
+      now - ctx->tx_hdr_us >= DVAP_TX_ACK_TIMEOUT_MS * 1000ULL) {
+    debug_print("%s\n", "dvap_tx_flush: timeout waiting for header ack");
+    ctx->tx_hdr_us = 0;
+  }
+
+  // Gather every frame the fifo has room for into one write
+  while (ctx->tx_credits > 0 && count < DVAP_TX_WINDOW_FRAMES &&
+         queue_peek_buf(&(ctx->txq), &pkt)) {
+    header = (pkt->data[0] << 8) + pkt->data[1];
+
+    // Hold voice frames until the device has accepted the stream header
+    if (ctx->tx_hdr_us && header != DVAP_DATA_GMSK_HDR) {
+      buf_release(pkt);
+      break;
+    }
+
+    // Drop the queue's reference, ours keeps the frame alive
+    queue_try_remove_buf(&(ctx->txq), &pkt);
+    buf_release(pkt);
+    pkts[count] = pkt;
+    iov[count].iov_base = pkt->data;
+    iov[count].iov_len = pkt->len;
+    bytes += pkt->len;
+    count += 1;
+
+    ctx->tx_credits -= 1;
+    ctx->tx_since_status += 1;
+    if (header == DVAP_DATA_GMSK_HDR) {
+      ctx->tx_hdr_us = now;
+    }
+  }
+
+  if (count > 0) {
+    LOG(LOG_DEBUG, "dvap_tx_flush: %d frames\n", count);
+    pthread_mutex_lock(&(ctx->tx_mutex));
+    dvap_tx_writev(ctx, iov, count, count);
+    pthread_mutex_unlock(&(ctx->tx_mutex));
+    for (i = 0; i < count; i++) {
+      if (ctx->tx_written) {
+        ctx->tx_written(ctx->tx_written_arg, pkts[i]->data, pkts[i]->len);
+      }
+      buf_release(pkts[i]);
+    }
+    METRIC_ADD(dvap_tx_frames, count);
+    METRIC_ADD(dvap_tx_bytes, bytes);
+    METRIC_SET(dvap_txq_depth, queue_count(&(ctx->txq)));
+  }
+
+  // An event loop has no read timeout to retry on, so come back in a
+  // frame period if anything is still waiting
+  if (ctx->loop && ctx->flush_timer >= 0 && !queue_is_empty(&(ctx->txq))) {
+    evloop_set_timer(ctx->flush_timer, DVAP_FRAME_MS, FALSE);
+  }
+  pthread_mutex_unlock(&(ctx->credit_mutex));
 }
 
 int
 dvap_write(device_t* ctx, char msg_type, int command, unsigned char* payload,
            int payload_bytes)
 {
-  int n;
-  int total_sent_bytes = 0;
-  int payload_sent_bytes = 0;
   unsigned char buf[4];
-  int pktlen;
+  int pktlen, n;
 
   if (!ctx) return -1;
 
@@ -350,46 +733,23 @@ dvap_write(device_t* ctx, char msg_type, int command, unsigned char* payload,
   buf[2] = command & 0xFF;
   buf[3] = (command >> 8) & 0xFF;
 
-  if (DEBUG) {
-    hex_dump("tx", buf, 4);
-  }
-
-  pthread_mutex_lock(&(ctx->tx_mutex));
-  while(total_sent_bytes < 4) {
-    n = write(ctx->fd, &buf[total_sent_bytes], 4-total_sent_bytes);
-    if (n <= 0) {
-      pthread_mutex_unlock(&(ctx->tx_mutex));
-      debug_print("dvap_write - returned %d\n", n);
-      return n;
-    }
-    total_sent_bytes += n;
+  LOG_HEX(LOG_DEBUG, "tx", buf, 4);
+  if (payload) {
+    LOG_HEX(LOG_DEBUG, "tx payload", payload, payload_bytes);
   }
 
-  if (payload) {
-    if (DEBUG) {
-      hex_dump("tx payload", payload, payload_bytes);
-    }
-    while(payload_sent_bytes < payload_bytes) {
-      n = write(ctx->fd, &payload[payload_sent_bytes],
-                payload_bytes-payload_sent_bytes);
-      if (n <= 0) {
-        pthread_mutex_unlock(&(ctx->tx_mutex));
-        debug_print("dvap_write - returned %d\n", n);
-        return n;
-      }
-      payload_sent_bytes += n;
-      total_sent_bytes += n;
-    }
+  n = dvap_tx_send(ctx, buf, 4, payload, payload ? payload_bytes : 0);
+  if (n <= 0) {
+    debug_print("dvap_write - returned %d\n", n);
   }
-  pthread_mutex_unlock(&(ctx->tx_mutex));
-  return total_sent_bytes;
+  return n;
 }
 
 int
 dvap_read(device_t* ctx, char* msg_type, unsigned char* buf, int buf_bytes)
 {
   if (!ctx) return -1;
-  return packet_read(ctx->fd, msg_type, buf, buf_bytes);
+  return framer_read(&(ctx->framer), msg_type, buf, buf_bytes);
 }
 
 int
@@ -404,32 +764,40 @@ dvap_should_shutdown(device_t* ctx)
   return shutdown;
 }
 
-void*
-dvap_watchdog_loop(void* arg)
+// Send watchdog keepalive, FALSE if the transmitter is in use
+static int
+dvap_watchdog_send(device_t* ctx)
 {
-  device_t* ctx = (device_t *)arg;
   unsigned char buf[3];
   int ptt_active;
-  int counter = DVAP_WATCHDOG_SECS;
   buf[0] = 0x03;
   buf[1] = 0x60;
   buf[2] = 0x00;
 
+  pthread_mutex_lock(&(ctx->ptt_mutex));
+  ptt_active = ctx->ptt_active;
+  pthread_mutex_unlock(&(ctx->ptt_mutex));
+
+  // Only send watchdog keepalive message if transmitter is not in use
+  if (ptt_active) {
+    return FALSE;
+  }
+
+  dvap_tx_send(ctx, buf, 3, NULL, 0);
+  LOG_HEX(LOG_DEBUG, "watchdog tx", buf, 3);
+  return TRUE;
+}
+
+void*
+dvap_watchdog_loop(void* arg)
+{
+  device_t* ctx = (device_t *)arg;
+  int counter = DVAP_WATCHDOG_SECS;
+
   while (!dvap_should_shutdown(ctx)) {
     if (counter <= 0) {
-      pthread_mutex_lock(&(ctx->ptt_mutex));
-      ptt_active = ctx->ptt_active;
-      pthread_mutex_unlock(&(ctx->ptt_mutex));
-
-      // Only send watchdog keepalive message if transmitter is not in use
-      if (!ptt_active) {
-        pthread_mutex_lock(&(ctx->tx_mutex));
-        write(ctx->fd, buf, 3);
-        pthread_mutex_unlock(&(ctx->tx_mutex));
+      if (dvap_watchdog_send(ctx)) {
         counter = DVAP_WATCHDOG_SECS;
-        if (DEBUG) {
-          hex_dump("watchdog tx", buf, 3);
-        }
       }
     }
     counter -= 1;
@@ -439,15 +807,53 @@ dvap_watchdog_loop(void* arg)
   return NULL;
 }
 
+static void
+dvap_evloop_watchdog(void* arg)
+{
+  device_t* ctx = (device_t *)arg;
+  if (!dvap_should_shutdown(ctx)) {
+    dvap_watchdog_send(ctx);
+  }
+}
+
+static void
+dvap_evloop_flush(void* arg)
+{
+  dvap_tx_flush((device_t *)arg);
+}
+
+static void
+dvap_evloop_expire(void* arg)
+{
+  device_t* ctx = (device_t *)arg;
+  unsigned long long next = dvap_cmd_expire(ctx);
+  unsigned long long now = now_us();
+
+  if (next) {
+    evloop_set_timer(ctx->cmd_timer,
+                     (next > now) ? (next - now + 999) / 1000 : 1, FALSE);
+  }
+}
+
+static void
+dvap_evloop_read(void* arg)
+{
+  device_t* ctx = (device_t *)arg;
+
+  // Stop watching a device we can no longer read, as the read loop
+  // thread would exit
+  if (!dvap_read_handler(ctx)) {
+    evloop_remove_fd(ctx->loop, ctx->fd);
+  }
+}
+
 void* 
 dvap_read_loop(void* arg)
 {
   device_t* ctx = (device_t *)arg;
 
   fd_set set;
-  char msg_type;
   int ret;
-  unsigned char buf[DVAP_MSG_MAX_BYTES];
 
   struct timeval timeout;
   while(!dvap_should_shutdown(ctx)) {
@@ -466,56 +872,86 @@ dvap_read_loop(void* arg)
     }
     else if (ret == 0) {
       //debug_print("%s\n", "DVAP select timeout");
+      // Give queued tx frames a chance if fifo status has gone quiet
+      dvap_tx_flush(ctx);
+      dvap_cmd_expire(ctx);
       continue;
     }
 
-    // Read packet
-    ret = dvap_read(ctx, &msg_type, buf, DVAP_MSG_MAX_BYTES);
-    if (ret < 0) {
-      fprintf(stderr, "Error reading from DVAP\n");
-      return NULL;
-    }
-    else if (ret == 0) {
-      fprintf(stderr, "Timeout while reading from DVAP\n");
+    if (!dvap_read_handler(ctx)) {
       return NULL;
     }
+  }
 
-    // Call appropriate handler depending on message type
-    switch (msg_type) {
+  return NULL;
+}
 
-    // Response to a host initiated request
-    case DVAP_MSG_TARGET_ITEM_RESPONSE:
-    case DVAP_MSG_TARGET_RANGE_RESPONSE:
-      queue_insert(&(ctx->rxq), &buf[2], ret-2);
-      if (DEBUG) {
-        hex_dump("rx", buf, ret);
-      }
-      break;
+int
+dvap_read_handler(device_t* ctx)
+{
+  char msg_type;
+  int ret;
+  unsigned char* buf;
 
-    // Status message
-    case DVAP_MSG_TARGET_UNSOLICITED:
-      dvap_parse_rx_unsolicited(ctx, &buf[2], ret-2);
-      break;
+  // Pull in everything available with a single read
+  ret = framer_fill(&(ctx->framer));
+  if (ret < 0) {
+    fprintf(stderr, "Error reading from DVAP\n");
+    return FALSE;
+  }
+  else if (ret == 0) {
+    fprintf(stderr, "Timeout while reading from DVAP\n");
+    return FALSE;
+  }
+  METRIC_ADD(serial_rx_bytes, ret);
 
-    // Ignore target data acks for now
-    case DVAP_MSG_TARGET_DATA_ACK:
-      break;
+  while ((ret = framer_next(&(ctx->framer), &buf, &msg_type)) > 0) {
+    dvap_dispatch(ctx, msg_type, buf, ret);
+  }
+  dvap_cmd_expire(ctx);
 
-    // Radio data
-    case DVAP_MSG_TARGET_DATA_ITEM_0:
-    case DVAP_MSG_TARGET_DATA_ITEM_1:
-    case DVAP_MSG_TARGET_DATA_ITEM_2:
-    case DVAP_MSG_TARGET_DATA_ITEM_3:
-      (ctx->callback)(buf, ret);
-      break;
+  return TRUE;
+}
 
-    default:
-      fprintf(stderr, "rx: unrecognized response type: %d\n", msg_type);
-      break;
-    }
-  }
+void
+dvap_dispatch(device_t* ctx, char msg_type, unsigned char* buf, int buf_len)
+{
+  METRIC_ADD(dvap_rx_msgs[msg_type & (METRICS_MSG_TYPES - 1)], 1);
 
-  return NULL;
+  // Call appropriate handler depending on message type
+  switch (msg_type) {
+
+  // Response to a host initiated request
+  case DVAP_MSG_TARGET_ITEM_RESPONSE:
+  case DVAP_MSG_TARGET_RANGE_RESPONSE:
+    dvap_cmd_complete(ctx, &buf[2], buf_len-2);
+    LOG_HEX(LOG_DEBUG, "rx", buf, buf_len);
+    break;
+
+  // Status message
+  case DVAP_MSG_TARGET_UNSOLICITED:
+    dvap_parse_rx_unsolicited(ctx, &buf[2], buf_len-2);
+    break;
+
+  // Transmit acknowledgement
+  case DVAP_MSG_TARGET_DATA_ACK:
+    dvap_parse_rx_ack(ctx, buf, buf_len);
+    break;
+
+  // Radio data
+  case DVAP_MSG_TARGET_DATA_ITEM_0:
+  case DVAP_MSG_TARGET_DATA_ITEM_1:
+  case DVAP_MSG_TARGET_DATA_ITEM_2:
+  case DVAP_MSG_TARGET_DATA_ITEM_3:
+    METRIC_ADD(dvap_rx_frames, 1);
+    METRIC_ADD(dvap_rx_bytes, buf_len);
+    (ctx->callback)(buf, buf_len);
+    break;
+
+  default:
+    LOG(LOG_WARN, "rx: unrecognized response type: %d\n", msg_type);
+    break;
+  }
 }
 
 void
@@ -526,6 +962,7 @@ dvap_parse_rx_unsolicited(device_t* ctx, unsigned char* buf, int buf_len)
   switch (ctrl_code) {
   case DVAP_CTRL_OPERATIONAL_STATUS:
     //dvap_print_operational_status(buf, buf_len);
+    dvap_parse_fifo_status(ctx, buf, buf_len);
     break;
   case DVAP_CTRL_PTT_STATE:
     //dvap_print_ptt_state(buf, buf_len);
@@ -544,13 +981,48 @@ dvap_parse_rx_unsolicited(device_t* ctx, unsigned char* buf, int buf_len)
     dvap_print_dtmf(buf, buf_len);
     break;
   default:
-    if (DEBUG) {
-      hex_dump("rx unsolicited other", buf, buf_len);
-    }
+    LOG_HEX(LOG_DEBUG, "rx unsolicited other", buf, buf_len);
     break;
   }
 }
 
+void
+dvap_parse_rx_ack(device_t* ctx, unsigned char* buf, int buf_len)
+{
+  int header;
+  if (buf_len < 2) return;
+
+  header = (buf[0] << 8) + buf[1];
+  if (header != DVAP_GMSK_TX_ACK_HDR) {
+    LOG_HEX(LOG_DEBUG, "rx ack other", buf, buf_len);
+    return;
+  }
+
+  // Header accepted, release the voice frames held behind it
+  pthread_mutex_lock(&(ctx->credit_mutex));
+  ctx->tx_hdr_us = 0;
+  pthread_mutex_unlock(&(ctx->credit_mutex));
+  dvap_tx_flush(ctx);
+}
+
+void
+dvap_parse_fifo_status(device_t* ctx, unsigned char* buf, int buf_len)
+{
+  int credits;
+  if (buf_len < 5) return;
+
+  // Frames written since the previous status may not be counted yet, so
+  // subtract them to stay on the safe side of the fifo
+  pthread_mutex_lock(&(ctx->credit_mutex));
+  credits = buf[4] - ctx->tx_since_status;
+  ctx->tx_credits = (credits > 0) ? credits : 0;
+  ctx->tx_since_status = 0;
+  ctx->tx_credit_us = now_us();
+  pthread_mutex_unlock(&(ctx->credit_mutex));
+
+  dvap_tx_flush(ctx);
+}
+
 void
 dvap_print_operational_status(unsigned char* buf, int buf_len)
 {
@@ -561,8 +1033,8 @@ dvap_print_operational_status(unsigned char* buf, int buf_len)
   squelch = buf[3];
   fifo_free = buf[4];
 
-  printf("rssi: %04d, squelch: %d, tx fifo free: %03d\n", rssi, squelch,
-         fifo_free);
+  LOG(LOG_INFO, "rssi: %04d, squelch: %d, tx fifo free: %03d\n", rssi,
+      squelch, fifo_free);
 }
 
 void
@@ -570,10 +1042,10 @@ dvap_print_ptt_state(unsigned char* buf, int buf_len)
 {
   if (buf_len < 3) return;
   if (buf[2] <= 0) {
-    printf("ptt: receive active\n");
+    LOG(LOG_INFO, "ptt: receive active\n");
   }
   else {
-    printf("ptt: transmit active\n");
+    LOG(LOG_INFO, "ptt: transmit active\n");
   }
 }
 
@@ -582,9 +1054,9 @@ dvap_print_dtmf(unsigned char* buf, int buf_len)
 {
   if (buf_len < 3) return;
   if (buf[2] == 0) {
-    printf("dtmf: release\n");
+    LOG(LOG_INFO, "dtmf: release\n");
   }
   else {
-    printf("dtmf: %c\n", buf[2]);
+    LOG(LOG_INFO, "dtmf: %c\n", buf[2]);
   }
 }
@@ -3,12 +3,30 @@
 
 #include <pthread.h>
 #include <termios.h>
+#include "evloop.h"
+#include "framer.h"
 #include "queue.h"
 
 #define DVAP_BAUD                    B230400
+#define DVAP_BAUD_RATE               230400	// DVAP_BAUD in bits per second
 #define DVAP_WATCHDOG_SECS           3
 #define DVAP_READ_TIMEOUT_USEC       10000
 
+#define DVAP_FRAME_MS                20	// GMSK frame period on air
+#define DVAP_TX_WINDOW_FRAMES        10	// credits assumed before any status
+#define DVAP_TX_STATUS_TIMEOUT_MS    40	// then fall back to timed credits
+#define DVAP_TX_ACK_TIMEOUT_MS       100	// max wait for a tx header ack
+#define DVAP_TX_PENDING_BYTES        512	// staged control messages
+
+#define DVAP_CMD_MAX_PENDING         8	// commands in flight at once
+#define DVAP_CMD_TIMEOUT_MS          1000	// default reply deadline
+#define DVAP_CMD_MAX_RESP_BYTES      256
+
+#define DVAP_CMD_PENDING             0	// command completion status
+#define DVAP_CMD_OK                  1
+#define DVAP_CMD_TIMEOUT             2
+#define DVAP_CMD_ERROR               3
+
 #define DVAP_MSG_HOST_SET_CTRL       0x00
 #define DVAP_MSG_HOST_REQ_CTRL_ITEM  0x01
 #define DVAP_MSG_HOST_REQ_CTRL_RANGE 0x02
@@ -70,6 +88,7 @@
 
 #define DVAP_DATA_FM_HDR             0x4281
 #define DVAP_DATA_GMSK_HDR           0x2FA0
+#define DVAP_DATA_GMSK_DATA          0x12C0
 #define DVAP_GMSK_TX_ACK_HDR         0x2F60
 
 #define DVAP_MSG_MAX_BYTES           8191
@@ -94,6 +113,31 @@
 // a pointer to a buffer and the length of the buffer
 typedef void (*dvap_rx_fptr)(unsigned char*, int);
 
+// dvap_tx_fptr is called with each frame from dvap_pkt_write() as it is
+// written to the serial port, while tx credit state is locked
+typedef void (*dvap_tx_fptr)(void* arg, unsigned char* buf, int buf_len);
+
+// dvap_cmd_fptr is called once a command completes with the argument
+// given when it was sent, a DVAP_CMD_* status and the response starting
+// at the control code. It runs on the read thread and must not wait on
+// other commands.
+typedef void (*dvap_cmd_fptr)(void* arg, int status, unsigned char* buf,
+                              int buf_len);
+
+// A control command waiting for its response
+typedef struct {
+  int in_use;
+  int command;                    // DVAP_CTRL_* code the reply must carry
+  unsigned long long seq;         // send order, replies match oldest first
+  unsigned long long deadline_us;
+  dvap_cmd_fptr callback;         // NULL if a caller will dvap_cmd_wait()
+  void* arg;
+
+  int status;                     // DVAP_CMD_* status
+  unsigned char resp[DVAP_CMD_MAX_RESP_BYTES];
+  int resp_len;
+} dvap_cmd_t;
+
 typedef struct {
   dvap_rx_fptr callback;	  // pointer to rx callback
   int fd;
@@ -104,12 +148,43 @@ typedef struct {
   pthread_mutex_t tx_mutex;       // acquire before writing to dvap
   pthread_t watchdog_thread;      // pthread associated with watchdog loop
 
+  // Control messages staged to go out with the next serial write,
+  // acquire tx_mutex before using these
+  unsigned char tx_pending[DVAP_TX_PENDING_BYTES];
+  int tx_pending_len;
+  int tx_corked;                  // hold control messages until uncorked
+  unsigned long tx_writes;        // serial write calls
+  unsigned long tx_msgs;          // frames and control messages written
+
   pthread_mutex_t ptt_mutex;      // acquire before using ptt_active
   int ptt_active;                 // true when dvap is transmitting
 
-  queue_t rxq;			  // queue to hold expected data from dvap
+  // Radio tx flow control, frames wait in txq until the dvap fifo has room
+  queue_t txq;                    // frames waiting for fifo credit
+  pthread_mutex_t credit_mutex;   // acquire before using tx credit state
+  int tx_credits;                 // frames the dvap fifo can still accept
+  int tx_since_status;            // frames written since last fifo status
+  unsigned long long tx_credit_us; // time of last credit update
+  unsigned long long tx_hdr_us;   // time header was sent, 0 once acked
+  unsigned long tx_dropped;       // frames dropped because txq was full
+  dvap_tx_fptr tx_written;        // NULL unless dvap_set_tx_callback()
+  void* tx_written_arg;
+
+  framer_t framer;                // buffers and splits serial reads
+
+  // Control commands in flight, matched to responses by control code
+  dvap_cmd_t cmds[DVAP_CMD_MAX_PENDING];
+  pthread_mutex_t cmd_mutex;      // acquire before using cmds
+  pthread_cond_t cmd_done;        // signalled when any command completes
+  unsigned long long cmd_seq;
+  unsigned long cmd_timeouts;     // commands that got no response
+  int cmd_timer;                  // expiry timer fd with an event loop
   pthread_t rx_thread;            // pthread associated with read loop
 
+  evloop_t* loop;                 // drives rx and timers instead of threads
+  int watchdog_timer;             // timer fds, only used with an event loop
+  int flush_timer;
+
 } device_t;
 
 typedef struct {
@@ -191,22 +266,71 @@ int set_tx_power(device_t* ctx, int dbm);
 
 int dvap_init(device_t* ctx, char* portname, dvap_rx_fptr callback);
 
+// Same as dvap_init but serial reads and the watchdog are driven by loop
+// rather than by dedicated threads
+int dvap_init_evloop(device_t* ctx, char* portname, dvap_rx_fptr callback,
+                     evloop_t* loop);
+
 // Start run loop
 int dvap_start(device_t* ctx);
 
+// Start only the watchdog, for when the run state was already set as
+// part of a configuration batch
+int dvap_start_watchdog(device_t* ctx);
+
 // Block until dvap_stop() is called then cleanly shutdown
 void dvap_wait(device_t* ctx);
 
 // Shutdown DVAP device and shut down threads
 int dvap_stop(device_t* ctx);
 
-// Used to send packets destined for the radio transmitter
+// Used to send packets destined for the radio transmitter. Packets are
+// queued and written as the DVAP tx fifo reports free space, so this
+// call never blocks on the radio. Safe to call from several threads.
 int dvap_pkt_write(device_t* ctx, unsigned char* buf, int buf_bytes);
 
+// Call callback with each queued frame when it is written to the DVAP.
+// Set before dvap_start().
+void dvap_set_tx_callback(device_t* ctx, dvap_tx_fptr callback, void* arg);
+
+// Stage control messages from dvap_write() instead of writing them,
+// then send everything staged in one write. Commands sent while corked
+// must not be waited on until after uncorking.
+void dvap_tx_cork(device_t* ctx);
+int dvap_tx_uncork(device_t* ctx);
+
+// Write queued packets to the DVAP while tx credit is available
+void dvap_tx_flush(device_t* ctx);
+
 // Used to send control commands to the DVAP device
 int dvap_write(device_t* ctx, char msg_type, int command,
                unsigned char* payload, int payload_bytes);
 
+// Send a control command without waiting for the response. If callback
+// is NULL the returned handle must be passed to dvap_cmd_wait(),
+// otherwise callback is called on completion and the handle must not be
+// used. Several commands may be in flight at once. Returns NULL if the
+// command could not be sent.
+dvap_cmd_t* dvap_cmd_send(device_t* ctx, char msg_type, int command,
+                          unsigned char* payload, int payload_bytes,
+                          int timeout_ms, dvap_cmd_fptr callback, void* arg);
+
+// Block until the command completes or times out, then release it.
+// buf and buf_len may be NULL. Returns a DVAP_CMD_* status.
+int dvap_cmd_wait(device_t* ctx, dvap_cmd_t* cmd, unsigned char* buf,
+                  int* buf_len);
+
+// Send a command and wait for it with the default timeout
+int dvap_cmd(device_t* ctx, char msg_type, int command,
+             unsigned char* payload, int payload_bytes, unsigned char* buf,
+             int* buf_len);
+
+// Match a response to the oldest pending command with its control code
+void dvap_cmd_complete(device_t* ctx, unsigned char* buf, int buf_len);
+
+// Time out commands past their deadline, returns the next deadline or 0
+unsigned long long dvap_cmd_expire(device_t* ctx);
+
 int dvap_read(device_t* ctx, char* msg_type, unsigned char* buf,
               int buf_bytes);
 
@@ -214,7 +338,15 @@ int dvap_should_shutdown(device_t* ctx);
 void* dvap_watchdog_loop(void* arg);
 
 void* dvap_read_loop(void* arg);
+
+// Read once from the device and dispatch every complete packet, FALSE
+// if the device can't be read
+int dvap_read_handler(device_t* ctx);
+void dvap_dispatch(device_t* ctx, char msg_type, unsigned char* buf,
+                   int buf_len);
 void dvap_parse_rx_unsolicited(device_t* ctx, unsigned char* buf, int buf_len);
+void dvap_parse_rx_ack(device_t* ctx, unsigned char* buf, int buf_len);
+void dvap_parse_fifo_status(device_t* ctx, unsigned char* buf, int buf_len);
 
 void dvap_print_operational_status(unsigned char* buf, int buf_len);
 void dvap_print_ptt_state(unsigned char* buf, int buf_len);
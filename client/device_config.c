@@ -0,0 +1,230 @@
+// Declarative DVAP configuration applied as one pipelined batch
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "device.h"
+#include "device_config.h"
+
+// Control code and payload size for each configuration item
+static const struct {
+  int command;
+  int bytes;
+} dvap_config_items[DVAP_CFG_ITEMS] = {
+  { DVAP_CTRL_RX_FREQ, 4 },
+  { DVAP_CTRL_TX_FREQ, 4 },
+  { DVAP_CTRL_MODULATION_TYPE, 1 },
+  { DVAP_CTRL_OPERATION_MODE, 1 },
+  { DVAP_CTRL_SQUELCH_THRESH, 1 },
+  { DVAP_CTRL_TX_POWER, 2 },
+};
+
+void
+dvap_config_init(dvap_config_t* cfg)
+{
+  memset(cfg, 0, sizeof(dvap_config_t));
+}
+
+static void
+dvap_config_set(dvap_config_t* cfg, int item, unsigned int val)
+{
+  int i;
+  for (i = 0; i < dvap_config_items[item].bytes; i++) {
+    cfg->value[item][i] = (val >> (8 * i)) & 0xFF;
+  }
+  cfg->valid |= (1 << item);
+}
+
+void
+dvap_config_rx_frequency(dvap_config_t* cfg, unsigned int hz)
+{
+  dvap_config_set(cfg, DVAP_CFG_RX_FREQ, hz);
+}
+
+void
+dvap_config_tx_frequency(dvap_config_t* cfg, unsigned int hz)
+{
+  dvap_config_set(cfg, DVAP_CFG_TX_FREQ, hz);
+}
+
+void
+dvap_config_modulation(dvap_config_t* cfg, char modulation)
+{
+  dvap_config_set(cfg, DVAP_CFG_MODULATION, modulation);
+}
+
+void
+dvap_config_operation_mode(dvap_config_t* cfg, char mode)
+{
+  dvap_config_set(cfg, DVAP_CFG_OPERATION_MODE, mode);
+}
+
+void
+dvap_config_squelch_threshold(dvap_config_t* cfg, int dbm)
+{
+  int squelch = dbm;
+  squelch = (squelch < DVAP_SQUELCH_MIN) ? DVAP_SQUELCH_MIN : squelch;
+  squelch = (squelch > DVAP_SQUELCH_MAX) ? DVAP_SQUELCH_MAX : squelch;
+  dvap_config_set(cfg, DVAP_CFG_SQUELCH, squelch);
+}
+
+void
+dvap_config_tx_power(dvap_config_t* cfg, int dbm)
+{
+  int power = dbm;
+  power = (power < DVAP_TX_POWER_MIN) ? DVAP_TX_POWER_MIN : power;
+  power = (power > DVAP_TX_POWER_MAX) ? DVAP_TX_POWER_MAX : power;
+  dvap_config_set(cfg, DVAP_CFG_TX_POWER, power);
+}
+
+void
+dvap_config_run(dvap_config_t* cfg, int run)
+{
+  cfg->run = run;
+}
+
+static int
+dvap_config_matches(dvap_config_t* a, dvap_config_t* b, int item)
+{
+  return (a->valid & b->valid & (1 << item)) &&
+    !memcmp(a->value[item], b->value[item], dvap_config_items[item].bytes);
+}
+
+// Write items in mask then, if run is set, the run state as one batch
+// and wait for every reply. Reads back items in verify in the same batch,
+// returning the mask of those that did not match state.
+static int
+dvap_config_batch(device_t* ctx, dvap_config_t* cfg, dvap_config_t* state,
+                  unsigned int mask, unsigned int verify, int probe_name,
+                  int run_state, unsigned int* stale)
+{
+  dvap_cmd_t* cmds[DVAP_CFG_ITEMS];
+  dvap_cmd_t* name_cmd = NULL;
+  dvap_cmd_t* run_cmd = NULL;
+  unsigned char buf[DVAP_CMD_MAX_RESP_BYTES];
+  unsigned char run[1];
+  int i, len, bytes;
+  int ok = TRUE;
+
+  *stale = 0;
+
+  // Queue everything before waiting on anything, the whole batch goes
+  // to the device in one write
+  dvap_tx_cork(ctx);
+  if (probe_name) {
+    name_cmd = dvap_cmd_send(ctx, DVAP_MSG_HOST_REQ_CTRL_ITEM,
+                             DVAP_CTRL_TARGET_NAME, NULL, 0,
+                             DVAP_CMD_TIMEOUT_MS, NULL, NULL);
+    ok = ok && name_cmd;
+  }
+  for (i = 0; i < DVAP_CFG_ITEMS; i++) {
+    cmds[i] = NULL;
+    if (mask & (1 << i)) {
+      cmds[i] = dvap_cmd_send(ctx, DVAP_MSG_HOST_SET_CTRL,
+                              dvap_config_items[i].command, cfg->value[i],
+                              dvap_config_items[i].bytes,
+                              DVAP_CMD_TIMEOUT_MS, NULL, NULL);
+      ok = ok && cmds[i];
+    }
+    else if (verify & (1 << i)) {
+      cmds[i] = dvap_cmd_send(ctx, DVAP_MSG_HOST_REQ_CTRL_ITEM,
+                              dvap_config_items[i].command, NULL, 0,
+                              DVAP_CMD_TIMEOUT_MS, NULL, NULL);
+      ok = ok && cmds[i];
+    }
+  }
+  if (run_state) {
+    run[0] = DVAP_RUN_STATE_RUN;
+    run_cmd = dvap_cmd_send(ctx, DVAP_MSG_HOST_SET_CTRL, DVAP_CTRL_RUN_STATE,
+                            run, 1, DVAP_CMD_TIMEOUT_MS, NULL, NULL);
+    ok = ok && run_cmd;
+  }
+  if (dvap_tx_uncork(ctx) < 0) {
+    ok = FALSE;
+  }
+
+  // Collect replies in the order they were sent
+  if (name_cmd) {
+    if (dvap_cmd_wait(ctx, name_cmd, buf, &len) == DVAP_CMD_OK && len > 2) {
+      len = (len - 2 < DVAP_CFG_NAME_BYTES) ? len - 2 : DVAP_CFG_NAME_BYTES;
+      memcpy(state->name, &buf[2], len);
+      state->name[DVAP_CFG_NAME_BYTES - 1] = 0;
+    }
+    else {
+      ok = FALSE;
+    }
+  }
+
+  for (i = 0; i < DVAP_CFG_ITEMS; i++) {
+    if (!cmds[i]) continue;
+    bytes = dvap_config_items[i].bytes;
+
+    if (dvap_cmd_wait(ctx, cmds[i], buf, &len) != DVAP_CMD_OK) {
+      state->valid &= ~(1 << i);
+      ok = FALSE;
+      continue;
+    }
+
+    if (mask & (1 << i)) {
+      memcpy(state->value[i], cfg->value[i], bytes);
+      state->valid |= (1 << i);
+      state->sent += 1;
+    }
+    else if (len >= 2 + bytes && !memcmp(&buf[2], state->value[i], bytes)) {
+      state->verified += 1;
+    }
+    else {
+      // The device lost this setting, maybe it was power cycled
+      state->valid &= ~(1 << i);
+      *stale |= (1 << i);
+    }
+  }
+
+  if (run_cmd && dvap_cmd_wait(ctx, run_cmd, NULL, NULL) != DVAP_CMD_OK) {
+    ok = FALSE;
+  }
+
+  return ok;
+}
+
+int
+dvap_config_apply(device_t* ctx, dvap_config_t* cfg, dvap_config_t* state)
+{
+  unsigned long long start = now_us();
+  unsigned int changed = 0;
+  unsigned int cached = 0;
+  unsigned int stale = 0;
+  int i, ok;
+
+  if (!ctx || !cfg || !state) return FALSE;
+
+  for (i = 0; i < DVAP_CFG_ITEMS; i++) {
+    if (!(cfg->valid & (1 << i))) continue;
+    if (dvap_config_matches(cfg, state, i)) {
+      cached |= (1 << i);
+    }
+    else {
+      changed |= (1 << i);
+    }
+  }
+
+  state->sent = 0;
+  state->verified = 0;
+  // Cached settings may be gone if the device was power cycled, so it
+  // is only started in the first batch when there is nothing to verify
+  ok = dvap_config_batch(ctx, cfg, state, changed, cached, TRUE,
+                         cfg->run && !cached, &stale);
+
+  // Settings the device forgot are written before it is started, so it
+  // never runs on its default frequency or modulation
+  if (ok && cached && (stale || cfg->run)) {
+    if (stale) {
+      debug_print("stale device settings 0x%02X\n", stale);
+    }
+    ok = dvap_config_batch(ctx, cfg, state, stale, 0, FALSE, cfg->run,
+                           &stale);
+  }
+
+  state->apply_us = now_us() - start;
+  return ok;
+}
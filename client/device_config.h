@@ -0,0 +1,51 @@
+// Declarative DVAP configuration applied as one pipelined batch of
+// commands, diffed against a snapshot of the last known device state
+#ifndef DEVICE_CONFIG_H
+#define DEVICE_CONFIG_H
+
+#include "device.h"
+
+// Configuration items, each maps to one DVAP_CTRL_* setting
+#define DVAP_CFG_RX_FREQ        0
+#define DVAP_CFG_TX_FREQ        1
+#define DVAP_CFG_MODULATION     2
+#define DVAP_CFG_OPERATION_MODE 3
+#define DVAP_CFG_SQUELCH        4
+#define DVAP_CFG_TX_POWER       5
+#define DVAP_CFG_ITEMS          6
+
+#define DVAP_CFG_NAME_BYTES     20
+
+typedef struct {
+  unsigned int valid;			// bit per DVAP_CFG_* item that is set
+  unsigned char value[DVAP_CFG_ITEMS][4];	// payload as sent to the device
+  int run;				// also put the device in run state
+  char name[DVAP_CFG_NAME_BYTES];	// device name, only in snapshots
+
+  // Results of the last dvap_config_apply() using this snapshot
+  int sent;				// settings written to the device
+  int verified;				// settings confirmed unchanged
+  unsigned long long apply_us;		// time taken to apply
+} dvap_config_t;
+
+// An empty configuration, also used to start an empty snapshot
+void dvap_config_init(dvap_config_t* cfg);
+
+void dvap_config_rx_frequency(dvap_config_t* cfg, unsigned int hz);
+void dvap_config_tx_frequency(dvap_config_t* cfg, unsigned int hz);
+void dvap_config_modulation(dvap_config_t* cfg, char modulation);
+void dvap_config_operation_mode(dvap_config_t* cfg, char mode);
+void dvap_config_squelch_threshold(dvap_config_t* cfg, int dbm);
+void dvap_config_tx_power(dvap_config_t* cfg, int dbm);
+void dvap_config_run(dvap_config_t* cfg, int run);
+
+// Bring the device to cfg. Settings that state says already match are
+// read back rather than written, all in the same batch as the writes,
+// and anything that turns out stale is written in a second batch. The
+// run state is set only once every setting is known to be in place.
+// state is updated to what the device confirmed. Returns FALSE if any
+// command failed.
+int dvap_config_apply(device_t* ctx, dvap_config_t* cfg,
+                      dvap_config_t* state);
+
+#endif
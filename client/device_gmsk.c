@@ -5,67 +5,156 @@
 #include "device.h"
 #include "device_gmsk.h"
 
-int
-gmsk_parse_header(unsigned char* buf, int buf_len)
+// Formatters for log_data, called on the log writer thread
+static void
+gmsk_print_header(FILE* fp, unsigned char* buf, int buf_len, int orig_len)
 {
-  int i;
   union dvap_dstar_header_union dstar;
   char str[9];
 
-  if (buf_len != sizeof(dvap_dstar_header_t)) {
-    return FALSE;
-  }
+  memcpy(dstar.bytes, buf, sizeof(dvap_dstar_header_t));
 
-  for (i = 0; i < buf_len; i++) {
-    dstar.bytes[i] = buf[i];
-  }
-
-  printf("gmsk header - ");
-  printf("stream_id: %d, ", (dstar.header.stream_id[1] << 8) +
-         dstar.header.stream_id[0]);
-  printf("header: %d, ", dstar.header.header_flag);
-  printf("end: %d, ", dstar.header.end_of_stream_flag);
-  printf("prev header pkt: %d\n", dstar.header.using_prev_header_packet_flag);
-  printf("              frame_pos: %d, ", dstar.header.frame_pos);
-  printf("seq: %d\n", dstar.header.seq);
+  fprintf(fp, " stream_id: %d, ", (dstar.header.stream_id[1] << 8) +
+          dstar.header.stream_id[0]);
+  fprintf(fp, "header: %d, ", dstar.header.header_flag);
+  fprintf(fp, "end: %d, ", dstar.header.end_of_stream_flag);
+  fprintf(fp, "prev header pkt: %d\n",
+          dstar.header.using_prev_header_packet_flag);
+  fprintf(fp, "              frame_pos: %d, ", dstar.header.frame_pos);
+  fprintf(fp, "seq: %d\n", dstar.header.seq);
 
   str[8] = 0;
   strncpy(str, (char *)dstar.header.rpt1, 8);
-  printf("rpt1: [%s], ", str);
+  fprintf(fp, "rpt1: [%s], ", str);
 
   strncpy(str, (char *)dstar.header.rpt2, 8);
-  printf("rpt2: [%s], ", str);
+  fprintf(fp, "rpt2: [%s], ", str);
 
   strncpy(str, (char *)dstar.header.urcall, 8);
-  printf("urcall: [%s], ", str);
+  fprintf(fp, "urcall: [%s], ", str);
 
   strncpy(str, (char *)dstar.header.mycall, 8);
-  printf("mycall: [%s]\n", str);
+  fprintf(fp, "mycall: [%s]\n", str);
+}
+
+static void
+gmsk_print_data(FILE* fp, unsigned char* buf, int buf_len, int orig_len)
+{
+  union dvap_dstar_data_union dstar;
 
+  memcpy(dstar.bytes, buf, sizeof(dvap_dstar_data_t));
+
+  fprintf(fp, " stream_id: %d, ", (dstar.data.stream_id[1] << 8) +
+          dstar.data.stream_id[0]);
+  fprintf(fp, "header: %d, ", dstar.data.header_flag);
+  fprintf(fp, "end: %d, ", dstar.data.end_of_stream_flag);
+  fprintf(fp, "prev header pkt: %d\n",
+          dstar.data.using_prev_header_packet_flag);
+  fprintf(fp, "            frame_pos: %d, ", dstar.data.frame_pos);
+  fprintf(fp, "seq: %d\n", dstar.data.seq);
+}
+
+// The frame is copied into a log record and printed later, so these
+// are cheap enough for the device read thread
+int
+gmsk_parse_header(unsigned char* buf, int buf_len)
+{
+  if (buf_len != sizeof(dvap_dstar_header_t)) {
+    return FALSE;
+  }
+  if (log_enabled(LOG_INFO)) {
+    log_data(LOG_INFO, gmsk_print_header, buf, buf_len, "gmsk header -");
+  }
   return TRUE;
 }
 
 int
 gmsk_parse_data(unsigned char* buf, int buf_len)
 {
-  int i;
-  union dvap_dstar_data_union dstar;
-
   if (buf_len != sizeof(dvap_dstar_data_t)) {
     return FALSE;
   }
+  if (log_enabled(LOG_DEBUG)) {
+    log_data(LOG_DEBUG, gmsk_print_data, buf, buf_len, "gmsk data -");
+  }
+  return TRUE;
+}
+
+// D-STAR header checksum, CRC-CCITT reflected with inverted result
+static unsigned int
+gmsk_crc(unsigned char* buf, int buf_len)
+{
+  unsigned int crc = 0xFFFF;
+  int i, j;
 
   for (i = 0; i < buf_len; i++) {
-    dstar.bytes[i] = buf[i];
+    crc ^= buf[i];
+    for (j = 0; j < 8; j++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
+    }
   }
+  return ~crc & 0xFFFF;
+}
 
-  printf("gmsk data - ");
-  printf("stream_id: %d, ", (dstar.data.stream_id[1] << 8) + 
-         dstar.data.stream_id[0]);
-  printf("header: %d, ", dstar.data.header_flag);
-  printf("end: %d, ", dstar.data.end_of_stream_flag);
-  printf("prev header pkt: %d\n", dstar.data.using_prev_header_packet_flag);
-  printf("            frame_pos: %d, ", dstar.data.frame_pos);
-  printf("seq: %d\n", dstar.data.seq);
-  return TRUE;
+static void
+gmsk_copy_call(unsigned char* dst, char* src, int len)
+{
+  int i;
+  int src_len = src ? strlen(src) : 0;
+
+  for (i = 0; i < len; i++) {
+    dst[i] = (i < src_len) ? src[i] : ' ';
+  }
+}
+
+void
+gmsk_build_header(unsigned char* buf, int stream_id, char* mycall,
+                  char* urcall, char* rpt1, char* rpt2)
+{
+  union dvap_dstar_header_union dstar;
+  unsigned int crc;
+
+  memset(dstar.bytes, 0, sizeof(dstar.bytes));
+  dstar.bytes[0] = DVAP_DATA_GMSK_HDR >> 8;
+  dstar.bytes[1] = DVAP_DATA_GMSK_HDR & 0xFF;
+  dstar.header.stream_id[0] = stream_id & 0xFF;
+  dstar.header.stream_id[1] = (stream_id >> 8) & 0xFF;
+  dstar.header.header_flag = 1;
+  gmsk_copy_call(dstar.header.rpt1, rpt1, 8);
+  gmsk_copy_call(dstar.header.rpt2, rpt2, 8);
+  gmsk_copy_call(dstar.header.urcall, urcall, 8);
+  gmsk_copy_call(dstar.header.mycall, mycall, 8);
+  gmsk_copy_call(dstar.header.mysuffix, NULL, 4);
+
+  // Checksum covers flags through suffix
+  crc = gmsk_crc(&dstar.bytes[6], 39);
+  dstar.header.pfcs[0] = crc & 0xFF;
+  dstar.header.pfcs[1] = (crc >> 8) & 0xFF;
+
+  memcpy(buf, dstar.bytes, GMSK_HEADER_BYTES);
+}
+
+void
+gmsk_build_data(unsigned char* buf, int stream_id, int seq, int end)
+{
+  // AMBE silence followed by slow data sync or filler
+  static const unsigned char silence[9] = {
+    0x9E, 0x8D, 0x32, 0x88, 0x26, 0x1A, 0x3F, 0x61, 0xE8
+  };
+  static const unsigned char sync[3] = { 0x55, 0x2D, 0x16 };
+  static const unsigned char filler[3] = { 0x16, 0x29, 0xF5 };
+  union dvap_dstar_data_union dstar;
+
+  memset(dstar.bytes, 0, sizeof(dstar.bytes));
+  dstar.bytes[0] = GMSK_DATA_BYTES;
+  dstar.bytes[1] = 0xC0;
+  dstar.data.stream_id[0] = stream_id & 0xFF;
+  dstar.data.stream_id[1] = (stream_id >> 8) & 0xFF;
+  dstar.data.end_of_stream_flag = end ? 1 : 0;
+  dstar.data.seq = seq;
+  memcpy(dstar.data.data, silence, 9);
+  memcpy(&dstar.data.data[9], (seq % GMSK_FRAMES_PER_SUPER) ? filler : sync,
+         3);
+
+  memcpy(buf, dstar.bytes, GMSK_DATA_BYTES);
 }
@@ -1,7 +1,17 @@
 #ifndef DEVICE_GMSK_H
 #define DEVICE_GMSK_H
 
+#define GMSK_HEADER_BYTES       47
+#define GMSK_DATA_BYTES         18
+#define GMSK_FRAMES_PER_SUPER   21	// data frames between sync frames
+
 int gmsk_parse_header(unsigned char* buf, int buf_len);
 int gmsk_parse_data(unsigned char* buf, int buf_len);
 
+// Build GMSK frames in DVAP wire format, used to synthesize traffic.
+// Callsigns are space padded to 8 characters.
+void gmsk_build_header(unsigned char* buf, int stream_id, char* mycall,
+                       char* urcall, char* rpt1, char* rpt2);
+void gmsk_build_data(unsigned char* buf, int stream_id, int seq, int end);
+
 #endif
@@ -0,0 +1,321 @@
+// A single threaded event loop that multiplexes file descriptors and
+// timers with epoll, timerfd and eventfd
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "evloop.h"
+
+#ifdef EVLOOP_ENABLED
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+int
+evloop_init(evloop_t* loop)
+{
+  struct epoll_event ev;
+  int i;
+
+  if (!loop) return FALSE;
+
+  for (i = 0; i < EVLOOP_MAX_HANDLERS; i++) {
+    loop->handlers[i].fd = -1;
+  }
+  loop->shutdown = FALSE;
+  loop->running = -1;
+  loop->thread = pthread_self();
+  pthread_mutex_init(&(loop->handler_mutex), NULL);
+  pthread_cond_init(&(loop->handler_done), NULL);
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0) {
+    fprintf(stderr, "evloop_init - error creating epoll instance\n");
+    return FALSE;
+  }
+
+  loop->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (loop->wakefd < 0) {
+    fprintf(stderr, "evloop_init - error creating eventfd\n");
+    close(loop->epfd);
+    return FALSE;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = EVLOOP_MAX_HANDLERS;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) != 0) {
+    fprintf(stderr, "evloop_init - error watching eventfd\n");
+    close(loop->wakefd);
+    close(loop->epfd);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int
+evloop_add(evloop_t* loop, int fd, int is_timer, evloop_fptr callback,
+           void* arg)
+{
+  struct epoll_event ev;
+  int i;
+
+  pthread_mutex_lock(&(loop->handler_mutex));
+  for (i = 0; i < EVLOOP_MAX_HANDLERS; i++) {
+    if (loop->handlers[i].fd < 0) break;
+  }
+  if (i >= EVLOOP_MAX_HANDLERS) {
+    pthread_mutex_unlock(&(loop->handler_mutex));
+    fprintf(stderr, "evloop_add - too many handlers\n");
+    return FALSE;
+  }
+
+  loop->handlers[i].fd = fd;
+  loop->handlers[i].is_timer = is_timer;
+  loop->handlers[i].callback = callback;
+  loop->handlers[i].arg = arg;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = i;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    loop->handlers[i].fd = -1;
+    pthread_mutex_unlock(&(loop->handler_mutex));
+    fprintf(stderr, "evloop_add - error watching fd %d\n", fd);
+    return FALSE;
+  }
+  pthread_mutex_unlock(&(loop->handler_mutex));
+
+  return TRUE;
+}
+
+int
+evloop_add_fd(evloop_t* loop, int fd, evloop_fptr callback, void* arg)
+{
+  if (!loop) return FALSE;
+  return evloop_add(loop, fd, FALSE, callback, arg);
+}
+
+int
+evloop_add_timer(evloop_t* loop, int interval_ms, int periodic,
+                 evloop_fptr callback, void* arg)
+{
+  int fd;
+
+  if (!loop) return -1;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "evloop_add_timer - error creating timerfd\n");
+    return -1;
+  }
+
+  if (!evloop_set_timer(fd, interval_ms, periodic) ||
+      !evloop_add(loop, fd, TRUE, callback, arg)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int
+evloop_set_timer(int timerfd, int interval_ms, int periodic)
+{
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = interval_ms / 1000;
+  spec.it_value.tv_nsec = (interval_ms % 1000) * 1000000L;
+  if (periodic) {
+    spec.it_interval = spec.it_value;
+  }
+
+  if (timerfd_settime(timerfd, 0, &spec, NULL) != 0) {
+    fprintf(stderr, "evloop_set_timer - error arming timer\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void
+evloop_remove_fd(evloop_t* loop, int fd)
+{
+  int i;
+
+  if (!loop || fd < 0) return;
+
+  pthread_mutex_lock(&(loop->handler_mutex));
+  for (i = 0; i < EVLOOP_MAX_HANDLERS; i++) {
+    if (loop->handlers[i].fd == fd) {
+      // Wait out a callback in progress unless we are that callback
+      while (loop->running == i &&
+             !pthread_equal(pthread_self(), loop->thread)) {
+        pthread_cond_wait(&(loop->handler_done), &(loop->handler_mutex));
+      }
+      epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+      if (loop->handlers[i].is_timer) {
+        close(fd);
+      }
+      loop->handlers[i].fd = -1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(loop->handler_mutex));
+}
+
+int
+evloop_start(evloop_t* loop)
+{
+  sigset_t all, old;
+  int ret;
+
+  if (!loop) return FALSE;
+
+  // Signal handlers must run on another thread, they may wait on
+  // replies this thread delivers
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  ret = pthread_create(&(loop->thread), NULL, evloop_run, loop);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return (ret == 0) ? TRUE : FALSE;
+}
+
+void
+evloop_stop(evloop_t* loop)
+{
+  if (!loop) return;
+  evloop_event_signal(loop->wakefd);
+}
+
+void
+evloop_wait(evloop_t* loop)
+{
+  int i;
+
+  if (!loop) return;
+  pthread_join(loop->thread, NULL);
+
+  for (i = 0; i < EVLOOP_MAX_HANDLERS; i++) {
+    if (loop->handlers[i].fd >= 0 && loop->handlers[i].is_timer) {
+      close(loop->handlers[i].fd);
+    }
+    loop->handlers[i].fd = -1;
+  }
+  close(loop->wakefd);
+  close(loop->epfd);
+  pthread_mutex_destroy(&(loop->handler_mutex));
+  pthread_cond_destroy(&(loop->handler_done));
+}
+
+void*
+evloop_run(void* arg)
+{
+  evloop_t* loop = (evloop_t *)arg;
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+  evloop_handler_t handler;
+  uint64_t count;
+  int i, n;
+
+  while (!loop->shutdown) {
+    n = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Error waiting for events\n");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u32 >= EVLOOP_MAX_HANDLERS) {
+        loop->shutdown = TRUE;
+        continue;
+      }
+
+      // Copy the handler, a callback may remove itself or others
+      pthread_mutex_lock(&(loop->handler_mutex));
+      handler = loop->handlers[events[i].data.u32];
+      if (handler.fd >= 0) {
+        loop->running = events[i].data.u32;
+      }
+      pthread_mutex_unlock(&(loop->handler_mutex));
+      if (handler.fd < 0) continue;
+
+      if (!handler.is_timer ||
+          read(handler.fd, &count, sizeof(count)) == sizeof(count)) {
+        (handler.callback)(handler.arg);
+      }
+
+      pthread_mutex_lock(&(loop->handler_mutex));
+      loop->running = -1;
+      pthread_cond_broadcast(&(loop->handler_done));
+      pthread_mutex_unlock(&(loop->handler_mutex));
+    }
+  }
+
+  return NULL;
+}
+
+int
+evloop_event_create(void)
+{
+  return eventfd(0, EFD_CLOEXEC);
+}
+
+void
+evloop_event_signal(int eventfd)
+{
+  uint64_t one = 1;
+  write(eventfd, &one, sizeof(one));
+}
+
+void
+evloop_event_wait(int eventfd)
+{
+  uint64_t count;
+  while (read(eventfd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+#else
+
+int
+evloop_init(evloop_t* loop)
+{
+  fprintf(stderr, "evloop_init - event loop not supported on this platform\n");
+  return FALSE;
+}
+
+int
+evloop_add_fd(evloop_t* loop, int fd, evloop_fptr callback, void* arg)
+{
+  return FALSE;
+}
+
+int
+evloop_add_timer(evloop_t* loop, int interval_ms, int periodic,
+                 evloop_fptr callback, void* arg)
+{
+  return -1;
+}
+
+int
+evloop_set_timer(int timerfd, int interval_ms, int periodic)
+{
+  return FALSE;
+}
+
+void evloop_remove_fd(evloop_t* loop, int fd) {}
+int evloop_start(evloop_t* loop) { return FALSE; }
+void evloop_stop(evloop_t* loop) {}
+void evloop_wait(evloop_t* loop) {}
+void* evloop_run(void* arg) { return NULL; }
+int evloop_event_create(void) { return -1; }
+void evloop_event_signal(int eventfd) {}
+void evloop_event_wait(int eventfd) {}
+
+#endif
@@ -0,0 +1,71 @@
+// A single threaded event loop that multiplexes file descriptors and
+// timers with epoll, timerfd and eventfd
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <pthread.h>
+
+#ifdef __linux__
+#define EVLOOP_ENABLED
+#endif
+
+#define EVLOOP_MAX_HANDLERS 16
+#define EVLOOP_MAX_EVENTS   8
+
+// evloop_fptr is a function pointer that takes the argument given when
+// the handler was registered
+typedef void (*evloop_fptr)(void* arg);
+
+typedef struct {
+  int fd;			// -1 when slot is free
+  int is_timer;			// true if fd is a timerfd
+  evloop_fptr callback;
+  void* arg;
+} evloop_handler_t;
+
+typedef struct {
+  int epfd;
+  int wakefd;			// eventfd written to stop the loop
+  int shutdown;			// only touched by the loop thread
+
+  evloop_handler_t handlers[EVLOOP_MAX_HANDLERS];
+  pthread_mutex_t handler_mutex;	// acquire before changing handlers
+  pthread_cond_t handler_done;		// signalled when a callback returns
+  int running;				// handler slot in a callback, or -1
+
+  pthread_t thread;		// pthread running evloop_run
+} evloop_t;
+
+int evloop_init(evloop_t* loop);
+
+// Call callback whenever fd is readable
+int evloop_add_fd(evloop_t* loop, int fd, evloop_fptr callback, void* arg);
+
+// Create a timer and call callback each time it fires. A zero interval
+// creates a disarmed timer. Returns the timer fd or -1 on error.
+int evloop_add_timer(evloop_t* loop, int interval_ms, int periodic,
+                     evloop_fptr callback, void* arg);
+int evloop_set_timer(int timerfd, int interval_ms, int periodic);
+
+// Stop watching fd, timer fds are also closed. Once this returns the
+// callback is not running and will not be called again.
+void evloop_remove_fd(evloop_t* loop, int fd);
+
+// Run the loop in its own thread with all signals blocked
+int evloop_start(evloop_t* loop);
+
+// Wake the loop thread and have it exit, safe to call from a signal handler
+void evloop_stop(evloop_t* loop);
+
+// Block until the loop thread exits then release loop resources
+void evloop_wait(evloop_t* loop);
+
+void* evloop_run(void* arg);
+
+// One-shot wakeup events for threads waiting outside the loop. Signalling
+// is safe from a signal handler.
+int evloop_event_create(void);
+void evloop_event_signal(int eventfd);
+void evloop_event_wait(int eventfd);
+
+#endif
@@ -0,0 +1,151 @@
+// A buffered DVAP frame decoder
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "device.h"
+#include "framer.h"
+#include "trace.h"
+
+void
+framer_init(framer_t* f, int fd)
+{
+  f->fd = fd;
+  f->start = 0;
+  f->end = 0;
+  f->syncing = FALSE;
+  f->reads = 0;
+  f->frames = 0;
+  f->resyncs = 0;
+  f->skipped_bytes = 0;
+}
+
+int
+framer_valid_header(unsigned char* buf)
+{
+  int header = (buf[0] << 8) + buf[1];
+  int len = buf[0] + ((buf[1] & 0x1F) << 8);
+  int msg_type = (buf[1] & 0xE0) >> 5;
+
+  switch (header) {
+  case DVAP_DATA_FM_HDR:
+  case DVAP_DATA_GMSK_HDR:
+  case DVAP_DATA_GMSK_DATA:
+  case DVAP_GMSK_TX_ACK_HDR:
+    return TRUE;
+  }
+
+  // Latency trace frames from the server, see trace.h
+  if (len == TRACE_FRAME_BYTES && ((buf[1] << 8) + buf[0]) == TRACE_FRAME_TYPE) {
+    return TRUE;
+  }
+
+  // Range responses are never requested, capped like items so a corrupt
+  // length byte cannot pass as one and swallow kilobytes of real frames
+  switch (msg_type) {
+  case DVAP_MSG_TARGET_ITEM_RESPONSE:
+  case DVAP_MSG_TARGET_UNSOLICITED:
+  case DVAP_MSG_TARGET_RANGE_RESPONSE:
+    return (len >= 4 && len <= FRAMER_MAX_CTRL_BYTES);
+  case DVAP_MSG_TARGET_DATA_ACK:
+    // Watchdog and network keepalives
+    return (len == 3);
+  default:
+    // Radio data only comes in the fixed sizes above
+    return FALSE;
+  }
+}
+
+int
+framer_fill(framer_t* f)
+{
+  int n;
+
+  // Move a partial frame to the front so frames stay contiguous
+  if (f->start > 0) {
+    memmove(f->buf, &f->buf[f->start], f->end - f->start);
+    f->end -= f->start;
+    f->start = 0;
+  }
+
+  if (f->end >= FRAMER_BUF_BYTES) {
+    // Buffer full without a complete frame, drop it and resync
+    f->skipped_bytes += f->end;
+    f->end = 0;
+    if (!f->syncing) {
+      f->resyncs += 1;
+      f->syncing = TRUE;
+    }
+  }
+
+  n = read(f->fd, &f->buf[f->end], FRAMER_BUF_BYTES - f->end);
+  f->reads += 1;
+  if (n <= 0) {
+    debug_print("framer_fill - returned %d\n", n);
+    return n;
+  }
+  f->end += n;
+  return n;
+}
+
+int
+framer_next(framer_t* f, unsigned char** frame, char* msg_type)
+{
+  unsigned char* p;
+  int avail, len;
+
+  while ((avail = f->end - f->start) >= 2) {
+    p = &f->buf[f->start];
+    len = p[0] + ((p[1] & 0x1F) << 8);
+
+    // While resyncing a candidate header must be followed by another
+    // valid header, if enough data is buffered to tell
+    if (!framer_valid_header(p) ||
+        (f->syncing && avail >= len + 2 && !framer_valid_header(&p[len]))) {
+      if (!f->syncing) {
+        f->resyncs += 1;
+        f->syncing = TRUE;
+      }
+      f->start += 1;
+      f->skipped_bytes += 1;
+      continue;
+    }
+
+    if (avail < len) {
+      return 0;
+    }
+
+    f->syncing = FALSE;
+    f->start += len;
+    f->frames += 1;
+    *frame = p;
+    if (msg_type) {
+      *msg_type = (p[1] & 0xE0) >> 5;
+    }
+    return len;
+  }
+
+  return 0;
+}
+
+int
+framer_read(framer_t* f, char* msg_type, unsigned char* buf, int buf_bytes)
+{
+  unsigned char* frame;
+  int n, len;
+
+  while ((len = framer_next(f, &frame, msg_type)) == 0) {
+    n = framer_fill(f);
+    if (n <= 0) {
+      return n;
+    }
+  }
+
+  if (len > buf_bytes) {
+    fprintf(stderr, "framer_read - frame is %d bytes but only %d bytes available\n", len, buf_bytes);
+    return -1;
+  }
+  memcpy(buf, frame, len);
+  return len;
+}
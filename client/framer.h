@@ -0,0 +1,43 @@
+// A buffered DVAP frame decoder. Each read() pulls in as many bytes as
+// are available and every complete frame is handed out as a view into
+// the buffer. Corrupt headers are skipped by scanning for the next
+// plausible DVAP header.
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#define FRAMER_BUF_BYTES       16384	// holds at least two max size frames
+#define FRAMER_MAX_CTRL_BYTES  64	// largest plausible control item
+
+typedef struct {
+  int fd;
+  unsigned char buf[FRAMER_BUF_BYTES];
+  int start;			// first unconsumed byte
+  int end;			// one past the last buffered byte
+  int syncing;			// true while scanning for a valid header
+
+  unsigned long reads;		// read() calls made
+  unsigned long frames;		// frames returned
+  unsigned long resyncs;	// times the stream lost sync
+  unsigned long skipped_bytes;	// bytes discarded while resyncing
+} framer_t;
+
+void framer_init(framer_t* f, int fd);
+
+// Read once from the fd, returns bytes read, 0 on end of file or -1 on
+// error
+int framer_fill(framer_t* f);
+
+// Return the length of the next buffered frame and point frame at it,
+// or 0 if no complete frame is buffered. The view is valid until the
+// next call to framer_fill().
+int framer_next(framer_t* f, unsigned char** frame, char* msg_type);
+
+// Read a single frame into buf, reading from the fd only when nothing is
+// buffered. Returns packet_read() style results.
+int framer_read(framer_t* f, char* msg_type, unsigned char* buf,
+                int buf_bytes);
+
+// True if the two bytes could start a DVAP frame
+int framer_valid_header(unsigned char* buf);
+
+#endif
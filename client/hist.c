@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+
+void
+hist_init(hist_t* h)
+{
+  memset(h, 0, sizeof(hist_t));
+}
+
+static int
+hist_index(unsigned long long value)
+{
+  int shift = 0;
+
+  if (value >> (HIST_MAX_SHIFT + HIST_SUB_BITS + 1)) {
+    value = (1ULL << (HIST_MAX_SHIFT + HIST_SUB_BITS + 1)) - 1;
+  }
+  while ((value >> shift) >= 2 * HIST_SUB) {
+    shift++;
+  }
+  return shift * HIST_SUB + (value >> shift);
+}
+
+// Lowest value counted in a bucket
+static unsigned long long
+hist_value(int index)
+{
+  int shift = (index < 2 * HIST_SUB) ? 0 : index / HIST_SUB - 1;
+  return (unsigned long long)(index - shift * HIST_SUB) << shift;
+}
+
+void
+hist_record(hist_t* h, unsigned long long value)
+{
+  h->counts[hist_index(value)]++;
+  if (!h->total || value < h->min) h->min = value;
+  if (value > h->max) h->max = value;
+  h->total++;
+  h->sum += value;
+}
+
+unsigned long long
+hist_percentile(hist_t* h, double percent)
+{
+  unsigned long want = (unsigned long)(h->total * percent / 100.0 + 0.5);
+  unsigned long seen = 0;
+  int i;
+
+  if (want < 1) want = 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= want) {
+      return (hist_value(i) > h->max) ? h->max : hist_value(i);
+    }
+  }
+  return h->max;
+}
+
+void
+hist_print(hist_t* h, char* name)
+{
+  if (!h->total) {
+    printf("  %-24s no samples\n", name);
+    return;
+  }
+  printf("  %-24s %7lu  mean %7llu  p50 %7llu  p90 %7llu  p99 %7llu  "
+         "p99.9 %7llu  max %7llu\n", name, h->total, h->sum / h->total,
+         hist_percentile(h, 50), hist_percentile(h, 90),
+         hist_percentile(h, 99), hist_percentile(h, 99.9), h->max);
+}
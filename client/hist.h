@@ -0,0 +1,29 @@
+// Log-linear latency histogram in the style of HdrHistogram. Values
+// below 128 are counted exactly, above that each power of two is split
+// into 64 buckets, so any value is recorded to within about 1.5%.
+#ifndef HIST_H
+#define HIST_H
+
+#define HIST_SUB_BITS   6
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT  25			// values up to 2^31 - 1
+#define HIST_BUCKETS    ((HIST_MAX_SHIFT + 2) * HIST_SUB)
+
+typedef struct {
+  unsigned long counts[HIST_BUCKETS];
+  unsigned long total;
+  unsigned long long sum;
+  unsigned long long min;
+  unsigned long long max;
+} hist_t;
+
+void hist_init(hist_t* h);
+void hist_record(hist_t* h, unsigned long long value);
+
+// Smallest recorded value that percent of the samples are at or below
+unsigned long long hist_percentile(hist_t* h, double percent);
+
+// Print count, mean and percentiles on one line prefixed with name
+void hist_print(hist_t* h, char* name);
+
+#endif
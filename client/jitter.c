@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "device.h"
+#include "jitter.h"
+
+#define JITTER_FRAME_US TXSCHED_FRAME_US
+
+static int
+jitter_stream_id(unsigned char* buf)
+{
+  return (buf[3] << 8) + buf[2];
+}
+
+// Depth for the next stream from the jitter estimate, enough to cover
+// about three times the mean deviation plus a frame
+static int
+jitter_target_depth(jitter_t* jb)
+{
+  int depth = 1 + (3 * jb->jitter_us + JITTER_FRAME_US - 1) / JITTER_FRAME_US;
+
+  if (depth < JITTER_MIN_DEPTH) depth = JITTER_MIN_DEPTH;
+  if (depth > JITTER_MAX_DEPTH) depth = JITTER_MAX_DEPTH;
+  return depth;
+}
+
+static void
+jitter_reset(jitter_t* jb)
+{
+  jb->active = FALSE;
+  jb->started = FALSE;
+  jb->header_pending = FALSE;
+  memset(jb->present, 0, sizeof(jb->present));
+  jb->buffered = 0;
+  jb->next_seq = 0;
+  jb->end_seq = -1;
+  jb->last_rx_seq = -1;
+}
+
+// Interarrival jitter as in RFC 3550, how far each frame's spacing from
+// the previous one strays from the spacing its seq says it should have
+static void
+jitter_estimate(jitter_t* jb, int seq, unsigned long long now)
+{
+  long long d;
+  int frames;
+
+  if (jb->last_rx_seq >= 0) {
+    frames = (seq - jb->last_rx_seq + JITTER_SLOTS) % JITTER_SLOTS;
+    d = (long long)(now - jb->last_rx_us) - (long long)frames * JITTER_FRAME_US;
+    if (d < 0) d = -d;
+    jb->jitter_us += (d - jb->jitter_us) / 16;
+  }
+  jb->last_rx_us = now;
+  jb->last_rx_seq = seq;
+}
+
+static void
+jitter_put_header(jitter_t* jb, unsigned char* buf)
+{
+  int stream_id = jitter_stream_id(buf);
+
+  // Headers are repeated by some gateways, keep the stream going
+  if (jb->active && stream_id == jb->stream_id) {
+    return;
+  }
+
+  // A new stream cuts off whatever is left of the last one
+  jb->flushed += jb->buffered;
+  jitter_reset(jb);
+  jb->active = TRUE;
+  jb->stream_id = stream_id;
+  memcpy(jb->header, buf, GMSK_HEADER_BYTES);
+  jb->header_pending = TRUE;
+  jb->depth = jitter_target_depth(jb);
+  jb->header_us = now_us();
+  jb->last_rx_us = jb->header_us;
+  jb->streams++;
+}
+
+static void
+jitter_put_data(jitter_t* jb, unsigned char* buf)
+{
+  union dvap_dstar_data_union dstar;
+  unsigned long long now = now_us();
+  int seq, ahead;
+
+  memcpy(dstar.bytes, buf, GMSK_DATA_BYTES);
+  if (!jb->active || jitter_stream_id(buf) != jb->stream_id) {
+    jb->orphaned++;
+    return;
+  }
+  seq = dstar.data.seq % JITTER_SLOTS;
+
+  // Streams start on a sync frame, but one joined part way through
+  // plays from wherever its first frame lands
+  if (!jb->started && jb->buffered == 0) {
+    jb->next_seq = seq;
+  }
+
+  // Seq only counts within a superframe, so split the circle into
+  // frames still to be played and frames whose slot has already gone
+  ahead = (seq - jb->next_seq + JITTER_SLOTS) % JITTER_SLOTS;
+  if (ahead >= JITTER_AHEAD) {
+    // Straight after the newest frame means the sender runs fast rather
+    // than this frame being late, skip the oldest slot to make room
+    if (jb->last_rx_seq < 0 ||
+        (seq - jb->last_rx_seq + JITTER_SLOTS) % JITTER_SLOTS >
+        JITTER_SLOTS - JITTER_AHEAD) {
+      jb->late++;
+      return;
+    }
+    while (ahead >= JITTER_AHEAD) {
+      if (jb->present[jb->next_seq]) {
+        jb->present[jb->next_seq] = FALSE;
+        jb->buffered--;
+      }
+      jb->next_seq = (jb->next_seq + 1) % JITTER_SLOTS;
+      jb->overflow++;
+      ahead--;
+    }
+  }
+  if (jb->present[seq]) {
+    jb->duplicate++;
+    return;
+  }
+
+  jitter_estimate(jb, seq, now);
+  memcpy(jb->slots[seq], buf, GMSK_DATA_BYTES);
+  jb->present[seq] = TRUE;
+  jb->buffered++;
+  if (dstar.data.end_of_stream_flag) {
+    jb->end_seq = seq;
+  }
+}
+
+void
+jitter_put(jitter_t* jb, unsigned char* buf, int buf_bytes)
+{
+  unsigned int header;
+
+  if (buf_bytes < 2) return;
+  header = (buf[1] << 8) + buf[0];
+
+  pthread_mutex_lock(&jb->mutex);
+  if (header == 0xA02F && buf_bytes == GMSK_HEADER_BYTES) {
+    jitter_put_header(jb, buf);
+  }
+  else if (header == 0xC012 && buf_bytes == GMSK_DATA_BYTES) {
+    jitter_put_data(jb, buf);
+  }
+  else {
+    pthread_mutex_unlock(&jb->mutex);
+    jb->output(jb->arg, buf, buf_bytes);
+    return;
+  }
+  pthread_mutex_unlock(&jb->mutex);
+}
+
+void
+jitter_tick(jitter_t* jb)
+{
+  unsigned char frame[GMSK_HEADER_BYTES];
+  unsigned long long now = now_us();
+  int frame_bytes = 0;
+  int seq;
+
+  pthread_mutex_lock(&jb->mutex);
+  if (!jb->active) {
+    pthread_mutex_unlock(&jb->mutex);
+    return;
+  }
+
+  // Hold the header back with the prefill so the device does not key
+  // up and then run dry waiting for the first frames
+  if (!jb->started) {
+    if (jb->buffered < jb->depth && jb->end_seq < 0 &&
+        now - jb->header_us < 2ULL * jb->depth * JITTER_FRAME_US) {
+      pthread_mutex_unlock(&jb->mutex);
+      return;
+    }
+    jb->started = TRUE;
+  }
+
+  if (jb->header_pending) {
+    memcpy(frame, jb->header, GMSK_HEADER_BYTES);
+    frame_bytes = GMSK_HEADER_BYTES;
+    jb->header_pending = FALSE;
+  }
+  else {
+    seq = jb->next_seq;
+    if (jb->present[seq]) {
+      memcpy(frame, jb->slots[seq], GMSK_DATA_BYTES);
+      jb->present[seq] = FALSE;
+      jb->buffered--;
+      jb->played++;
+    }
+    else {
+      // Fill the gap with silence carrying the sync or filler slow data
+      // for this position, the stream is ended here if it has gone quiet
+      gmsk_build_data(frame, jb->stream_id, seq,
+                      jb->buffered == 0 &&
+                      now - jb->last_rx_us >= JITTER_STREAM_TIMEOUT_MS * 1000);
+      jb->concealed++;
+    }
+    frame_bytes = GMSK_DATA_BYTES;
+    jb->next_seq = (seq + 1) % JITTER_SLOTS;
+
+    if (seq == jb->end_seq || (frame[4] & 0x40)) {
+      jitter_reset(jb);
+    }
+  }
+  pthread_mutex_unlock(&jb->mutex);
+
+  jb->output(jb->arg, frame, frame_bytes);
+}
+
+static void
+jitter_timer_handler(void* arg)
+{
+  jitter_t* jb = (jitter_t *)arg;
+  int n = txsched_release(&jb->sched);
+
+  while (n-- > 0) {
+    jitter_tick(jb);
+  }
+}
+
+static void*
+jitter_loop(void* arg)
+{
+  jitter_t* jb = (jitter_t *)arg;
+  int n, shutdown;
+
+  for (;;) {
+    n = txsched_wait(&jb->sched);
+
+    pthread_mutex_lock(&jb->mutex);
+    shutdown = jb->shutdown;
+    pthread_mutex_unlock(&jb->mutex);
+    if (shutdown) break;
+
+    while (n-- > 0) {
+      jitter_tick(jb);
+    }
+  }
+  return NULL;
+}
+
+int
+jitter_init(jitter_t* jb, jitter_out_fptr output, void* arg, evloop_t* loop)
+{
+  memset(jb, 0, sizeof(jitter_t));
+  jb->output = output;
+  jb->arg = arg;
+  jb->jitter_us = (JITTER_INITIAL_DEPTH - 1) * JITTER_FRAME_US / 3;
+  jb->loop = loop;
+  jb->timer = -1;
+  jitter_reset(jb);
+
+  if (pthread_mutex_init(&jb->mutex, NULL)) {
+    fprintf(stderr, "jitter_init - error creating mutex\n");
+    return FALSE;
+  }
+
+  // Deadlines are tracked by the scheduler, the loop timer only wakes
+  // the loop up once a period
+  txsched_init(&jb->sched, JITTER_FRAME_US);
+  if (loop) {
+    jb->timer = evloop_add_timer(loop, JITTER_FRAME_US / 1000, TRUE,
+                                 jitter_timer_handler, jb);
+    if (jb->timer < 0) {
+      fprintf(stderr, "jitter_init - error adding playout timer\n");
+      pthread_mutex_destroy(&jb->mutex);
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  if (pthread_create(&jb->thread, NULL, jitter_loop, jb)) {
+    fprintf(stderr, "jitter_init - error creating playout thread\n");
+    pthread_mutex_destroy(&jb->mutex);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void
+jitter_stop(jitter_t* jb)
+{
+  if (jb->loop) {
+    evloop_remove_fd(jb->loop, jb->timer);
+  }
+  else {
+    pthread_mutex_lock(&jb->mutex);
+    jb->shutdown = TRUE;
+    pthread_mutex_unlock(&jb->mutex);
+    pthread_join(jb->thread, NULL);
+  }
+  pthread_mutex_destroy(&jb->mutex);
+}
@@ -0,0 +1,78 @@
+// Receive side jitter buffer for GMSK streams from the network. Frames
+// are slotted by their superframe sequence number and played out one
+// per frame period, gaps are filled so slow data sync stays in place.
+#ifndef JITTER_H
+#define JITTER_H
+
+#include <pthread.h>
+
+#include "device_gmsk.h"
+#include "evloop.h"
+#include "txsched.h"
+
+#define JITTER_SLOTS          GMSK_FRAMES_PER_SUPER
+#define JITTER_AHEAD          12    // frames ahead accepted, rest are late
+#define JITTER_MIN_DEPTH      2     // frames buffered before playout starts
+#define JITTER_MAX_DEPTH      8
+#define JITTER_INITIAL_DEPTH  3
+#define JITTER_STREAM_TIMEOUT_MS 500 // end a stream that has gone quiet
+
+// Called with each frame to play, one per frame period
+typedef void (*jitter_out_fptr)(void* arg, unsigned char* buf, int buf_bytes);
+
+typedef struct {
+  jitter_out_fptr output;
+  void* arg;
+
+  // Stream being played, acquire mutex before using any of this
+  pthread_mutex_t mutex;
+  int active;
+  int started;                          // prefill done, playing out
+  int stream_id;
+  unsigned char header[GMSK_HEADER_BYTES];
+  int header_pending;                   // header still to be played
+  unsigned char slots[JITTER_SLOTS][GMSK_DATA_BYTES];
+  int present[JITTER_SLOTS];            // slot holds a frame, by seq
+  int buffered;                         // frames in slots
+  int next_seq;                         // seq played next
+  int end_seq;                          // seq carrying end of stream, or -1
+  int depth;                            // prefill for this stream
+  unsigned long long header_us;         // when the header arrived
+  unsigned long long last_rx_us;        // when the last frame arrived
+  int last_rx_seq;
+
+  // Interarrival jitter estimate in us, sets depth for the next stream
+  int jitter_us;
+
+  unsigned long streams;
+  unsigned long played;                 // frames played as received
+  unsigned long concealed;              // filler frames played for gaps
+  unsigned long late;                   // arrived after their slot played
+  unsigned long overflow;               // skipped to catch up a fast sender
+  unsigned long flushed;                // cut off by the next stream
+  unsigned long duplicate;
+  unsigned long orphaned;               // data without a stream header
+
+  // Playout ticker
+  txsched_t sched;
+  evloop_t* loop;
+  int timer;                            // timer fd with an event loop
+  int shutdown;                         // acquire mutex before using
+  pthread_t thread;
+} jitter_t;
+
+// Start the buffer, ticking from loop if set or else its own thread
+int jitter_init(jitter_t* jb, jitter_out_fptr output, void* arg,
+                evloop_t* loop);
+
+// Stop the ticker and wait for it
+void jitter_stop(jitter_t* jb);
+
+// Add a packet from the network. GMSK headers and data are buffered,
+// anything else is passed straight to output.
+void jitter_put(jitter_t* jb, unsigned char* buf, int buf_bytes);
+
+// Play the next frame, called once per frame period by the ticker
+void jitter_tick(jitter_t* jb);
+
+#endif
@@ -0,0 +1,429 @@
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+
+#ifdef LOG_FUTEX_ENABLED
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+int log_level = LOG_INFO;
+
+// Each slot's seq says whose turn it is: equal to the position when a
+// producer may fill it, one past when the writer may read it
+static log_record_t log_ring[LOG_RING_SIZE];
+static unsigned long log_tail;		// next position producers claim
+static unsigned long log_head;		// next position the writer reads
+static unsigned long log_lost;
+static int log_running = FALSE;
+static int log_pushing;			// producers that may still publish
+static int log_shutdown = FALSE;
+static pthread_t log_thread;
+
+// The writer sets log_waiting before it sleeps on log_wakeups, which
+// producers then bump to wake it
+static int log_waiting = FALSE;
+static unsigned int log_wakeups;
+
+void
+log_set_level(int level)
+{
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+unsigned long
+log_dropped(void)
+{
+  return __atomic_load_n(&log_lost, __ATOMIC_RELAXED);
+}
+
+// Find the next conversion in a printf format. Flags, width and
+// precision go in spec, the length modifier in len. Returns the rest of
+// the format or NULL when there are no more conversions.
+static const char*
+log_next_spec(const char* p, char* spec, int spec_bytes, char* len,
+              char* conv)
+{
+  int n = 0;
+
+  p = strchr(p, '%');
+  if (!p) return NULL;
+
+  spec[n++] = *p++;
+  while (*p && strchr("-+ #0123456789.", *p) && n < spec_bytes - 4) {
+    spec[n++] = *p++;
+  }
+  spec[n] = 0;
+  len[0] = len[1] = 0;
+  while (*p && strchr("hlzjt", *p)) {
+    len[len[0] ? 1 : 0] = *p++;
+  }
+  *conv = *p;
+  return *p ? p + 1 : p;
+}
+
+static int
+log_is_long(char* len)
+{
+  return (len[0] && len[0] != 'h' && !(len[0] == 'l' && len[1] == 'l'));
+}
+
+// Copy the arguments a format uses into the record. %s strings are
+// copied into its text area so they need not outlive the call.
+static void
+log_capture(log_record_t* r, const char* fmt, va_list ap)
+{
+  char spec[32];
+  char len[2];
+  char conv;
+  const char* p = fmt;
+  const char* s;
+  int n;
+
+  r->nargs = 0;
+  r->text_len = 0;
+  while ((p = log_next_spec(p, spec, sizeof(spec), len, &conv)) != NULL) {
+    if (conv == '%' || conv == 0) continue;
+    if (r->nargs == LOG_MAX_ARGS) break;
+
+    switch (conv) {
+    case 'd': case 'i': case 'c':
+      if (len[1] == 'l') r->args[r->nargs].i = va_arg(ap, long long);
+      else if (log_is_long(len)) r->args[r->nargs].i = va_arg(ap, long);
+      else r->args[r->nargs].i = va_arg(ap, int);
+      break;
+    case 'u': case 'x': case 'X': case 'o':
+      if (len[1] == 'l') r->args[r->nargs].u = va_arg(ap, unsigned long long);
+      else if (log_is_long(len)) r->args[r->nargs].u = va_arg(ap, unsigned long);
+      else r->args[r->nargs].u = va_arg(ap, unsigned int);
+      break;
+    case 'f': case 'e': case 'g': case 'F': case 'E': case 'G':
+      r->args[r->nargs].d = va_arg(ap, double);
+      break;
+    case 's':
+      s = va_arg(ap, const char*);
+      if (!s) s = "(null)";
+      n = strnlen(s, LOG_TEXT_BYTES - 1 - r->text_len);
+      memcpy(&(r->text[r->text_len]), s, n);
+      r->args[r->nargs].i = r->text_len;
+      r->text_len += n;
+      r->text[r->text_len] = 0;
+      if (r->text_len < LOG_TEXT_BYTES - 1) r->text_len++;
+      break;
+    default:
+      r->args[r->nargs].p = va_arg(ap, void*);
+      break;
+    }
+    r->nargs++;
+  }
+}
+
+static void
+log_format_hex(FILE* fp, unsigned char* data, int data_bytes, int orig_bytes)
+{
+  int i;
+
+  for (i = 0; i < data_bytes; i++) {
+    fprintf(fp, " %02X", data[i]);
+  }
+  if (data_bytes < orig_bytes) {
+    fprintf(fp, " ...");
+  }
+  fprintf(fp, " (%d bytes)\n", orig_bytes);
+}
+
+static void
+log_write_arg(FILE* fp, log_record_t* r, int arg, char* spec, char* len,
+              char conv)
+{
+  int n = strlen(spec);
+
+  if (len[0]) spec[n++] = len[0];
+  if (len[1]) spec[n++] = len[1];
+  spec[n++] = conv;
+  spec[n] = 0;
+
+  switch (conv) {
+  case 'd': case 'i': case 'c':
+    if (len[1] == 'l') fprintf(fp, spec, r->args[arg].i);
+    else if (log_is_long(len)) fprintf(fp, spec, (long)r->args[arg].i);
+    else fprintf(fp, spec, (int)r->args[arg].i);
+    break;
+  case 'u': case 'x': case 'X': case 'o':
+    if (len[1] == 'l') fprintf(fp, spec, r->args[arg].u);
+    else if (log_is_long(len)) fprintf(fp, spec, (unsigned long)r->args[arg].u);
+    else fprintf(fp, spec, (unsigned int)r->args[arg].u);
+    break;
+  case 'f': case 'e': case 'g': case 'F': case 'E': case 'G':
+    fprintf(fp, spec, r->args[arg].d);
+    break;
+  case 's':
+    fprintf(fp, spec, &(r->text[r->args[arg].i]));
+    break;
+  default:
+    fprintf(fp, spec, r->args[arg].p);
+    break;
+  }
+}
+
+// Format a record the way printf would have at the call site, with the
+// time it was logged in front
+static void
+log_write(log_record_t* r)
+{
+  FILE* fp = (r->level <= LOG_WARN) ? stderr : stdout;
+  char spec[32];
+  char len[2];
+  char conv;
+  const char* p = r->fmt;
+  const char* next;
+  time_t secs = r->time_us / 1000000ULL;
+  struct tm tm;
+  int arg = 0;
+  int n;
+
+  localtime_r(&secs, &tm);
+  flockfile(fp);
+  fprintf(fp, "%02d:%02d:%02d.%06llu ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+          r->time_us % 1000000ULL);
+
+  while ((next = log_next_spec(p, spec, sizeof(spec), len, &conv)) != NULL) {
+    fwrite(p, 1, strchr(p, '%') - p, fp);
+    p = next;
+    if (conv == '%') {
+      fputc('%', fp);
+    }
+    else if (conv && arg < r->nargs) {
+      log_write_arg(fp, r, arg++, spec, len, conv);
+    }
+  }
+  n = strlen(p);
+  fwrite(p, 1, n, fp);
+
+  // Messages usually end in a newline, dumps go on the same line
+  if (r->orig_len > 0) {
+    (r->format ? r->format : log_format_hex)(fp, r->data, r->data_len,
+                                               r->orig_len);
+  }
+  else if (n == 0 || p[n - 1] != '\n') {
+    fputc('\n', fp);
+  }
+  funlockfile(fp);
+}
+
+// Claim a slot for a new record, or NULL if the ring is full
+static log_record_t*
+log_claim(unsigned long* pos)
+{
+  unsigned long p = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+  log_record_t* r;
+  long diff;
+
+  for (;;) {
+    r = &log_ring[p & (LOG_RING_SIZE - 1)];
+    diff = (long)(__atomic_load_n(&(r->seq), __ATOMIC_ACQUIRE) - p);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&log_tail, &p, p + 1, TRUE,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos = p;
+        return r;
+      }
+    }
+    else if (diff < 0) {
+      return NULL;
+    }
+    else {
+      p = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void
+log_wake(void)
+{
+  __atomic_add_fetch(&log_wakeups, 1, __ATOMIC_SEQ_CST);
+#ifdef LOG_FUTEX_ENABLED
+  syscall(SYS_futex, &log_wakeups, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+          NULL, NULL, 0);
+#endif
+}
+
+static void
+log_vpush(int level, log_format_fptr format, unsigned char* data,
+          int data_bytes, const char* fmt, va_list ap)
+{
+  log_record_t local;
+  log_record_t* r = &local;
+  unsigned long pos = 0;
+  struct timespec ts;
+  int async;
+
+  // Counted before checking log_running, so log_stop either sees this
+  // producer or the producer sees the writer stopped
+  __atomic_add_fetch(&log_pushing, 1, __ATOMIC_SEQ_CST);
+  async = __atomic_load_n(&log_running, __ATOMIC_SEQ_CST);
+  if (!async) {
+    __atomic_sub_fetch(&log_pushing, 1, __ATOMIC_RELEASE);
+  }
+
+  // Never wait for the writer, a full ring loses the record instead
+  if (async) {
+    r = log_claim(&pos);
+    if (!r) {
+      __atomic_add_fetch(&log_lost, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&log_pushing, 1, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r->time_us = (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  r->fmt = fmt;
+  r->level = level;
+  log_capture(r, fmt, ap);
+  r->format = format;
+  r->orig_len = (data && data_bytes > 0) ? data_bytes : 0;
+  r->data_len = (r->orig_len < LOG_DATA_BYTES) ? r->orig_len : LOG_DATA_BYTES;
+  if (r->data_len > 0) {
+    memcpy(r->data, data, r->data_len);
+  }
+
+  if (async) {
+    __atomic_store_n(&(r->seq), pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_waiting, __ATOMIC_SEQ_CST)) {
+      log_wake();
+    }
+    __atomic_sub_fetch(&log_pushing, 1, __ATOMIC_RELEASE);
+  }
+  else {
+    log_write(r);
+  }
+}
+
+void
+log_printf(int level, const char* fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  log_vpush(level, NULL, NULL, 0, fmt, ap);
+  va_end(ap);
+}
+
+void
+log_data(int level, log_format_fptr format, unsigned char* data,
+         int data_bytes, const char* fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  log_vpush(level, format, data, data_bytes, fmt, ap);
+  va_end(ap);
+}
+
+// Write every record that is ready, returns how many there were
+static int
+log_drain(void)
+{
+  log_record_t* r;
+  int n = 0;
+
+  for (;;) {
+    r = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&(r->seq), __ATOMIC_ACQUIRE) != log_head + 1) {
+      break;
+    }
+    log_write(r);
+    __atomic_store_n(&(r->seq), log_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    log_head++;
+    n++;
+  }
+  return n;
+}
+
+// Sleep until a record is pushed or the writer is stopped
+static void
+log_park(void)
+{
+#ifdef LOG_FUTEX_ENABLED
+  unsigned int wakeups = __atomic_load_n(&log_wakeups, __ATOMIC_SEQ_CST);
+  log_record_t* r = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+
+  // Producers check log_waiting after publishing, so either they see it
+  // set or the record is seen here
+  __atomic_store_n(&log_waiting, TRUE, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(r->seq), __ATOMIC_SEQ_CST) != log_head + 1 &&
+      !__atomic_load_n(&log_shutdown, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, &log_wakeups, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+            wakeups, NULL, NULL, 0);
+  }
+  __atomic_store_n(&log_waiting, FALSE, __ATOMIC_RELAXED);
+#else
+  sleep_ms(LOG_IDLE_MS);
+#endif
+}
+
+static void*
+log_loop(void* arg)
+{
+  unsigned long reported = 0;
+  unsigned long lost;
+
+  while (!__atomic_load_n(&log_shutdown, __ATOMIC_ACQUIRE)) {
+    if (log_drain() > 0) continue;
+
+    fflush(stdout);
+    lost = log_dropped();
+    if (lost != reported) {
+      fprintf(stderr, "log: %lu records dropped, ring full\n",
+              lost - reported);
+      reported = lost;
+    }
+    log_park();
+  }
+  return NULL;
+}
+
+int
+log_start(void)
+{
+  unsigned long i;
+
+  for (i = 0; i < LOG_RING_SIZE; i++) {
+    log_ring[i].seq = i;
+  }
+  log_head = log_tail = 0;
+  log_shutdown = FALSE;
+  __atomic_store_n(&log_running, TRUE, __ATOMIC_RELEASE);
+
+  if (pthread_create(&log_thread, NULL, log_loop, NULL)) {
+    __atomic_store_n(&log_running, FALSE, __ATOMIC_RELEASE);
+    fprintf(stderr, "log_start - error creating thread\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void
+log_stop(void)
+{
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) return;
+
+  __atomic_store_n(&log_running, FALSE, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&log_shutdown, TRUE, __ATOMIC_SEQ_CST);
+  log_wake();
+  pthread_join(log_thread, NULL);
+
+  // Producers that saw the writer running may have claimed a slot and
+  // not yet published it, wait for them before the last drain
+  while (__atomic_load_n(&log_pushing, __ATOMIC_ACQUIRE) > 0) {
+    sleep_ms(1);
+  }
+  log_drain();
+  fflush(stdout);
+}
@@ -0,0 +1,88 @@
+// Asynchronous logging. Callers push compact records into a lock-free
+// ring and a background thread formats and writes them, so hot threads
+// never wait on stdout. Levels can be changed at runtime.
+#ifndef LOG_H
+#define LOG_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SIZE   1024	// records, power of two
+#define LOG_MAX_ARGS    8
+#define LOG_TEXT_BYTES  96	// copies of %s arguments
+#define LOG_DATA_BYTES  64	// binary payload, longer payloads are cut
+#define LOG_IDLE_MS     10	// writer poll interval without futexes
+
+// The writer sleeps on a futex while the ring is empty, Linux only
+#ifdef __linux__
+#define LOG_FUTEX_ENABLED
+#endif
+
+// Prints a record's binary payload after its message. data_bytes is
+// what was kept, orig_bytes what the caller passed.
+typedef void (*log_format_fptr)(FILE* fp, unsigned char* data,
+                                int data_bytes, int orig_bytes);
+
+typedef union {
+  long long i;
+  unsigned long long u;
+  double d;
+  void* p;
+} log_arg_t;
+
+typedef struct {
+  unsigned long seq;			// ring position this slot is ready for
+  unsigned long long time_us;
+  const char* fmt;			// must be a string literal
+  int level;
+  int nargs;
+  log_arg_t args[LOG_MAX_ARGS];		// %s args hold an offset into text
+  int text_len;
+  char text[LOG_TEXT_BYTES];
+  log_format_fptr format;
+  int data_len;
+  int orig_len;
+  unsigned char data[LOG_DATA_BYTES];
+} log_record_t;
+
+// Records at or below this level are kept, change with log_set_level
+extern int log_level;
+
+#define log_enabled(level) \
+  ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+// printf style message, arguments are captured and formatted later
+#define LOG(level, ...) \
+  do { if (log_enabled(level)) log_printf((level), __VA_ARGS__); } while (0)
+
+// Message followed by a hex dump of buf
+#define LOG_HEX(level, prefix, buf, len) \
+  do { if (log_enabled(level)) \
+      log_data((level), NULL, (buf), (len), "%s:", (prefix)); } while (0)
+
+void log_set_level(int level);
+
+// Start the writer thread. Until then, and after log_stop, records are
+// written as they are logged.
+int log_start(void);
+
+// Write out everything still in the ring and stop the writer thread
+void log_stop(void);
+
+void log_printf(int level, const char* fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Message followed by data, printed by format or as hex if it is NULL
+void log_data(int level, log_format_fptr format, unsigned char* data,
+              int data_bytes, const char* fmt, ...)
+  __attribute__((format(printf, 5, 6)));
+
+// Records lost because the ring was full
+unsigned long log_dropped(void);
+
+#endif
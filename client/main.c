@@ -1,11 +1,19 @@
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include "arbiter.h"
 #include "common.h"
 #include "device.h"
+#include "device_config.h"
 #include "device_gmsk.h"
+#include "evloop.h"
+#include "jitter.h"
+#include "metrics.h"
 #include "network.h"
+#include "trace.h"
 
 #define PORT 8191
 #define USE_DVAP 1
@@ -18,6 +26,31 @@
 static network_t* network_ptr;
 static device_t* device_ptr;
 
+// Drive device and network from a single event loop thread
+static int use_evloop = FALSE;
+static evloop_t event_loop;
+
+// NET_TRANSPORT_* used to reach the server
+static int transport = NET_TRANSPORT_TCP;
+
+// Lets one network stream at a time through to the radio
+static arbiter_t arbiter;
+
+// Smooths network arrival before frames are queued for the device
+static jitter_t jitter;
+
+// Set once the device is configured and can take frames
+static int device_ready = FALSE;
+
+// Follow frames sent to the server with trace frames
+static int trace_tx = FALSE;
+
+// Latency of traced frames received from the server, SIGUSR1 dumps it
+static trace_t tracer;
+
+// Last known device settings, kept across reconnects
+static dvap_config_t device_state;
+
 // Try connecting to server until user cancels
 static int net_init_retry = TRUE;
 
@@ -42,16 +75,20 @@ void net_rx_callback(unsigned char* buf, int buf_bytes)
   if (buf_bytes < 2) return;
   header = (buf[1] << 8) + buf[0];
 
-  // Write packet to device then sleep the appropriate amount to
-  // avoid overflowing DVAP's receive buffer
-  dvap_pkt_write(device_ptr, buf, buf_bytes);
-  sleep_ms(buf_bytes);
+  // Trace frames are only kept until the frame they follow is played
+  if (buf_bytes == TRACE_FRAME_BYTES && header == TRACE_FRAME_TYPE) {
+    trace_receive(&tracer, buf, buf_bytes);
+    return;
+  }
+
+  // One stream at a time is buffered and played out, see jitter_output
+  arbiter_put(&arbiter, buf, buf_bytes);
   return;
 
   switch(header) {
   // FM data
   case 0x8142:
-    hex_dump("fm data", buf, 2);
+    LOG_HEX(LOG_DEBUG, "fm data", buf, 2);
     break;
   // GMSK header
   case 0xA02F:
@@ -63,14 +100,41 @@ void net_rx_callback(unsigned char* buf, int buf_bytes)
     //gmsk_parse_data(buf, buf_bytes);
     break;
   default:
-    hex_dump("net rx unrecognized", buf, buf_bytes);
+    LOG_HEX(LOG_INFO, "net rx unrecognized", buf, buf_bytes);
     break;
   }
 }
 
+// Called by the arbiter with frames from the stream holding the radio
+static void
+arbiter_output(void* arg, unsigned char* buf, int buf_bytes)
+{
+  jitter_put(&jitter, buf, buf_bytes);
+}
+
+// Called by the jitter buffer with each frame to play
+static void
+jitter_output(void* arg, unsigned char* buf, int buf_bytes)
+{
+  // Queue packet for the device, it is written as soon as the DVAP
+  // reports room in its transmit fifo
+  if (device_ready) {
+    dvap_pkt_write(device_ptr, buf, buf_bytes);
+  }
+}
+
+// Called by the device as each queued frame is written to the serial port
+static void
+device_tx_output(void* arg, unsigned char* buf, int buf_bytes)
+{
+  trace_complete(&tracer, buf, buf_bytes);
+}
+
 // Called when we receive data from DVAP device
 void dvap_rx_callback(unsigned char* buf, int buf_len)
 {
+  unsigned char trace[TRACE_FRAME_BYTES];
+  unsigned long long rx_us = trace_now();
   unsigned int header;
   if (buf_len < 2) return;
   header = (buf[1] << 8) + buf[0];
@@ -78,7 +142,7 @@ void dvap_rx_callback(unsigned char* buf, int buf_len)
   switch(header) {
   // FM data
   case 0x8142:
-    hex_dump("fm data", buf, 2);
+    LOG_HEX(LOG_DEBUG, "fm data", buf, 2);
     break;
   // GMSK header
   case 0xA02F:
@@ -92,22 +156,65 @@ void dvap_rx_callback(unsigned char* buf, int buf_len)
     net_write(network_ptr, buf, buf_len);
     break;
   default:
-    hex_dump("dvap rx unrecognized", buf, buf_len);
-    break;
+    LOG_HEX(LOG_INFO, "dvap rx unrecognized", buf, buf_len);
+    return;
+  }
+
+  if (trace_tx && trace_build(trace, buf, buf_len, rx_us)) {
+    net_write(network_ptr, trace, TRACE_FRAME_BYTES);
+  }
+}
+
+// Dump latency histograms whenever SIGUSR1 arrives, SIGUSR2 switches
+// debug logging on and off
+static void*
+signal_loop(void* arg)
+{
+  sigset_t* set = (sigset_t *)arg;
+  int base_level = log_level;
+  int sig;
+
+  while (sigwait(set, &sig) == 0) {
+    if (sig == SIGUSR1) {
+      trace_print(&tracer);
+    }
+    else if (log_level < LOG_DEBUG) {
+      log_set_level(LOG_DEBUG);
+    }
+    else {
+      log_set_level(base_level);
+    }
   }
+  return NULL;
 }
 
 int
-timeout_retry_wrapper(int argc, char* argv[])
+timeout_retry_wrapper(char* server, char* port)
 {
-  char buf[20];
+  dvap_config_t config;
   int net_init_success;
+  evloop_t* loop = NULL;
+
+  if (use_evloop) {
+    if (!evloop_init(&event_loop) || !evloop_start(&event_loop)) {
+      fprintf(stderr, "Error starting event loop\n");
+      return -1;
+    }
+    loop = &event_loop;
+  }
+
+  arbiter_init(&arbiter, arbiter_output, NULL);
+  if (!jitter_init(&jitter, jitter_output, NULL, loop)) {
+    fprintf(stderr, "Error starting jitter buffer\n");
+    return -1;
+  }
 
   // Attempt to initialize network, retry on failure until user cancels
   do {
-    net_init_success = net_init(network_ptr, argv[1], PORT, &net_rx_callback);
+    net_init_success = net_init_transport(network_ptr, server, PORT,
+                                          &net_rx_callback, loop, transport);
     if (!net_init_success) {
-      fprintf(stderr, "Error connecting to %s on port %d\n", argv[1], PORT);
+      fprintf(stderr, "Error connecting to %s on port %d\n", server, PORT);
       sleep(2);
     }
     if (!net_init_retry) {
@@ -115,18 +222,15 @@ timeout_retry_wrapper(int argc, char* argv[])
     }
   }
   while(!net_init_success && net_init_retry);
-  printf("Connected to %s on port %d\n", argv[1], PORT);
+  printf("Connected to %s on port %d\n", server, PORT);
 
 #if USE_DVAP
   // Initialize DVAP
-  if (!dvap_init(device_ptr, argv[2], &dvap_rx_callback)) {
-    fprintf(stderr, "No DVAP device found at %s\n", argv[2]);
+  if (!dvap_init_evloop(device_ptr, port, &dvap_rx_callback, loop)) {
+    fprintf(stderr, "No DVAP device found at %s\n", port);
     return -1;
   }
-
-  if (get_name(device_ptr, buf, 20)) {
-    printf("Device name: %s\n", buf);
-  }
+  dvap_set_tx_callback(device_ptr, &device_tx_output, NULL);
 
   /*
     Dump from DVAPTool program
@@ -146,25 +250,63 @@ timeout_retry_wrapper(int argc, char* argv[])
     [set run state]   tx: 05 00 18 00 00   rx: 05 00 18 00 00
    */
 
-  //set_operation_mode(device_ptr, DVAP_OPERATION_NORMAL);
-  //set_squelch_threshold(device_ptr, -80);
-  //set_tx_power(device_ptr, -12);
-  printf("cmd - set rx frequency\n");
-  set_rx_frequency(device_ptr, 145670000);
-  printf("cmd - set tx frequency\n");
-  set_tx_frequency(device_ptr, 145670000);
-  printf("cmd - set modulation type\n");
-  set_modulation_type(device_ptr, DVAP_MODULATION_GMSK);
-
-  printf("cmd - dvap start\n");
-  if (!dvap_start(device_ptr)) {
+  // Only settings that differ from the last known device state are
+  // written, a reconnect after a network drop just reads them back and
+  // starts the device
+  dvap_config_init(&config);
+  //dvap_config_operation_mode(&config, DVAP_OPERATION_NORMAL);
+  //dvap_config_squelch_threshold(&config, -80);
+  //dvap_config_tx_power(&config, -12);
+  dvap_config_rx_frequency(&config, 145670000);
+  dvap_config_tx_frequency(&config, 145670000);
+  dvap_config_modulation(&config, DVAP_MODULATION_GMSK);
+  dvap_config_run(&config, TRUE);
+
+  if (!dvap_config_apply(device_ptr, &config, &device_state)) {
+    fprintf(stderr, "Error configuring DVAP device\n");
+    return -1;
+  }
+  printf("Device name: %s\n", device_state.name);
+  printf("Device configured in %llu ms, %d settings sent, %d unchanged\n",
+         device_state.apply_us / 1000, device_state.sent,
+         device_state.verified);
+
+  if (!dvap_start_watchdog(device_ptr)) {
     fprintf(stderr, "Error starting DVAP device\n");
     return -1;
   }
+  device_ready = TRUE;
 #endif
 
-  // Block until net_read_loop finishes
+  // Block until net_read_loop finishes or net_stop() is called
   net_wait(network_ptr);
+  printf("Network tx: %lu frames in %lu sends, %lu dropped, "
+         "max queue depth %d\n", network_ptr->tx_frames,
+         network_ptr->tx_batches, network_ptr->tx_dropped,
+         network_ptr->tx_depth_max);
+  if (transport == NET_TRANSPORT_UDP) {
+    printf("Network rx: %lu frames, %lu lost, %lu late, %lu duplicate, "
+           "%lu resyncs\n", network_ptr->udp_rx.received,
+           network_ptr->udp_rx.lost, network_ptr->udp_rx.late,
+           network_ptr->udp_rx.duplicate, network_ptr->udp_rx.resyncs);
+  }
+
+  // Nothing more is played once the stream in progress is cut off
+  jitter_stop(&jitter);
+  device_ready = FALSE;
+  printf("Jitter buffer: %lu streams, %lu frames played, %lu filled, "
+         "%lu late, %lu skipped, %lu cut off, %lu duplicate, %lu orphaned, "
+         "jitter %d us\n", jitter.streams, jitter.played, jitter.concealed,
+         jitter.late, jitter.overflow, jitter.flushed,
+         jitter.duplicate, jitter.orphaned, jitter.jitter_us);
+  txsched_print(&jitter.sched, "Playout");
+  printf("Stream arbiter: %lu streams, %lu taken over, %lu hung, "
+         "%lu frames discarded\n", arbiter.streams, arbiter.takeovers,
+         arbiter.hangs, arbiter.discarded);
+
+  if (tracer.hops[TRACE_HOPS - 1].total) {
+    trace_print(&tracer);
+  }
 
   // If net_read_loop finished due to a network timeout,
   // signal stop of dvap so we can restart
@@ -180,6 +322,11 @@ timeout_retry_wrapper(int argc, char* argv[])
   dvap_wait(device_ptr);
 #endif
 
+  if (loop) {
+    evloop_stop(loop);
+    evloop_wait(loop);
+  }
+
   return 0;
 }
 
@@ -188,10 +335,42 @@ main(int argc, char* argv[])
 {
   network_t n_ctx;
   device_t d_ctx;
-  int ret;
+  sigset_t signals;
+  pthread_t signal_thread;
+  int metrics_port = 0;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "em:tuv")) != -1) {
+    switch (opt) {
+    case 'e':
+      use_evloop = TRUE;
+      break;
+    case 'm':
+      metrics_port = atoi(optarg);
+      break;
+    case 't':
+      trace_tx = TRUE;
+      break;
+    case 'u':
+      transport = NET_TRANSPORT_UDP;
+      break;
+    case 'v':
+      log_set_level(LOG_DEBUG);
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
 
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <server> <device>\n", argv[0]);
+  if (argc - optind < 2) {
+    fprintf(stderr, "Usage: %s [-e] [-m port] [-t] [-u] [-v] <server> "
+            "<device>\n", argv[0]);
+    fprintf(stderr, "  -e run device and network from a single event loop\n");
+    fprintf(stderr, "  -m serve counters over HTTP on port\n");
+    fprintf(stderr, "  -t trace frames sent for per hop latency\n");
+    fprintf(stderr, "  -u connect over UDP instead of TCP\n");
+    fprintf(stderr, "  -v log debug messages, SIGUSR2 toggles this\n");
     return -1;
   }
 
@@ -200,9 +379,32 @@ main(int argc, char* argv[])
   device_ptr = &d_ctx;
   signal(SIGINT, interrupt);
 
+  // Every thread started from here on leaves SIGUSR1 and SIGUSR2 to
+  // the signal thread
+  if (!trace_init(&tracer)) {
+    return -1;
+  }
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  pthread_create(&signal_thread, NULL, signal_loop, &signals);
+
+  if (!log_start()) {
+    return -1;
+  }
+
+  if (metrics_port && !metrics_start(metrics_port)) {
+    return -1;
+  }
+
   do {
-    ret = timeout_retry_wrapper(argc, argv);
+    ret = timeout_retry_wrapper(argv[optind], argv[optind + 1]);
+    if (n_ctx.try_restart) {
+      METRIC_ADD(net_reconnects, 1);
+    }
   } while(n_ctx.try_restart);
+  log_stop();
   if (ret) return ret;
 
   return 0;
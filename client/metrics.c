@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "device.h"
+#include "metrics.h"
+
+#define METRICS_BODY_BYTES 4096
+
+metrics_t metrics = { .fd = -1 };
+
+static const char* metrics_msg_names[METRICS_MSG_TYPES] = {
+  "item_response", "unsolicited", "range_response", "data_ack",
+  "data_item_0", "data_item_1", "data_item_2", "data_item_3",
+};
+
+void
+metrics_pkt_write(unsigned long long ns)
+{
+  unsigned long long max = METRIC_GET(dvap_pkt_write_max_ns);
+
+  METRIC_ADD(dvap_pkt_write_calls, 1);
+  METRIC_ADD(dvap_pkt_write_ns, ns);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&(metrics.dvap_pkt_write_max_ns), &max,
+                                      ns, TRUE, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+}
+
+// Serial utilization over the last window, as a fraction of the line rate
+static void
+metrics_sample(void)
+{
+  unsigned long long now = now_us();
+  unsigned long rx = METRIC_GET(serial_rx_bytes);
+  unsigned long tx = METRIC_GET(serial_tx_bytes);
+  double line;
+
+  if (now - metrics.sample_us < METRICS_SAMPLE_MS * 1000ULL) return;
+  line = (double)DVAP_BAUD_RATE / METRICS_SERIAL_BITS *
+    (now - metrics.sample_us) / 1000000.0;
+
+  metrics.serial_rx_utilization = (rx - metrics.sample_rx_bytes) / line;
+  metrics.serial_tx_utilization = (tx - metrics.sample_tx_bytes) / line;
+  metrics.sample_us = now;
+  metrics.sample_rx_bytes = rx;
+  metrics.sample_tx_bytes = tx;
+}
+
+#define METRICS_PRINT(...) \
+  len += snprintf(&buf[len], (len < buf_bytes) ? buf_bytes - len : 0, \
+                  __VA_ARGS__)
+
+static int
+metrics_format(char* buf, int buf_bytes)
+{
+  int len = 0;
+  int i;
+
+  METRICS_PRINT("# TYPE dvap_uptime_seconds gauge\n"
+                "dvap_uptime_seconds %llu\n",
+                (now_us() - metrics.start_us) / 1000000ULL);
+
+  METRICS_PRINT("# TYPE dvap_serial_bytes_total counter\n"
+                "dvap_serial_bytes_total{dir=\"rx\"} %lu\n"
+                "dvap_serial_bytes_total{dir=\"tx\"} %lu\n",
+                METRIC_GET(serial_rx_bytes), METRIC_GET(serial_tx_bytes));
+  METRICS_PRINT("# TYPE dvap_serial_utilization gauge\n"
+                "dvap_serial_utilization{dir=\"rx\"} %.4f\n"
+                "dvap_serial_utilization{dir=\"tx\"} %.4f\n",
+                metrics.serial_rx_utilization,
+                metrics.serial_tx_utilization);
+
+  METRICS_PRINT("# TYPE dvap_messages_total counter\n");
+  for (i = 0; i < METRICS_MSG_TYPES; i++) {
+    METRICS_PRINT("dvap_messages_total{type=\"%s\"} %lu\n",
+                  metrics_msg_names[i], METRIC_GET(dvap_rx_msgs[i]));
+  }
+
+  METRICS_PRINT("# TYPE dvap_frames_total counter\n"
+                "dvap_frames_total{dir=\"rx\"} %lu\n"
+                "dvap_frames_total{dir=\"tx\"} %lu\n"
+                "# TYPE dvap_frame_bytes_total counter\n"
+                "dvap_frame_bytes_total{dir=\"rx\"} %lu\n"
+                "dvap_frame_bytes_total{dir=\"tx\"} %lu\n"
+                "# TYPE dvap_tx_dropped_total counter\n"
+                "dvap_tx_dropped_total %lu\n"
+                "# TYPE dvap_txq_depth gauge\n"
+                "dvap_txq_depth %d\n",
+                METRIC_GET(dvap_rx_frames), METRIC_GET(dvap_tx_frames),
+                METRIC_GET(dvap_rx_bytes), METRIC_GET(dvap_tx_bytes),
+                METRIC_GET(dvap_tx_dropped), METRIC_GET(dvap_txq_depth));
+
+  METRICS_PRINT("# TYPE dvap_pkt_write_calls_total counter\n"
+                "dvap_pkt_write_calls_total %lu\n"
+                "# TYPE dvap_pkt_write_seconds_total counter\n"
+                "dvap_pkt_write_seconds_total %.6f\n"
+                "# TYPE dvap_pkt_write_max_seconds gauge\n"
+                "dvap_pkt_write_max_seconds %.6f\n",
+                METRIC_GET(dvap_pkt_write_calls),
+                METRIC_GET(dvap_pkt_write_ns) / 1e9,
+                METRIC_GET(dvap_pkt_write_max_ns) / 1e9);
+
+  METRICS_PRINT("# TYPE net_frames_total counter\n"
+                "net_frames_total{dir=\"rx\"} %lu\n"
+                "net_frames_total{dir=\"tx\"} %lu\n"
+                "# TYPE net_bytes_total counter\n"
+                "net_bytes_total{dir=\"rx\"} %lu\n"
+                "net_bytes_total{dir=\"tx\"} %lu\n"
+                "# TYPE net_write_failures_total counter\n"
+                "net_write_failures_total %lu\n"
+                "# TYPE net_reconnects_total counter\n"
+                "net_reconnects_total %lu\n"
+                "# TYPE net_txq_depth gauge\n"
+                "net_txq_depth %d\n",
+                METRIC_GET(net_rx_frames), METRIC_GET(net_tx_frames),
+                METRIC_GET(net_rx_bytes), METRIC_GET(net_tx_bytes),
+                METRIC_GET(net_write_failures), METRIC_GET(net_reconnects),
+                METRIC_GET(net_txq_depth));
+
+  return (len < buf_bytes) ? len : buf_bytes - 1;
+}
+
+// Answer one request, whatever the path, then close
+static void
+metrics_serve(int fd)
+{
+  char req[1024];
+  char body[METRICS_BODY_BYTES];
+  char head[128];
+  struct timeval timeout = { 1, 0 };
+  int body_len, head_len;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (recv(fd, req, sizeof(req), 0) <= 0) {
+    return;
+  }
+
+  body_len = metrics_format(body, sizeof(body));
+  head_len = snprintf(head, sizeof(head),
+                      "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %d\r\n\r\n", body_len);
+  if (send(fd, head, head_len, MSG_NOSIGNAL) == head_len) {
+    send(fd, body, body_len, MSG_NOSIGNAL);
+  }
+}
+
+static void*
+metrics_loop(void* arg)
+{
+  struct pollfd pfd;
+  int fd;
+
+  pfd.fd = metrics.fd;
+  pfd.events = POLLIN;
+  for (;;) {
+    if (poll(&pfd, 1, METRICS_SAMPLE_MS) < 0 && errno != EINTR) {
+      fprintf(stderr, "metrics_loop - error waiting for connections\n");
+      break;
+    }
+    metrics_sample();
+    if (!(pfd.revents & POLLIN)) continue;
+
+    fd = accept(metrics.fd, NULL, NULL);
+    if (fd < 0) continue;
+    metrics_serve(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+int
+metrics_start(int port)
+{
+  struct sockaddr_in addr;
+  int on = 1;
+
+  metrics.start_us = now_us();
+  metrics.sample_us = metrics.start_us;
+
+  metrics.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (metrics.fd < 0) {
+    fprintf(stderr, "metrics_start - error creating socket\n");
+    return FALSE;
+  }
+  setsockopt(metrics.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(metrics.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(metrics.fd, 4) < 0) {
+    fprintf(stderr, "metrics_start - error listening on port %d\n", port);
+    close(metrics.fd);
+    metrics.fd = -1;
+    return FALSE;
+  }
+
+  if (pthread_create(&(metrics.thread), NULL, metrics_loop, NULL)) {
+    fprintf(stderr, "metrics_start - error creating thread\n");
+    close(metrics.fd);
+    metrics.fd = -1;
+    return FALSE;
+  }
+  return TRUE;
+}
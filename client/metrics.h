@@ -0,0 +1,67 @@
+// Runtime counters for the bridge client. Hot paths update them with
+// relaxed atomics, a small HTTP endpoint serves them as plain text in
+// the Prometheus exposition format for scraping.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+
+#define METRICS_SAMPLE_MS   1000	// serial utilization window
+#define METRICS_MSG_TYPES   8		// DVAP message types, 3 bits
+#define METRICS_SERIAL_BITS 10		// bits on the wire per byte, 8N1
+
+#define METRIC_ADD(name, n) \
+  __atomic_add_fetch(&(metrics.name), (n), __ATOMIC_RELAXED)
+#define METRIC_SET(name, v) \
+  __atomic_store_n(&(metrics.name), (v), __ATOMIC_RELAXED)
+#define METRIC_GET(name) \
+  __atomic_load_n(&(metrics.name), __ATOMIC_RELAXED)
+
+typedef struct {
+  // Serial line to the DVAP
+  unsigned long serial_rx_bytes;
+  unsigned long serial_tx_bytes;
+  unsigned long dvap_rx_msgs[METRICS_MSG_TYPES];	// by msg_type
+  unsigned long dvap_rx_frames;				// radio data
+  unsigned long dvap_rx_bytes;
+  unsigned long dvap_tx_frames;
+  unsigned long dvap_tx_bytes;
+  unsigned long dvap_tx_dropped;
+  int dvap_txq_depth;
+
+  // Time in dvap_pkt_write
+  unsigned long dvap_pkt_write_calls;
+  unsigned long long dvap_pkt_write_ns;
+  unsigned long long dvap_pkt_write_max_ns;
+
+  // Network
+  unsigned long net_rx_frames;
+  unsigned long net_rx_bytes;
+  unsigned long net_tx_frames;
+  unsigned long net_tx_bytes;
+  unsigned long net_write_failures;
+  unsigned long net_reconnects;
+  int net_txq_depth;
+
+  // Only touched by the endpoint thread
+  unsigned long long start_us;
+  unsigned long long sample_us;
+  unsigned long sample_rx_bytes;
+  unsigned long sample_tx_bytes;
+  double serial_rx_utilization;		// of DVAP_BAUD_RATE, last window
+  double serial_tx_utilization;
+
+  int fd;				// listening socket, -1 if none
+  pthread_t thread;
+} metrics_t;
+
+extern metrics_t metrics;
+
+// Serve counters over HTTP on port, on all interfaces. Without a call
+// the counters are still kept.
+int metrics_start(int port);
+
+// Record the time taken by one dvap_pkt_write call
+void metrics_pkt_write(unsigned long long ns);
+
+#endif
@@ -3,20 +3,90 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
 #include "common.h"
+#include "metrics.h"
 #include "network.h"
+#include "trace.h"
+
+static void net_evloop_read(void* arg);
+static void net_evloop_keepalive(void* arg);
+static void net_evloop_txfd(void* arg);
+static void net_evloop_send(void* arg);
+static int net_udp_send_ctrl(network_t* ctx, int type);
+static int net_udp_tx_flush(network_t* ctx, int flags);
+static int net_udp_read_handler(network_t* ctx);
 
 int
 net_init(network_t* ctx, char* hostname, int port, net_rx_fptr callback)
+{
+  return net_init_evloop(ctx, hostname, port, callback, NULL);
+}
+
+int
+net_init_evloop(network_t* ctx, char* hostname, int port,
+                net_rx_fptr callback, evloop_t* loop)
+{
+  return net_init_transport(ctx, hostname, port, callback, loop,
+                            NET_TRANSPORT_TCP);
+}
+
+// UDP sessions need heartbeats whatever the TCP keepalive setting
+static int
+net_keepalive_enabled(network_t* ctx)
+{
+#ifdef NET_KEEPALIVE_ENABLED
+  return TRUE;
+#else
+  return (ctx->transport == NET_TRANSPORT_UDP);
+#endif
+}
+
+// UDP always reads, heartbeats are how we know the server is there
+static int
+net_reads_enabled(network_t* ctx)
+{
+  return (ctx->callback || ctx->transport == NET_TRANSPORT_UDP);
+}
+
+static int
+net_keepalive_ms(network_t* ctx)
+{
+  if (ctx->transport == NET_TRANSPORT_UDP) {
+    return NET_UDP_HEARTBEAT_MS;
+  }
+  return NET_KEEPALIVE_SECS * 1000;
+}
+
+int
+net_init_transport(network_t* ctx, char* hostname, int port,
+                   net_rx_fptr callback, evloop_t* loop, int transport)
 {
   ctx->callback = callback;
+  ctx->transport = transport;
+  ctx->loop = loop;
+  ctx->keepalive_timer = -1;
+  ctx->stopfd = -1;
+  ctx->txfd = -1;
+  ctx->tx_timer = -1;
+  ctx->tx_pending_count = 0;
+  ctx->tx_offset = 0;
+  ctx->tx_frames = 0;
+  ctx->tx_batches = 0;
+  ctx->tx_dropped = 0;
+  ctx->tx_depth_max = 0;
+  ctx->udp_tx_seq = 0;
+  memset(&(ctx->udp_rx), 0, sizeof(net_seq_t));
+  queue_init(&(ctx->txq));
 
   strncpy(ctx->host, hostname, HOST_NAME_MAX);
   ctx->host[HOST_NAME_MAX] = 0;
@@ -31,10 +101,33 @@ net_init(network_t* ctx, char* hostname, int port, net_rx_fptr callback)
     return FALSE;
   }
 
-#ifdef NET_KEEPALIVE_ENABLED
-  pthread_create(&(ctx->keepalive_thread), NULL, net_keepalive_loop, ctx);
-#endif
-  if (ctx->callback) {
+  if (ctx->loop) {
+    ctx->stopfd = evloop_event_create();
+    ctx->txfd = evloop_event_create();
+    if (ctx->stopfd < 0 || ctx->txfd < 0) {
+      return FALSE;
+    }
+    ctx->tx_timer = evloop_add_timer(ctx->loop, 0, FALSE, net_evloop_send,
+                                     ctx);
+    if (!evloop_add_fd(ctx->loop, ctx->txfd, net_evloop_txfd, ctx)) {
+      return FALSE;
+    }
+    if (net_keepalive_enabled(ctx)) {
+      ctx->keepalive_timer = evloop_add_timer(ctx->loop, net_keepalive_ms(ctx),
+                                              TRUE, net_evloop_keepalive, ctx);
+    }
+    if (net_reads_enabled(ctx) &&
+        !evloop_add_fd(ctx->loop, ctx->fd, net_evloop_read, ctx)) {
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  pthread_create(&(ctx->tx_thread), NULL, net_tx_loop, ctx);
+  if (net_keepalive_enabled(ctx)) {
+    pthread_create(&(ctx->keepalive_thread), NULL, net_keepalive_loop, ctx);
+  }
+  if (net_reads_enabled(ctx)) {
     pthread_create(&(ctx->rx_thread), NULL, net_read_loop, ctx);
   }
   return TRUE;
@@ -44,6 +137,7 @@ int
 net_connect(network_t* ctx)
 {
   int fd, ret;
+  int one = 1;
   char portstr[6];
   struct addrinfo hints;
   struct addrinfo* servinfo;
@@ -53,7 +147,8 @@ net_connect(network_t* ctx)
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_socktype = (ctx->transport == NET_TRANSPORT_UDP) ?
+    SOCK_DGRAM : SOCK_STREAM;
 
   if ((ret = getaddrinfo(ctx->host, portstr, &hints, &servinfo)) != 0) {
     fprintf(stderr, "net_connect - %s\n", gai_strerror(ret));
@@ -75,9 +170,23 @@ net_connect(network_t* ctx)
   if (p == NULL) {
     return FALSE;
   }
+
+  // Voice frames are small and time critical, don't let Nagle hold them
+  if (ctx->transport == NET_TRANSPORT_TCP &&
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0) {
+    fprintf(stderr, "net_connect - error setting TCP_NODELAY\n");
+  }
   ctx->fd = fd;
+  framer_init(&(ctx->framer), fd);
   freeaddrinfo(servinfo);
 
+  // A connected UDP socket only filters addresses, say hello so the
+  // server opens a session
+  if (ctx->transport == NET_TRANSPORT_UDP) {
+    ctx->udp_last_rx_us = now_us();
+    net_udp_send_ctrl(ctx, NET_UDP_HEARTBEAT);
+  }
+
   return TRUE;
 }
 
@@ -85,12 +194,36 @@ void
 net_wait(network_t* ctx)
 {
   if (!ctx) return;
-  pthread_join(ctx->rx_thread, NULL);
-#ifdef NET_KEEPALIVE_ENABLED
-  pthread_join(ctx->keepalive_thread, NULL);
-#endif
+  if (ctx->loop) {
+    // Sleep until net_stop() rather than polling the shutdown flag
+    evloop_event_wait(ctx->stopfd);
+    evloop_remove_fd(ctx->loop, ctx->fd);
+    evloop_remove_fd(ctx->loop, ctx->keepalive_timer);
+    evloop_remove_fd(ctx->loop, ctx->txfd);
+    evloop_remove_fd(ctx->loop, ctx->tx_timer);
+    close(ctx->stopfd);
+    close(ctx->txfd);
+  }
+  else {
+    if (net_reads_enabled(ctx)) {
+      pthread_join(ctx->rx_thread, NULL);
+    }
+    pthread_join(ctx->tx_thread, NULL);
+    if (net_keepalive_enabled(ctx)) {
+      pthread_join(ctx->keepalive_thread, NULL);
+    }
+  }
+  if (ctx->transport == NET_TRANSPORT_UDP) {
+    net_udp_send_ctrl(ctx, NET_UDP_BYE);
+  }
   close(ctx->fd);
 
+  // Anything not sent by now is dropped with the connection
+  while (ctx->tx_pending_count > 0) {
+    buf_release(ctx->tx_pending[--ctx->tx_pending_count]);
+  }
+  queue_delete(&(ctx->txq));
+
   pthread_mutex_destroy(&(ctx->shutdown_mutex));
   pthread_mutex_destroy(&(ctx->tx_mutex));
 }
@@ -98,28 +231,169 @@ net_wait(network_t* ctx)
 int
 net_write(network_t* ctx, unsigned char* buf, int buf_bytes)
 {
-  int n;
-  int sent_bytes = 0;
+  buf_t* pkt;
+  int depth;
 
-  pthread_mutex_lock(&(ctx->tx_mutex));
-  while (sent_bytes < buf_bytes) {
-    n = send(ctx->fd, &buf[sent_bytes], buf_bytes-sent_bytes, 0);
+  if (!ctx || buf_bytes > NET_MAX_BYTES) return -1;
+
+  pkt = buf_alloc(ctx->txq.pool, buf_bytes);
+  if (!pkt) {
+    METRIC_ADD(net_write_failures, 1);
+    return -1;
+  }
+  memcpy(pkt->data, buf, buf_bytes);
+  pkt->len = buf_bytes;
+
+  // Drop rather than hold up the caller when the network has stalled
+  if (!queue_try_insert_buf(&(ctx->txq), pkt)) {
+    buf_release(pkt);
+    __atomic_add_fetch(&(ctx->tx_dropped), 1, __ATOMIC_RELAXED);
+    METRIC_ADD(net_write_failures, 1);
+    debug_print("%s\n", "net_write: tx queue full, dropping packet");
+    return -1;
+  }
+
+  depth = queue_count(&(ctx->txq));
+  METRIC_SET(net_txq_depth, depth);
+  if (depth > __atomic_load_n(&(ctx->tx_depth_max), __ATOMIC_RELAXED)) {
+    __atomic_store_n(&(ctx->tx_depth_max), depth, __ATOMIC_RELAXED);
+  }
+
+  if (ctx->loop) {
+    evloop_event_signal(ctx->txfd);
+  }
+  return buf_bytes;
+}
+
+int
+net_tx_depth(network_t* ctx)
+{
+  if (!ctx) return 0;
+  return queue_count(&(ctx->txq)) + ctx->tx_pending_count;
+}
+
+// Send as many pending frames as possible, topped up from txq, in one
+// sendmsg. Blocks until everything is sent unless flags has
+// MSG_DONTWAIT. Returns the frames still pending or -1 on error.
+static int
+net_tx_flush(network_t* ctx, int flags)
+{
+  struct iovec iov[NET_TX_BATCH];
+  struct msghdr msg;
+  buf_t* pkt;
+  int i, n, sent;
+  int done = 0;
+
+  while (ctx->tx_pending_count < NET_TX_BATCH &&
+         queue_try_remove_buf(&(ctx->txq), &pkt)) {
+    trace_stamp(pkt->data, pkt->len, TRACE_NET_TX);
+    ctx->tx_pending[ctx->tx_pending_count++] = pkt;
+  }
+  if (ctx->transport == NET_TRANSPORT_UDP) {
+    return net_udp_tx_flush(ctx, flags);
+  }
+
+  while (ctx->tx_pending_count > 0) {
+    for (i = 0; i < ctx->tx_pending_count; i++) {
+      iov[i].iov_base = ctx->tx_pending[i]->data;
+      iov[i].iov_len = ctx->tx_pending[i]->len;
+    }
+    iov[0].iov_base = (unsigned char *)iov[0].iov_base + ctx->tx_offset;
+    iov[0].iov_len -= ctx->tx_offset;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ctx->tx_pending_count;
+
+    pthread_mutex_lock(&(ctx->tx_mutex));
+    n = sendmsg(ctx->fd, &msg, flags | MSG_NOSIGNAL);
+    pthread_mutex_unlock(&(ctx->tx_mutex));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
     if (n <= 0) {
-      pthread_mutex_unlock(&(ctx->tx_mutex));
       fprintf(stderr, "net_write - error writing to socket\n");
+      METRIC_ADD(net_write_failures, 1);
       return -1;
     }
-    sent_bytes += n;
+    __atomic_add_fetch(&(ctx->tx_batches), 1, __ATOMIC_RELAXED);
+    METRIC_ADD(net_tx_bytes, n);
+
+    // Retire fully sent frames, keep the rest for the next call
+    sent = n + ctx->tx_offset;
+    ctx->tx_offset = 0;
+    for (i = 0; i < ctx->tx_pending_count; i++) {
+      if (sent < ctx->tx_pending[i]->len) {
+        ctx->tx_offset = sent;
+        break;
+      }
+      sent -= ctx->tx_pending[i]->len;
+      buf_release(ctx->tx_pending[i]);
+      done += 1;
+    }
+    ctx->tx_pending_count -= i;
+    memmove(ctx->tx_pending, &(ctx->tx_pending[i]),
+            ctx->tx_pending_count * sizeof(buf_t *));
   }
-  pthread_mutex_unlock(&(ctx->tx_mutex));
-  return sent_bytes;
+
+  __atomic_add_fetch(&(ctx->tx_frames), done, __ATOMIC_RELAXED);
+  METRIC_ADD(net_tx_frames, done);
+  METRIC_SET(net_txq_depth, queue_count(&(ctx->txq)));
+  return ctx->tx_pending_count;
+}
+
+void*
+net_tx_loop(void* arg)
+{
+  network_t* ctx = (network_t *)arg;
+  buf_t* pkt;
+
+  while (!net_should_shutdown(ctx)) {
+    if (!queue_remove_buf_timeout(&(ctx->txq), &pkt, NET_TX_WAIT_MS)) {
+      continue;
+    }
+    trace_stamp(pkt->data, pkt->len, TRACE_NET_TX);
+    ctx->tx_pending[ctx->tx_pending_count++] = pkt;
+
+    // Whatever queued up behind this frame goes in the same send
+    if (net_tx_flush(ctx, 0) < 0) {
+      net_stop(ctx, TRUE);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+net_evloop_send(void* arg)
+{
+  network_t* ctx = (network_t *)arg;
+  int pending = net_tx_flush(ctx, MSG_DONTWAIT);
+
+  if (pending < 0) {
+    net_stop(ctx, TRUE);
+  }
+  else if (pending > 0 && ctx->tx_timer >= 0) {
+    // The socket is full, try again shortly
+    evloop_set_timer(ctx->tx_timer, NET_TX_RETRY_MS, FALSE);
+  }
+}
+
+static void
+net_evloop_txfd(void* arg)
+{
+  network_t* ctx = (network_t *)arg;
+
+  evloop_event_wait(ctx->txfd);
+  net_evloop_send(ctx);
 }
 
 int
 net_read(network_t* ctx, char* msg_type, unsigned char* buf, int buf_bytes)
 {
   if (!ctx) return -1;
-  return packet_read(ctx->fd, msg_type, buf, buf_bytes);
+  return framer_read(&(ctx->framer), msg_type, buf, buf_bytes);
 }
 
 void
@@ -131,6 +405,9 @@ net_stop(network_t* ctx, int try_restart)
   pthread_mutex_lock(&(ctx->shutdown_mutex));
   ctx->shutdown = TRUE;
   pthread_mutex_unlock(&(ctx->shutdown_mutex));
+  if (ctx->loop) {
+    evloop_event_signal(ctx->stopfd);
+  }
 }
 
 int
@@ -145,26 +422,41 @@ net_should_shutdown(network_t* ctx)
   return shutdown;
 }
 
-void*
-net_keepalive_loop(void* arg)
+static void
+net_keepalive_send(network_t* ctx)
 {
-  network_t* ctx = (network_t *)arg;
   unsigned char buf[3];
-  int counter = NET_KEEPALIVE_SECS;
 
   buf[0] = 0x03;
   buf[1] = 0x60;
   buf[2] = 0x00;
 
+  if (ctx->transport == NET_TRANSPORT_UDP) {
+    // Heartbeats also check the server is still there
+    if (now_us() - ctx->udp_last_rx_us > NET_UDP_TIMEOUT_MS * 1000ULL) {
+      fprintf(stderr, "Timeout while reading from network\n");
+      net_stop(ctx, TRUE);
+      return;
+    }
+    net_udp_send_ctrl(ctx, NET_UDP_HEARTBEAT);
+    return;
+  }
+
+  net_write(ctx, buf, 3);
+  LOG_HEX(LOG_DEBUG, "net keepalive tx", buf, 3);
+}
+
+void*
+net_keepalive_loop(void* arg)
+{
+  network_t* ctx = (network_t *)arg;
+  int secs = net_keepalive_ms(ctx) / 1000;
+  int counter = secs;
+
   while(!net_should_shutdown(ctx)) {
     if (counter <= 0) {
-      pthread_mutex_lock(&(ctx->tx_mutex));
-      send(ctx->fd, buf, 3, 0);
-      pthread_mutex_unlock(&(ctx->tx_mutex));
-      counter = NET_KEEPALIVE_SECS;
-      if (DEBUG) {
-        hex_dump("net keepalive tx", buf, 3);
-      }
+      net_keepalive_send(ctx);
+      counter = secs;
     }
     counter -= 1;
     sleep(1);
@@ -173,15 +465,33 @@ net_keepalive_loop(void* arg)
   return NULL;
 }
 
+static void
+net_evloop_keepalive(void* arg)
+{
+  network_t* ctx = (network_t *)arg;
+  if (!net_should_shutdown(ctx)) {
+    net_keepalive_send(ctx);
+  }
+}
+
+static void
+net_evloop_read(void* arg)
+{
+  network_t* ctx = (network_t *)arg;
+
+  // Stop watching a failed connection so it doesn't spin the loop
+  if (!net_read_handler(ctx)) {
+    evloop_remove_fd(ctx->loop, ctx->fd);
+  }
+}
+
 void*
 net_read_loop(void* arg)
 {
   network_t* ctx = (network_t *)arg;
 
   fd_set set;
-  char msg_type;
   int ret;
-  unsigned char buf[NET_MAX_BYTES];
 
   struct timeval timeout;
   while(!net_should_shutdown(ctx)) {
@@ -201,22 +511,228 @@ net_read_loop(void* arg)
       continue;
     }
 
-    ret = net_read(ctx, &msg_type, buf, NET_MAX_BYTES);
-    if (ret < 0) {
-      fprintf(stderr, "Error reading from network\n");
-      net_stop(ctx, TRUE);
-      return NULL;
-    }
-    else if (ret == 0) {
-      fprintf(stderr, "Timeout while reading from network\n");
-      net_stop(ctx, TRUE);
+    if (!net_read_handler(ctx)) {
       return NULL;
     }
+  }
 
+  return NULL;
+}
+
+int
+net_read_handler(network_t* ctx)
+{
+  char msg_type;
+  int ret;
+  unsigned char* buf;
+
+  if (ctx->transport == NET_TRANSPORT_UDP) {
+    return net_udp_read_handler(ctx);
+  }
+
+  // Pull in everything available with a single read
+  ret = framer_fill(&(ctx->framer));
+  if (ret < 0) {
+    fprintf(stderr, "Error reading from network\n");
+    net_stop(ctx, TRUE);
+    return FALSE;
+  }
+  else if (ret == 0) {
+    fprintf(stderr, "Timeout while reading from network\n");
+    net_stop(ctx, TRUE);
+    return FALSE;
+  }
+
+  while ((ret = framer_next(&(ctx->framer), &buf, &msg_type)) > 0) {
+    METRIC_ADD(net_rx_frames, 1);
+    METRIC_ADD(net_rx_bytes, ret);
     if (ctx->callback) {
       (ctx->callback)(buf, ret);
     }
   }
+  return TRUE;
+}
 
-  return NULL;
+int
+net_seq_accept(net_seq_t* seq, unsigned int n)
+{
+  int diff;
+  unsigned int back;
+
+  if (!seq->started) {
+    seq->started = TRUE;
+    seq->first = n;
+    seq->next = n + 1;
+    seq->window = 1;
+    seq->received += 1;
+    return TRUE;
+  }
+
+  // Ahead of or at the expected number, anything skipped is lost
+  diff = (int)(n - seq->next);
+  if (diff >= 0) {
+    seq->lost += diff;
+    seq->window = (diff + 1 >= 64) ? 1 : (seq->window << (diff + 1)) | 1;
+    seq->next = n + 1;
+    seq->received += 1;
+    return TRUE;
+  }
+
+  // Too far behind to be reordering, the peer restarted its numbering,
+  // such as a new session on the server. Start over from this frame.
+  back = (unsigned int)(-diff) - 1;
+  if (back >= 64) {
+    seq->resyncs += 1;
+    seq->started = FALSE;
+    return net_seq_accept(seq, n);
+  }
+
+  // Behind, either filling a gap too late to play or a repeat
+  if (seq->window & (1ULL << back)) {
+    seq->duplicate += 1;
+    return FALSE;
+  }
+  seq->window |= (1ULL << back);
+
+  // Only gaps after the first frame were counted as lost
+  if ((int)(n - seq->first) > 0) {
+    seq->lost -= 1;
+  }
+  seq->late += 1;
+  return FALSE;
+}
+
+static void
+net_udp_put_header(unsigned char* buf, int type, unsigned int seq)
+{
+  buf[0] = type;
+  buf[1] = 0;
+  buf[2] = seq & 0xFF;
+  buf[3] = (seq >> 8) & 0xFF;
+  buf[4] = (seq >> 16) & 0xFF;
+  buf[5] = (seq >> 24) & 0xFF;
+}
+
+static int
+net_udp_send_ctrl(network_t* ctx, int type)
+{
+  unsigned char buf[NET_UDP_HEADER_BYTES];
+  int n;
+
+  net_udp_put_header(buf, type, 0);
+  pthread_mutex_lock(&(ctx->tx_mutex));
+  n = send(ctx->fd, buf, NET_UDP_HEADER_BYTES, MSG_NOSIGNAL);
+  pthread_mutex_unlock(&(ctx->tx_mutex));
+  return (n == NET_UDP_HEADER_BYTES);
+}
+
+// One datagram per frame so a loss costs a single frame. Returns the
+// frames still pending or -1 on error.
+static int
+net_udp_tx_flush(network_t* ctx, int flags)
+{
+  unsigned char hdr[NET_UDP_HEADER_BYTES];
+  struct iovec iov[2];
+  struct msghdr msg;
+  int n;
+  int done = 0;
+
+  while (done < ctx->tx_pending_count) {
+    net_udp_put_header(hdr, NET_UDP_DATA, ctx->udp_tx_seq);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = NET_UDP_HEADER_BYTES;
+    iov[1].iov_base = ctx->tx_pending[done]->data;
+    iov[1].iov_len = ctx->tx_pending[done]->len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    pthread_mutex_lock(&(ctx->tx_mutex));
+    n = sendmsg(ctx->fd, &msg, flags | MSG_NOSIGNAL);
+    pthread_mutex_unlock(&(ctx->tx_mutex));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    // Nobody listening yet is not fatal, the heartbeat decides that
+    if (n < 0 && errno == ECONNREFUSED) {
+      n = 0;
+    }
+    else if (n < 0) {
+      fprintf(stderr, "net_write - error writing to socket\n");
+      METRIC_ADD(net_write_failures, 1);
+      return -1;
+    }
+    __atomic_add_fetch(&(ctx->tx_batches), 1, __ATOMIC_RELAXED);
+    METRIC_ADD(net_tx_bytes, n);
+    buf_release(ctx->tx_pending[done]);
+    ctx->udp_tx_seq += 1;
+    done += 1;
+  }
+
+  ctx->tx_pending_count -= done;
+  memmove(ctx->tx_pending, &(ctx->tx_pending[done]),
+          ctx->tx_pending_count * sizeof(buf_t *));
+  __atomic_add_fetch(&(ctx->tx_frames), done, __ATOMIC_RELAXED);
+  METRIC_ADD(net_tx_frames, done);
+  METRIC_SET(net_txq_depth, queue_count(&(ctx->txq)));
+  return ctx->tx_pending_count;
+}
+
+static int
+net_udp_read_handler(network_t* ctx)
+{
+  unsigned char buf[NET_UDP_HEADER_BYTES + NET_MAX_BYTES];
+  unsigned char* frame;
+  unsigned int seq;
+  int n, len;
+
+  n = recv(ctx->fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if (n < 0) {
+    // Refused means the server isn't up, wait for the heartbeat timeout
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+        errno == ECONNREFUSED) {
+      return TRUE;
+    }
+    fprintf(stderr, "Error reading from network\n");
+    net_stop(ctx, TRUE);
+    return FALSE;
+  }
+  if (n < NET_UDP_HEADER_BYTES) {
+    return TRUE;
+  }
+  ctx->udp_last_rx_us = now_us();
+
+  switch (buf[0]) {
+  case NET_UDP_HEARTBEAT:
+    return TRUE;
+  case NET_UDP_BYE:
+    fprintf(stderr, "Server closed the session\n");
+    net_stop(ctx, TRUE);
+    return FALSE;
+  case NET_UDP_DATA:
+    break;
+  default:
+    return TRUE;
+  }
+
+  // Late frames are dropped rather than played out of order
+  seq = buf[2] | (buf[3] << 8) | (buf[4] << 16) | ((unsigned int)buf[5] << 24);
+  if (!net_seq_accept(&(ctx->udp_rx), seq)) {
+    return TRUE;
+  }
+
+  frame = &buf[NET_UDP_HEADER_BYTES];
+  n -= NET_UDP_HEADER_BYTES;
+  while (n >= 2) {
+    len = frame[0] + ((frame[1] & 0x1F) << 8);
+    if (len < 2 || len > n) break;
+    METRIC_ADD(net_rx_frames, 1);
+    METRIC_ADD(net_rx_bytes, len);
+    if (ctx->callback) {
+      (ctx->callback)(frame, len);
+    }
+    frame += len;
+    n -= len;
+  }
+  return TRUE;
 }
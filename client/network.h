@@ -3,6 +3,9 @@
 
 #include <limits.h>
 #include <pthread.h>
+#include "evloop.h"
+#include "framer.h"
+#include "queue.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 64
@@ -11,20 +14,54 @@
 #define NET_KEEPALIVE_ENABLED
 #define NET_KEEPALIVE_SECS    120
 
+// Transports, UDP avoids head-of-line blocking behind a lost segment
+#define NET_TRANSPORT_TCP     0
+#define NET_TRANSPORT_UDP     1
+
+// Each UDP datagram starts with a header, data datagrams then carry
+// one DVAP frame
+//   byte 0     NET_UDP_* type
+//   byte 1     reserved, 0
+//   bytes 2-5  sequence number, little endian, counts data datagrams
+#define NET_UDP_HEADER_BYTES  6
+#define NET_UDP_DATA          1
+#define NET_UDP_HEARTBEAT     2
+#define NET_UDP_BYE           3
+#define NET_UDP_HEARTBEAT_MS  1000 // also the liveness check period
+#define NET_UDP_TIMEOUT_MS    5000 // peer is gone after this much silence
+
 #define NET_READ_TIMEOUT_USEC 10000
 #define NET_MAX_BYTES         8191 // should match device.h:DVAP_MSG_MAX_BYTES
+#define NET_TX_BATCH          QUEUE_SIZE // max frames per send call
+#define NET_TX_WAIT_MS        100  // sender checks for shutdown this often
+#define NET_TX_RETRY_MS       5    // event loop retry after a full socket
 
 // net_rx_fptr is a function pointer that takes two arguments,
 // a pointer to a buffer and the length of the buffer
 typedef void (*net_rx_fptr)(unsigned char* buf, int buf_bytes);
 
+// Tracks received sequence numbers to count loss and reordering
+typedef struct {
+  int started;
+  unsigned int first;			// number tracking (re)started from
+  unsigned int next;			// sequence number expected next
+  unsigned long long window;		// bit n set if next - 1 - n arrived
+  unsigned long received;		// frames accepted in order
+  unsigned long lost;			// gaps not (yet) filled
+  unsigned long late;			// arrived after a newer frame, dropped
+  unsigned long duplicate;		// seen before, dropped
+  unsigned long resyncs;		// peer restarted its numbering
+} net_seq_t;
+
 typedef struct {  
   net_rx_fptr callback; 		// pointer to rx callback
+  int transport;			// NET_TRANSPORT_*
 
   char host[HOST_NAME_MAX + 1];
   int port;
 
   int fd;
+  framer_t framer;			// buffers and splits socket reads
 
   int try_restart;			// if true restart network on timeout
   int shutdown;         		// set true to shut down rx loop
@@ -33,18 +70,65 @@ typedef struct {
   pthread_mutex_t tx_mutex;		// acquire before writing to network
   pthread_t keepalive_thread;		// pthread associated with keepalive
 
+  // Frames waiting to be sent, so a slow socket never blocks the caller
+  // of net_write. Drained by net_tx_loop or by the event loop.
+  queue_t txq;
+  pthread_t tx_thread;			// pthread associated with send loop
+  buf_t* tx_pending[NET_TX_BATCH];	// taken off txq, not yet fully sent
+  int tx_pending_count;
+  int tx_offset;			// bytes of tx_pending[0] already sent
+  int txfd;				// wakes the event loop to send
+  int tx_timer;				// retries sends on a full socket
+  unsigned long tx_frames;		// frames sent, atomic
+  unsigned long tx_batches;		// send calls made, atomic
+  unsigned long tx_dropped;		// frames dropped on a full txq, atomic
+  int tx_depth_max;			// deepest txq seen, atomic
+
+  // UDP session state
+  unsigned int udp_tx_seq;		// sequence number of next data sent
+  net_seq_t udp_rx;			// only used by the reader
+  unsigned long long udp_last_rx_us;	// anything heard from the server
+
   pthread_t rx_thread;			// pthread associated with read loop
+
+  evloop_t* loop;			// drives rx and keepalive, or NULL
+  int keepalive_timer;			// timer fd when using an event loop
+  int stopfd;				// signalled by net_stop with a loop
 } network_t;
 
 int net_init(network_t* ctx, char* hostname, int port, net_rx_fptr callback);
+
+// Same as net_init but socket reads and keepalives are driven by loop
+// rather than by dedicated threads
+int net_init_evloop(network_t* ctx, char* hostname, int port,
+                    net_rx_fptr callback, evloop_t* loop);
+
+// Same as net_init_evloop with a choice of NET_TRANSPORT_*, loop may be
+// NULL
+int net_init_transport(network_t* ctx, char* hostname, int port,
+                       net_rx_fptr callback, evloop_t* loop, int transport);
 int net_connect(network_t* ctx);
 void net_wait(network_t* ctx);
 int net_read(network_t* ctx, char* msg_type, unsigned char* buf, int buf_bytes);
+// Queue a packet for sending, never blocks. Returns -1 and counts a
+// drop if the tx queue is full.
 int net_write(network_t* ctx, unsigned char* buf, int buf_bytes);
+
+// Frames currently waiting in the tx queue
+int net_tx_depth(network_t* ctx);
 void net_stop(network_t* ctx, int try_restart);
 
+// Returns FALSE for a sequence number that is late or a duplicate. One
+// more than 64 behind is taken as the peer restarting its numbering.
+int net_seq_accept(net_seq_t* seq, unsigned int n);
+
 int net_should_shutdown(network_t* ctx);
 void* net_keepalive_loop(void* arg);
+void* net_tx_loop(void* arg);
 void* net_read_loop(void* arg);
 
+// Read once from the socket and dispatch every complete packet, FALSE
+// if the connection failed
+int net_read_handler(network_t* ctx);
+
 #endif
@@ -1,82 +1,187 @@
+// qtest.c
+// Checks queue behaviour then compares the mutex and lock-free SPSC
+// backends for throughput and for producer to consumer latency
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "common.h"
 #include "queue.h"
 
-int main(int argc, char* argv[])
+#define BENCH_OPS	1000000
+#define BENCH_PACED_OPS	20000
+#define BENCH_BUFS	(2 * QUEUE_SIZE)
+
+typedef struct {
+  queue_t* q;
+  int ops;
+  int paced;			// wait for each entry to be consumed
+  buf_t* bufs[BENCH_BUFS];	// reused, never more than QUEUE_SIZE + 1 out
+  unsigned long long* latency;	// ns per entry, filled in by the consumer
+} bench_t;
+
+static const char*
+backend_name(int backend)
+{
+  return (backend == QUEUE_BACKEND_SPSC) ? "spsc" : "mutex";
+}
+
+static int
+check(const char* what, int ok)
+{
+  printf("  %-40s %s\n", what, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+// The original walk through: fill, overfill, drain in order
+static int
+check_backend(int backend)
 {
   queue_t q;
   unsigned char buf0[8];
   unsigned char buf1[10];
-  int len;
+  unsigned long long start;
+  buf_t* buf;
+  int i, len, ok = TRUE;
+
+  queue_init_backend(&q, backend);
+  printf("%s backend:\n", backend_name(backend));
+  ok &= check("starts empty", queue_is_empty(&q));
 
-  queue_init(&q);
-  printf("queue empty? ");
-  if (queue_is_empty(&q)) {
-    printf("yes\n");
+  for (i = 0; i < QUEUE_SIZE; i++) {
+    snprintf((char *)buf0, sizeof(buf0), "msg %d", i);
+    queue_insert(&q, buf0, strlen((char *)buf0) + 1);
   }
-  else {
-    printf("no\n");
+  ok &= check("full after QUEUE_SIZE inserts", queue_is_full(&q));
+  ok &= check("try insert fails when full",
+              !queue_try_insert(&q, buf0, 7));
+
+  start = now_us();
+  buf = buf_alloc(q.pool, 0);
+  ok &= check("timed insert times out when full",
+              !queue_insert_buf_timeout(&q, buf, 50));
+  buf_release(buf);
+  ok &= check("timed insert waited about 50 ms",
+              now_us() - start >= 45000 && now_us() - start < 500000);
+
+  ok &= check("peek returns oldest",
+              queue_peek(&q, buf1, &len) && !strcmp((char *)buf1, "msg 0"));
+  for (i = 0; i < QUEUE_SIZE; i++) {
+    snprintf((char *)buf0, sizeof(buf0), "msg %d", i);
+    queue_remove(&q, buf1, &len);
+    if (strcmp((char *)buf0, (char *)buf1) ||
+        len != strlen((char *)buf0) + 1) {
+      ok = FALSE;
+    }
   }
+  ok &= check("removed in insert order", ok);
+  ok &= check("empty after draining", queue_is_empty(&q));
+  ok &= check("try remove fails when empty",
+              !queue_try_remove(&q, buf1, &len));
 
-  memcpy(buf0, "hello!", 7);
-  printf("buf0: %s\n", buf0);
-
-  queue_insert(&q, buf0, 7);
-  memcpy(buf0, "hi!", 4);
-  queue_insert(&q, buf0, 7);
-  memcpy(buf0, "beep", 5);
-  queue_insert(&q, buf0, 7);
-  memcpy(buf0, "boop", 5);
-  queue_insert(&q, buf0, 7);
-  queue_insert(&q, buf0, 7);
-  queue_insert(&q, buf0, 7);
-  queue_insert(&q, buf0, 7);
-  queue_insert(&q, buf0, 7);
-  queue_insert(&q, buf0, 7);
-  printf("q size: %d\n", q.count);
-
-  queue_insert(&q, buf0, 7);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
-
-  queue_remove(&q, buf1, &len);
-  printf("remove: %s [%d]\n", buf1, len);
-  printf("q size: %d\n", q.count);
+  queue_delete(&q);
+  return ok;
+}
+
+static void*
+producer_loop(void* arg)
+{
+  bench_t* b = (bench_t *)arg;
+  unsigned long long until;
+  buf_t* buf;
+  int i;
+
+  for (i = 0; i < b->ops; i++) {
+    buf = b->bufs[i % BENCH_BUFS];
+    *(unsigned long long *)buf->data = now_ns();
+    queue_insert_buf(b->q, buf);
+
+    // Let the consumer go back to sleep so every entry pays for a wakeup
+    if (b->paced) {
+      while (!queue_is_empty(b->q));
+      until = now_ns() + 20000;
+      while (now_ns() < until);
+    }
+  }
+  return NULL;
+}
+
+static int
+compare_ull(const void* a, const void* b)
+{
+  unsigned long long x = *(unsigned long long *)a;
+  unsigned long long y = *(unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+static void
+bench_backend(int backend, int ops, int paced)
+{
+  queue_t q;
+  bench_t b;
+  pthread_t thread;
+  buf_t* buf;
+  unsigned long long start, elapsed;
+  int i;
+
+  queue_init_backend(&q, backend);
+  b.q = &q;
+  b.ops = ops;
+  b.paced = paced;
+  b.latency = malloc(ops * sizeof(unsigned long long));
+  for (i = 0; i < BENCH_BUFS; i++) {
+    b.bufs[i] = buf_alloc(q.pool, sizeof(unsigned long long));
+  }
+
+  start = now_ns();
+  pthread_create(&thread, NULL, producer_loop, &b);
+  for (i = 0; i < ops; i++) {
+    queue_remove_buf(&q, &buf);
+    b.latency[i] = now_ns() - *(unsigned long long *)buf->data;
+  }
+  elapsed = now_ns() - start;
+  pthread_join(thread, NULL);
+
+  qsort(b.latency, ops, sizeof(unsigned long long), compare_ull);
+  printf("%-6s %-7s %8d ops %10.0f ops/s  latency ns p50 %6llu "
+         "p99 %7llu max %8llu\n", backend_name(backend),
+         paced ? "paced" : "burst", ops, ops * 1e9 / elapsed,
+         b.latency[ops / 2], b.latency[ops * 99 / 100], b.latency[ops - 1]);
+
+  for (i = 0; i < BENCH_BUFS; i++) {
+    buf_release(b.bufs[i]);
+  }
+  free(b.latency);
+  queue_delete(&q);
+}
+
+int main(int argc, char* argv[])
+{
+  int backends[] = { QUEUE_BACKEND_MUTEX, QUEUE_BACKEND_SPSC };
+  int ops = BENCH_OPS;
+  int i, ok = TRUE;
+
+  if (argc > 1) {
+    ops = atoi(argv[1]);
+  }
+
+  for (i = 0; i < 2; i++) {
+    ok &= check_backend(backends[i]);
+  }
+  if (!ok) {
+    fprintf(stderr, "queue checks failed\n");
+    return 1;
+  }
+
+  // Burst keeps the ring busy and measures throughput, paced lets the
+  // consumer sleep between entries and measures wakeup latency
+  printf("\n");
+  for (i = 0; i < 2; i++) {
+    bench_backend(backends[i], ops, FALSE);
+  }
+  for (i = 0; i < 2; i++) {
+    bench_backend(backends[i], BENCH_PACED_OPS, TRUE);
+  }
 
   return 0;
 }
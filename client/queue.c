@@ -1,89 +1,466 @@
-// A thread-safe fifo queue that stores byte arrays
+// A thread-safe fifo queue of reference counted buffers
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "common.h"
 #include "queue.h"
 
+#ifdef QUEUE_SPSC_ENABLED
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 void
 queue_init(queue_t* q)
 {
+  queue_init_backend(q, QUEUE_BACKEND_MUTEX);
+}
+
+void
+queue_init_backend(queue_t* q, int backend)
+{
+#ifndef QUEUE_SPSC_ENABLED
+  backend = QUEUE_BACKEND_MUTEX;
+#endif
+  q->backend = backend;
   q->first = 0;
   q->last = QUEUE_SIZE - 1;
   q->count = 0;
+  q->head = 0;
+  q->tail = 0;
+  q->consumer_waiting = FALSE;
+  q->producer_waiting = FALSE;
+  q->pool = bufpool_default();
 
   pthread_mutex_init(&(q->mutex), NULL);
   pthread_cond_init(&(q->empty), NULL);
   pthread_cond_init(&(q->fill), NULL);
 }
 
-int
-queue_insert(queue_t* q, unsigned char* data, int len)
+void
+queue_delete(queue_t* q)
 {
-  if (len > QUEUE_ENTRY_SIZE) {
-    fprintf(stderr, "Error: queue insert fail, data too large\n");
-    return FALSE;
-  }
+  buf_t* buf;
 
-  pthread_mutex_lock(&(q->mutex));
-  while(q->count >= QUEUE_SIZE) {
-    pthread_cond_wait(&(q->empty), &(q->mutex));
+  while (queue_try_remove_buf(q, &buf)) {
+    buf_release(buf);
   }
+  pthread_mutex_destroy(&(q->mutex));
+  pthread_cond_destroy(&(q->empty));
+  pthread_cond_destroy(&(q->fill));
+}
+
+static unsigned long long
+queue_deadline(int timeout_ms)
+{
+  return now_us() + timeout_ms * 1000ULL;
+}
+
+// Mutex backend
 
+// Call with q->mutex held and room in the queue
+static void
+queue_push(queue_t* q, buf_t* buf)
+{
   q->last = (q->last + 1) % QUEUE_SIZE;
-  memcpy(&(q->data[q->last]), data, len);
-  q->data_len[q->last] = len;
+  q->data[q->last] = buf;
   q->count += 1;
-
   pthread_cond_signal(&(q->fill));
+}
+
+// Call with q->mutex held and something in the queue
+static buf_t*
+queue_pop(queue_t* q)
+{
+  buf_t* buf = q->data[q->first];
+
+  q->data[q->first] = NULL;
+  q->first = (q->first + 1) % QUEUE_SIZE;
+  q->count -= 1;
+  pthread_cond_signal(&(q->empty));
+  return buf;
+}
+
+static int
+queue_mutex_insert(queue_t* q, buf_t* buf, int timeout_ms)
+{
+  unsigned long long deadline = queue_deadline(timeout_ms);
+
+  pthread_mutex_lock(&(q->mutex));
+  while (q->count >= QUEUE_SIZE) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&(q->empty), &(q->mutex));
+    }
+    else if (timeout_ms == 0 ||
+             !cond_wait_until(&(q->empty), &(q->mutex), deadline)) {
+      break;
+    }
+  }
+  if (q->count >= QUEUE_SIZE) {
+    pthread_mutex_unlock(&(q->mutex));
+    return FALSE;
+  }
+  queue_push(q, buf);
   pthread_mutex_unlock(&(q->mutex));
 
   return TRUE;
 }
 
-int
-queue_remove(queue_t* q, unsigned char* data, int* len)
+static int
+queue_mutex_remove(queue_t* q, buf_t** buf, int timeout_ms)
 {
-  int l;
+  unsigned long long deadline = queue_deadline(timeout_ms);
 
   pthread_mutex_lock(&(q->mutex));
   while (q->count <= 0) {
-    pthread_cond_wait(&(q->fill), &(q->mutex));
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&(q->fill), &(q->mutex));
+    }
+    else if (timeout_ms == 0 ||
+             !cond_wait_until(&(q->fill), &(q->mutex), deadline)) {
+      break;
+    }
   }
+  if (q->count <= 0) {
+    pthread_mutex_unlock(&(q->mutex));
+    return FALSE;
+  }
+  *buf = queue_pop(q);
+  pthread_mutex_unlock(&(q->mutex));
 
-  l = q->data_len[q->first];
-  memcpy(data, &(q->data[q->first]), l);
-  *len = l;
-  q->first = (q->first + 1) % QUEUE_SIZE;
-  q->count -= 1;
+  return TRUE;
+}
 
-  pthread_cond_signal(&(q->empty));
-  pthread_mutex_unlock(&(q->mutex));
+// Lock-free single producer/single consumer backend. The producer
+// publishes an entry by advancing tail, the consumer frees a slot by
+// advancing head. A side that finds the ring full or empty flags
+// itself as waiting and sleeps on the other side's index, so the fast
+// path makes no system calls while both sides keep up.
+
+#ifdef QUEUE_SPSC_ENABLED
+
+// Polls of the other side's index before going to sleep, a wakeup costs
+// far more than a short spin when both threads are running. On a single
+// CPU the other side cannot run while we spin, so go straight to sleep.
+#define QUEUE_SPSC_SPINS 200
+
+static int queue_spsc_spins = -1;
 
+static unsigned int
+queue_spsc_spin(unsigned int* index, unsigned int val)
+{
+  unsigned int cur = val;
+  int i;
+
+  if (queue_spsc_spins < 0) {
+    queue_spsc_spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ?
+      QUEUE_SPSC_SPINS : 0;
+  }
+
+  for (i = 0; i < queue_spsc_spins && cur == val; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    cur = __atomic_load_n(index, __ATOMIC_ACQUIRE);
+  }
+  return cur;
+}
+
+static void
+queue_futex_wait(unsigned int* addr, unsigned int val,
+                 unsigned long long deadline_us)
+{
+  struct timespec ts;
+
+  if (deadline_us) {
+    ts.tv_sec = deadline_us / 1000000ULL;
+    ts.tv_nsec = (deadline_us % 1000000ULL) * 1000ULL;
+  }
+
+  // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, the
+  // same clock now_us() reads
+  syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val,
+          deadline_us ? &ts : NULL, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void
+queue_futex_wake(unsigned int* addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX,
+          NULL, NULL, 0);
+}
+
+static int
+queue_spsc_insert(queue_t* q, buf_t* buf, int timeout_ms)
+{
+  unsigned long long deadline = 0;
+  unsigned int tail = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+  unsigned int head = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+
+  if (timeout_ms > 0) {
+    deadline = queue_deadline(timeout_ms);
+  }
+
+  if (tail - head >= QUEUE_SIZE && timeout_ms != 0) {
+    head = queue_spsc_spin(&(q->head), head);
+  }
+  while (tail - head >= QUEUE_SIZE) {
+    if (timeout_ms == 0 || (deadline && now_us() >= deadline)) {
+      return FALSE;
+    }
+    __atomic_store_n(&(q->producer_waiting), TRUE, __ATOMIC_SEQ_CST);
+    head = __atomic_load_n(&(q->head), __ATOMIC_SEQ_CST);
+    if (tail - head >= QUEUE_SIZE) {
+      queue_futex_wait(&(q->head), head, deadline);
+      head = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&(q->producer_waiting), FALSE, __ATOMIC_RELAXED);
+  }
+
+  q->data[tail % QUEUE_SIZE] = buf;
+  __atomic_store_n(&(q->tail), tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(q->consumer_waiting), __ATOMIC_SEQ_CST)) {
+    queue_futex_wake(&(q->tail));
+  }
   return TRUE;
 }
 
+static int
+queue_spsc_remove(queue_t* q, buf_t** buf, int timeout_ms)
+{
+  unsigned long long deadline = 0;
+  unsigned int head = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+  unsigned int tail = __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE);
+
+  if (timeout_ms > 0) {
+    deadline = queue_deadline(timeout_ms);
+  }
+
+  if (tail == head && timeout_ms != 0) {
+    tail = queue_spsc_spin(&(q->tail), tail);
+  }
+  while (tail == head) {
+    if (timeout_ms == 0 || (deadline && now_us() >= deadline)) {
+      return FALSE;
+    }
+    __atomic_store_n(&(q->consumer_waiting), TRUE, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&(q->tail), __ATOMIC_SEQ_CST);
+    if (tail == head) {
+      queue_futex_wait(&(q->tail), tail, deadline);
+      tail = __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&(q->consumer_waiting), FALSE, __ATOMIC_RELAXED);
+  }
+
+  *buf = q->data[head % QUEUE_SIZE];
+  q->data[head % QUEUE_SIZE] = NULL;
+  __atomic_store_n(&(q->head), head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(q->producer_waiting), __ATOMIC_SEQ_CST)) {
+    queue_futex_wake(&(q->head));
+  }
+  return TRUE;
+}
+
+static int
+queue_spsc_peek(queue_t* q, buf_t** buf)
+{
+  unsigned int head = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+  unsigned int tail = __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE);
+
+  if (tail == head) return FALSE;
+  *buf = buf_ref(q->data[head % QUEUE_SIZE]);
+  return TRUE;
+}
+
+#else
+
+static int
+queue_spsc_insert(queue_t* q, buf_t* buf, int timeout_ms)
+{
+  return FALSE;
+}
+
+static int
+queue_spsc_remove(queue_t* q, buf_t** buf, int timeout_ms)
+{
+  return FALSE;
+}
+
+static int
+queue_spsc_peek(queue_t* q, buf_t** buf)
+{
+  return FALSE;
+}
+
+#endif
+
 int
-queue_is_empty(queue_t* q)
+queue_insert_buf_timeout(queue_t* q, buf_t* buf, int timeout_ms)
 {
-  int count;
+  if (!buf) return FALSE;
+  if (q->backend == QUEUE_BACKEND_SPSC) {
+    return queue_spsc_insert(q, buf, timeout_ms);
+  }
+  return queue_mutex_insert(q, buf, timeout_ms);
+}
+
+int
+queue_remove_buf_timeout(queue_t* q, buf_t** buf, int timeout_ms)
+{
+  if (q->backend == QUEUE_BACKEND_SPSC) {
+    return queue_spsc_remove(q, buf, timeout_ms);
+  }
+  return queue_mutex_remove(q, buf, timeout_ms);
+}
+
+int
+queue_insert_buf(queue_t* q, buf_t* buf)
+{
+  return queue_insert_buf_timeout(q, buf, -1);
+}
+
+int
+queue_remove_buf(queue_t* q, buf_t** buf)
+{
+  return queue_remove_buf_timeout(q, buf, -1);
+}
+
+int
+queue_try_insert_buf(queue_t* q, buf_t* buf)
+{
+  return queue_insert_buf_timeout(q, buf, 0);
+}
+
+int
+queue_try_remove_buf(queue_t* q, buf_t** buf)
+{
+  return queue_remove_buf_timeout(q, buf, 0);
+}
+
+int
+queue_peek_buf(queue_t* q, buf_t** buf)
+{
+  if (q->backend == QUEUE_BACKEND_SPSC) {
+    return queue_spsc_peek(q, buf);
+  }
 
   pthread_mutex_lock(&(q->mutex));
-  count = q->count;
+  if (q->count <= 0) {
+    pthread_mutex_unlock(&(q->mutex));
+    return FALSE;
+  }
+  *buf = buf_ref(q->data[q->first]);
   pthread_mutex_unlock(&(q->mutex));
 
-  if (count <= 0) return TRUE;
-  return FALSE;
+  return TRUE;
+}
+
+static buf_t*
+queue_copy_in(queue_t* q, unsigned char* data, int len)
+{
+  buf_t* buf;
+
+  if (len > QUEUE_ENTRY_SIZE) {
+    fprintf(stderr, "Error: queue insert fail, data too large\n");
+    return NULL;
+  }
+
+  buf = buf_alloc(q->pool, len);
+  if (buf) {
+    memcpy(buf->data, data, len);
+    buf->len = len;
+  }
+  return buf;
+}
+
+static void
+queue_copy_out(buf_t* buf, unsigned char* data, int* len)
+{
+  memcpy(data, buf->data, buf->len);
+  *len = buf->len;
+  buf_release(buf);
 }
 
 int
-queue_is_full(queue_t* q)
+queue_insert(queue_t* q, unsigned char* data, int len)
+{
+  buf_t* buf = queue_copy_in(q, data, len);
+  return queue_insert_buf(q, buf);
+}
+
+int
+queue_remove(queue_t* q, unsigned char* data, int* len)
+{
+  buf_t* buf;
+
+  queue_remove_buf(q, &buf);
+  queue_copy_out(buf, data, len);
+  return TRUE;
+}
+
+int
+queue_try_insert(queue_t* q, unsigned char* data, int len)
+{
+  buf_t* buf = queue_copy_in(q, data, len);
+
+  if (!queue_try_insert_buf(q, buf)) {
+    buf_release(buf);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int
+queue_try_remove(queue_t* q, unsigned char* data, int* len)
 {
+  buf_t* buf;
+
+  if (!queue_try_remove_buf(q, &buf)) return FALSE;
+  queue_copy_out(buf, data, len);
+  return TRUE;
+}
+
+int
+queue_peek(queue_t* q, unsigned char* data, int* len)
+{
+  buf_t* buf;
+
+  if (!queue_peek_buf(q, &buf)) return FALSE;
+  queue_copy_out(buf, data, len);
+  return TRUE;
+}
+
+int
+queue_count(queue_t* q)
+{
+  unsigned int head;
   int count;
 
+  // Read head first, tail can only have moved further ahead since
+  if (q->backend == QUEUE_BACKEND_SPSC) {
+    head = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE) - head;
+  }
+
   pthread_mutex_lock(&(q->mutex));
   count = q->count;
   pthread_mutex_unlock(&(q->mutex));
+  return count;
+}
+
+int
+queue_is_empty(queue_t* q)
+{
+  if (queue_count(q) <= 0) return TRUE;
+  return FALSE;
+}
 
-  if (count >= QUEUE_SIZE) return TRUE;
+int
+queue_is_full(queue_t* q)
+{
+  if (queue_count(q) >= QUEUE_SIZE) return TRUE;
   return FALSE;
 }
@@ -1,33 +1,87 @@
-// A thread-safe fifo queue that stores byte arrays
+// A thread-safe fifo queue of reference counted buffers
 #ifndef QUEUE_H
 #define QUEUE_H
 
 #include <pthread.h>
 
+#include "bufpool.h"
+
 #define QUEUE_SIZE	 10
 #define QUEUE_ENTRY_SIZE 8191	// should match device.h:DVAP_MSG_MAX_BYTES
 
+// Queue implementations
+#define QUEUE_BACKEND_MUTEX	0	// mutex and condition variables
+#define QUEUE_BACKEND_SPSC	1	// lock-free single producer/consumer ring
+
+// The lock-free ring sleeps on a futex, Linux only
+#ifdef __linux__
+#define QUEUE_SPSC_ENABLED
+#endif
+
 typedef struct {
-  unsigned char data[QUEUE_SIZE + 1][QUEUE_ENTRY_SIZE];
-  int data_len[QUEUE_SIZE + 1];
+  buf_t* data[QUEUE_SIZE];	// entries owned by the queue
+  int backend;			// QUEUE_BACKEND_*
+  bufpool_t* pool;		// where the copying calls allocate from
+
+  // QUEUE_BACKEND_MUTEX, acquire mutex before using these
   int first;
   int last;
   int count;
-
   pthread_mutex_t mutex;
   pthread_cond_t empty;
   pthread_cond_t fill;
+
+  // QUEUE_BACKEND_SPSC, free running indices on separate cache lines,
+  // head is only written by the consumer and tail by the producer
+  unsigned int head __attribute__((aligned(64)));
+  int consumer_waiting;
+  unsigned int tail __attribute__((aligned(64)));
+  int producer_waiting;
 } queue_t;
 
 void queue_init(queue_t* q);
+
+// Same as queue_init but picks the implementation. QUEUE_BACKEND_SPSC
+// is only safe with one producer thread and one consumer thread at a
+// time, and falls back to QUEUE_BACKEND_MUTEX where unsupported. Only
+// qtest uses it now, the DVAP tx queue has more than one producer.
+void queue_init_backend(queue_t* q, int backend);
+
+// Releases anything still queued
 void queue_delete(queue_t* q);
 
+// Zero-copy calls. Insert hands the caller's reference to the queue,
+// remove hands it back. Peek takes a new reference the caller must
+// release.
+// NOTE: queue_insert_buf will block if the queue is full and
+// queue_remove_buf will block if the queue is empty
+int queue_insert_buf(queue_t* q, buf_t* buf);
+int queue_remove_buf(queue_t* q, buf_t** buf);
+int queue_try_insert_buf(queue_t* q, buf_t* buf);
+int queue_try_remove_buf(queue_t* q, buf_t** buf);
+int queue_peek_buf(queue_t* q, buf_t** buf);
+
+// Blocking calls that give up after timeout_ms, -1 waits forever.
+// Return FALSE on timeout.
+int queue_insert_buf_timeout(queue_t* q, buf_t* buf, int timeout_ms);
+int queue_remove_buf_timeout(queue_t* q, buf_t** buf, int timeout_ms);
+
+// Copying calls, data is copied into and out of a pooled buffer
+
 // NOTE: This call will block if the queue is full
 int queue_insert(queue_t* q, unsigned char* data, int len);
 
 // NOTE: This call will block if the queue is empty
 int queue_remove(queue_t* q, unsigned char* data, int* len);
 
+// Non-blocking variants, return FALSE instead of waiting
+int queue_try_insert(queue_t* q, unsigned char* data, int len);
+int queue_try_remove(queue_t* q, unsigned char* data, int* len);
+
+// Copy the oldest entry without removing it, FALSE if empty
+int queue_peek(queue_t* q, unsigned char* data, int* len);
+
+int queue_count(queue_t* q);
 int queue_is_empty(queue_t* q);
 int queue_is_full(queue_t* q);
 
@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "replay.h"
+#include "txsched.h"
+
+void
+replay_init(replay_t* p, capture_reader_t* r, double speed)
+{
+  memset(p, 0, sizeof(replay_t));
+  p->speed = speed;
+  p->timed = !r->raw;
+  hist_init(&(p->lateness));
+}
+
+// Capture time of a frame, counting frame periods when there are no
+// timestamps
+static unsigned long long
+replay_frame_us(replay_t* p, capture_frame_t* frame)
+{
+  if (p->timed) {
+    return frame->time_us;
+  }
+  return (unsigned long long)p->frames * TXSCHED_FRAME_US;
+}
+
+void
+replay_wait(replay_t* p, capture_frame_t* frame)
+{
+  unsigned long long frame_us = replay_frame_us(p, frame);
+  unsigned long long deadline, now;
+  struct timespec ts;
+
+  if (!p->started) {
+    p->started = TRUE;
+    p->start_us = now_us();
+    p->first_us = frame_us;
+  }
+  p->last_us = frame_us;
+  p->frames++;
+  if (p->speed <= REPLAY_MAX_SPEED) {
+    return;
+  }
+
+  // Deadlines are absolute from the first frame, so sleep error and
+  // time spent sending do not add up over a long replay
+  deadline = p->start_us;
+  if (frame_us > p->first_us) {
+    deadline += (unsigned long long)((frame_us - p->first_us) / p->speed);
+  }
+
+  ts.tv_sec = deadline / 1000000ULL;
+  ts.tv_nsec = (deadline % 1000000ULL) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+  now = now_us();
+  if (now > deadline) {
+    hist_record(&(p->lateness), now - deadline);
+    if (now - deadline > TXSCHED_LATE_US) p->late++;
+  }
+  else {
+    hist_record(&(p->lateness), 0);
+  }
+}
+
+int
+replay_parse_speed(char* arg, double* speed)
+{
+  char* end;
+
+  if (!strcmp(arg, "max")) {
+    *speed = REPLAY_MAX_SPEED;
+    return TRUE;
+  }
+  *speed = strtod(arg, &end);
+  return (end != arg && *end == 0 && *speed > 0.0);
+}
+
+void
+replay_print(replay_t* p, char* name)
+{
+  unsigned long long elapsed_us = p->started ? now_us() - p->start_us : 0;
+  unsigned long long span_us = p->last_us - p->first_us;
+  double elapsed = elapsed_us / 1000000.0;
+
+  printf("%s: %lu frames in %.3f s, %.1f frames/s, %.3f s of capture at "
+         "%.2fx, %lu late\n", name, p->frames, elapsed,
+         elapsed > 0 ? p->frames / elapsed : 0.0, span_us / 1000000.0,
+         elapsed_us ? (double)span_us / elapsed_us : 0.0, p->late);
+  if (p->lateness.total) {
+    hist_print(&(p->lateness), "  lateness (us)");
+  }
+}
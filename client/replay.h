@@ -0,0 +1,39 @@
+// Paces frames read from a capture so they are sent with the spacing
+// they were recorded with, scaled by a speed factor. Raw dumps carry no
+// timestamps and are replayed at one frame per D-STAR frame period.
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "capture.h"
+#include "hist.h"
+
+#define REPLAY_MAX_SPEED 0.0		// no waiting, as fast as possible
+
+typedef struct {
+  double speed;
+  int timed;				// use capture timestamps
+  int started;
+  unsigned long long start_us;		// now_us() of the first frame
+  unsigned long long first_us;		// capture time of the first frame
+  unsigned long long last_us;		// capture time of the last frame
+
+  unsigned long frames;
+  unsigned long late;			// sent over TXSCHED_LATE_US late
+  hist_t lateness;			// us behind the scaled capture time
+} replay_t;
+
+// speed is the factor to compress time by, 2.0 plays twice as fast.
+// REPLAY_MAX_SPEED sends frames back to back.
+void replay_init(replay_t* p, capture_reader_t* r, double speed);
+
+// Sleep until frame is due
+void replay_wait(replay_t* p, capture_frame_t* frame);
+
+// Parse a speed option, "max" for as fast as possible. Returns FALSE if
+// it is not a positive number.
+int replay_parse_speed(char* arg, double* speed);
+
+// Print achieved rate and lateness prefixed with name
+void replay_print(replay_t* p, char* name);
+
+#endif
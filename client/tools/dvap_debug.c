@@ -7,14 +7,18 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "bufpool.h"
+#include "capture.h"
 #include "common.h"
 #include "device.h"
 #include "device_gmsk.h"
+#include "replay.h"
 
 static device_t* device_ptr;
-FILE* fp;
+capture_writer_t capture;
+capture_reader_t playback;
 int write_mode = FALSE;
-int fread_stop = FALSE;
+int replay_stop = FALSE;
 
 void
 interrupt()
@@ -22,54 +26,15 @@ interrupt()
   if (!dvap_stop(device_ptr)) {
     fprintf(stderr, "Error stopping DVAP device\n");
   }
-  fread_stop = TRUE;
-}
-
-int read_packet(FILE* fp, unsigned char* buf, int buf_len)
-{
-  int expected_bytes = 2;
-  int received_bytes = 0;
-  int n;
-
-  n = fread(buf, 1, 2, fp);
-  if (n <= 0) {
-    if (feof(fp)) {
-      return n;
-    }
-    fprintf(stderr, "Error reading header\n");
-    return n;
-  }
-  received_bytes += n;
-  
-  expected_bytes = buf[0] + ((buf[1] & 0x1F) << 8);
-  if (expected_bytes >= buf_len) {
-    fprintf(stderr, "Expected %d bytes, buf only %d bytes available\n", expected_bytes, buf_len);
-    return -1;
-  }
-  
-  while (received_bytes < expected_bytes) {
-    n = fread(&buf[received_bytes], 1, expected_bytes-received_bytes, fp);
-    if (n <= 0) {
-      return n;
-    }
-    received_bytes += n;
-  }
-  return received_bytes;
+  replay_stop = TRUE;
 }
 
 void dvap_rx_callback(unsigned char* buf, int buf_len)
 {
-  int write_bytes = 0;
-  int n;
-
-  if (fp) {
-    while (write_bytes < buf_len) {
-      n = fwrite(&buf[write_bytes], 1, buf_len-write_bytes, fp);
-      if (n <= 0) {
-        fprintf(stderr, "Error writing to file\n");
-        return;
-      }
-      write_bytes += n;
+  if (!write_mode) {
+    if (!capture_write(&capture, CAPTURE_SRC_DVAP_RX, buf, buf_len)) {
+      fprintf(stderr, "Error writing to file\n");
+      return;
     }
     printf("Received %d bytes from DVAP\n", buf_len);
   }
@@ -78,35 +43,40 @@ void dvap_rx_callback(unsigned char* buf, int buf_len)
 void
 print_usage(char* cmd)
 {
-  fprintf(stderr, "Usage: %s <device> <option> <data file>\n", cmd);
+  fprintf(stderr, "Usage: %s <device> <option> <data file> [speed]\n", cmd);
   fprintf(stderr, "  -r receive from dvap and write to file\n");
   fprintf(stderr, "  -w read from file and write to dvap\n");
+  fprintf(stderr, "  speed for -w, 0.5 for half speed, max for no pacing\n");
 }
 
 int
 main(int argc, char* argv[])
 {
   char buf[20];
-  unsigned char dbuf[8191];
-  int n;
+  capture_frame_t frame;
   device_t device_ctx;
+  bufpool_t* pool;
+  replay_t replay;
+  double speed = 1.0;
  
   if (argc < 4) {
     print_usage(argv[0]);
     return -1;
   }
+  if (argc > 4 && !replay_parse_speed(argv[4], &speed)) {
+    print_usage(argv[0]);
+    return -1;
+  }
 
   if (!strncmp("-r", argv[2], 2)) {
-    fp = fopen(argv[3], "wb");
-    if (!fp) {
+    if (!capture_create(&capture, argv[3])) {
       fprintf(stderr, "Error opening file %s\n", argv[3]);
       return -1;
     }
     write_mode = FALSE;
   }
   else if (!strncmp("-w", argv[2], 2)) {
-    fp = fopen(argv[3], "rb");
-    if (!fp) {
+    if (!capture_open(&playback, argv[3])) {
       fprintf(stderr, "Error opening file %s\n", argv[3]);
       return -1;
     }
@@ -145,16 +115,15 @@ main(int argc, char* argv[])
   if (write_mode) {
     printf("Sending file data to DVAP\n");
 
-    while(!fread_stop) {
-      n = read_packet(fp, dbuf, 8191);
-      printf("%d bytes\n", n);
-      dvap_pkt_write(&device_ctx, dbuf, n);
-      sleep_ms(n);
-      if (feof(fp)) {
-        break;
-      }
+    // Frames go out with the spacing they were captured with
+    replay_init(&replay, &playback, speed);
+    while(!replay_stop && capture_next(&playback, &frame)) {
+      replay_wait(&replay, &frame);
+      printf("%d bytes\n", frame.buf_bytes);
+      dvap_pkt_write(&device_ctx, frame.buf, frame.buf_bytes);
     }
     printf("Done!\n");
+    replay_print(&replay, "replay");
     sleep(2);
     dvap_stop(&device_ctx);
   }
@@ -162,8 +131,17 @@ main(int argc, char* argv[])
   // Block until dvap_stop() is called
   dvap_wait(&device_ctx);
 
-  if (fp) {
-    fclose(fp);
+  printf("serial tx: %lu messages in %lu writes\n", device_ctx.tx_msgs,
+         device_ctx.tx_writes);
+  pool = bufpool_default();
+  printf("tx buffers: %lu allocated, high water %d, %lu outside pool\n",
+         pool->allocs, pool->high_water, pool->fallbacks);
+
+  if (write_mode) {
+    capture_unmap(&playback);
+  }
+  else if (!capture_close(&capture)) {
+    fprintf(stderr, "Error writing to file\n");
   }
 
   return 0;
@@ -0,0 +1,570 @@
+// dvap_emu.c
+// This utility emulates a DVAP device on a pseudo-terminal so the client
+// and tools can be run and benchmarked without a dongle attached
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include "capture.h"
+#include "common.h"
+#include "device.h"
+#include "device_gmsk.h"
+
+#define EMU_FRAME_USEC      20000	// GMSK frame period
+#define EMU_FIFO_FRAMES     10		// default tx fifo depth in frames
+#define EMU_PTT_HANG_FRAMES 5		// drop ptt after this many empty ticks
+#define EMU_WATCHDOG_SECS   (DVAP_WATCHDOG_SECS * 2)
+#define EMU_STREAM_FRAMES   105		// synthetic stream length in frames
+#define EMU_STREAM_GAP      50		// idle frames between synthetic streams
+
+typedef struct {
+  int master;			// pty master, our side of the link
+  int slave;			// held open so the master never sees EIO
+
+  int running;
+  char modulation;
+  unsigned int rx_freq;
+  unsigned int tx_freq;
+
+  // transmit side: frames queued by the host, drained every tick
+  int fifo_len;
+  int fifo_max;
+  int fifo_eos;			// last queued frame ended the stream
+  int ptt;
+  int ptt_idle;
+
+  // receive side: frames played to the host every tick
+  capture_reader_t capture;
+  int playing;			// capture is open
+  int synthetic;
+  int stream_id;
+  int stream_pos;
+
+  unsigned long long last_host_us;
+
+  unsigned char in[DVAP_MSG_MAX_BYTES * 2];
+  int in_len;
+
+  // statistics
+  unsigned long tx_frames;
+  unsigned long tx_overruns;
+  unsigned long tx_underruns;
+  unsigned long rx_frames;
+  unsigned long ctrl_msgs;
+} emu_t;
+
+static int emu_stop = FALSE;
+
+void
+interrupt()
+{
+  emu_stop = TRUE;
+}
+
+static void
+emu_send(emu_t* emu, unsigned char* buf, int buf_len)
+{
+  int n;
+  int sent_bytes = 0;
+
+  while (sent_bytes < buf_len) {
+    n = write(emu->master, &buf[sent_bytes], buf_len - sent_bytes);
+    if (n <= 0) {
+      // Nobody is reading the slave, drop rather than stall the clock
+      if (n < 0 && errno == EAGAIN) return;
+      debug_print("emu_send - returned %d\n", n);
+      return;
+    }
+    sent_bytes += n;
+  }
+}
+
+static void
+emu_send_ctrl(emu_t* emu, char msg_type, int command, unsigned char* payload,
+              int payload_bytes)
+{
+  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  int pktlen = 4 + payload_bytes;
+
+  buf[0] = pktlen & 0xFF;
+  buf[1] = (msg_type << 5) | ((pktlen & 0x1F00) >> 8);
+  buf[2] = command & 0xFF;
+  buf[3] = (command >> 8) & 0xFF;
+  if (payload_bytes > 0) {
+    memcpy(&buf[4], payload, payload_bytes);
+  }
+  emu_send(emu, buf, pktlen);
+}
+
+static void
+emu_put_u32(unsigned char* buf, unsigned int val)
+{
+  buf[0] = val & 0xFF;
+  buf[1] = (val >> 8) & 0xFF;
+  buf[2] = (val >> 16) & 0xFF;
+  buf[3] = (val >> 24) & 0xFF;
+}
+
+static unsigned int
+emu_get_u32(unsigned char* buf)
+{
+  return buf[0] + (buf[1] << 8) + (buf[2] << 16) + ((unsigned)buf[3] << 24);
+}
+
+static void
+emu_set_ptt(emu_t* emu, int active)
+{
+  unsigned char payload[1];
+
+  if (emu->ptt == active) return;
+  emu->ptt = active;
+  emu->ptt_idle = 0;
+  payload[0] = active ? DVAP_PTT_TX_ACTIVE : DVAP_PTT_RX_ACTIVE;
+  emu_send_ctrl(emu, DVAP_MSG_TARGET_UNSOLICITED, DVAP_CTRL_PTT_STATE,
+                payload, 1);
+}
+
+static void
+emu_set_running(emu_t* emu, int running)
+{
+  emu->running = running;
+  if (!running) {
+    emu->fifo_len = 0;
+    emu_set_ptt(emu, FALSE);
+  }
+}
+
+// Answer a host request for a control item
+static void
+emu_request(emu_t* emu, int command, unsigned char* buf, int buf_len)
+{
+  unsigned char payload[16];
+  char* name = "DVAP Dongle";
+  char* serial = "AP000000";
+
+  switch (command) {
+  case DVAP_CTRL_TARGET_NAME:
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command,
+                  (unsigned char *)name, strlen(name) + 1);
+    break;
+  case DVAP_CTRL_TARGET_SERIAL:
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command,
+                  (unsigned char *)serial, strlen(serial) + 1);
+    break;
+  case DVAP_CTRL_IFACE_VER:
+    payload[0] = 0x01;
+    payload[1] = 0x00;
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 2);
+    break;
+  case DVAP_CTRL_HW_VER:
+    // Request selects bootcode (0) or firmware (1) version
+    payload[0] = (buf_len > 0) ? buf[0] : 0;
+    payload[1] = payload[0] ? 0x6B : 0x6D;
+    payload[2] = 0x00;
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 3);
+    break;
+  case DVAP_CTRL_STATUS:
+    payload[0] = emu->running ? DVAP_STATUS_RUNNING : DVAP_STATUS_STOPPED;
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 1);
+    break;
+  case DVAP_CTRL_RUN_STATE:
+    payload[0] = emu->running ? DVAP_RUN_STATE_RUN : DVAP_RUN_STATE_STOP;
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 1);
+    break;
+  case DVAP_CTRL_MODULATION_TYPE:
+    payload[0] = emu->modulation;
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 1);
+    break;
+  case DVAP_CTRL_RX_FREQ:
+    emu_put_u32(payload, emu->rx_freq);
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 4);
+    break;
+  case DVAP_CTRL_TX_FREQ:
+    emu_put_u32(payload, emu->tx_freq);
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 4);
+    break;
+  case DVAP_CTRL_READ_TX_FREQ_LIM:
+    emu_put_u32(payload, DVAP_BAND_SCAN_FREQ_MIN);
+    emu_put_u32(&payload[4], DVAP_BAND_SCAN_FREQ_MAX);
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, payload, 8);
+    break;
+  default:
+    emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, buf, buf_len);
+    break;
+  }
+}
+
+// Apply a host control setting, the DVAP echoes settings back
+static void
+emu_set(emu_t* emu, int command, unsigned char* buf, int buf_len)
+{
+  switch (command) {
+  case DVAP_CTRL_RUN_STATE:
+    if (buf_len >= 1) {
+      emu_set_running(emu, buf[0] == DVAP_RUN_STATE_RUN);
+    }
+    break;
+  case DVAP_CTRL_MODULATION_TYPE:
+    if (buf_len >= 1) {
+      emu->modulation = buf[0];
+    }
+    break;
+  case DVAP_CTRL_RX_FREQ:
+    if (buf_len >= 4) {
+      emu->rx_freq = emu_get_u32(buf);
+    }
+    break;
+  case DVAP_CTRL_TX_FREQ:
+    if (buf_len >= 4) {
+      emu->tx_freq = emu_get_u32(buf);
+    }
+    break;
+  case DVAP_CTRL_TX_RX_FREQ:
+    if (buf_len >= 4) {
+      emu->rx_freq = emu_get_u32(buf);
+      emu->tx_freq = emu->rx_freq;
+    }
+    break;
+  default:
+    break;
+  }
+  emu_send_ctrl(emu, DVAP_MSG_TARGET_ITEM_RESPONSE, command, buf, buf_len);
+}
+
+// Queue a frame for transmission, the fifo drains at the frame rate
+static void
+emu_tx_frame(emu_t* emu, unsigned char* buf, int buf_len)
+{
+  union dvap_dstar_data_union dstar;
+  int header = (buf[0] << 8) + buf[1];
+
+  if (!emu->running) return;
+
+  if (emu->fifo_len >= emu->fifo_max) {
+    emu->tx_overruns += 1;
+    return;
+  }
+  emu->fifo_len += 1;
+
+  if (header == DVAP_DATA_GMSK_HDR) {
+    // Acknowledge the header by echoing it back as a data ack
+    buf[1] = DVAP_GMSK_TX_ACK_HDR & 0xFF;
+    emu_send(emu, buf, buf_len);
+    buf[1] = DVAP_DATA_GMSK_HDR & 0xFF;
+    emu->fifo_eos = FALSE;
+  }
+  else if (buf_len == GMSK_DATA_BYTES) {
+    memcpy(dstar.bytes, buf, GMSK_DATA_BYTES);
+    emu->fifo_eos = dstar.data.end_of_stream_flag;
+  }
+}
+
+static void
+emu_host_msg(emu_t* emu, unsigned char* buf, int buf_len)
+{
+  char msg_type = (buf[1] & 0xE0) >> 5;
+  int command = 0;
+
+  emu->last_host_us = now_us();
+  if (buf_len >= 4) {
+    command = buf[2] + (buf[3] << 8);
+  }
+
+  switch (msg_type) {
+  case DVAP_MSG_HOST_SET_CTRL:
+    emu->ctrl_msgs += 1;
+    if (buf_len >= 4) emu_set(emu, command, &buf[4], buf_len - 4);
+    break;
+  case DVAP_MSG_HOST_REQ_CTRL_ITEM:
+  case DVAP_MSG_HOST_REQ_CTRL_RANGE:
+    emu->ctrl_msgs += 1;
+    if (buf_len >= 4) emu_request(emu, command, &buf[4], buf_len - 4);
+    break;
+  case DVAP_MSG_HOST_DATA_ACK:
+    // Watchdog keepalive, last_host_us already updated
+    break;
+  case DVAP_MSG_HOST_DATA_ITEM_0:
+  case DVAP_MSG_HOST_DATA_ITEM_1:
+  case DVAP_MSG_HOST_DATA_ITEM_2:
+  case DVAP_MSG_HOST_DATA_ITEM_3:
+    emu_tx_frame(emu, buf, buf_len);
+    break;
+  }
+}
+
+// Split buffered host bytes into frames
+static void
+emu_host_read(emu_t* emu)
+{
+  int n, len;
+  int pos = 0;
+
+  n = read(emu->master, &emu->in[emu->in_len], sizeof(emu->in) - emu->in_len);
+  if (n <= 0) return;
+  emu->in_len += n;
+
+  while (emu->in_len - pos >= 2) {
+    len = emu->in[pos] + ((emu->in[pos + 1] & 0x1F) << 8);
+    if (len < 3) {
+      // Not a valid frame, skip a byte and try to find the next one
+      pos += 1;
+      continue;
+    }
+    if (emu->in_len - pos < len) break;
+    emu_host_msg(emu, &emu->in[pos], len);
+    pos += len;
+  }
+
+  memmove(emu->in, &emu->in[pos], emu->in_len - pos);
+  emu->in_len -= pos;
+}
+
+// Read the next recorded GMSK frame, looping at the end of the capture.
+// Frames the host sent to the device were not received, skip them.
+static int
+emu_file_frame(emu_t* emu, unsigned char* buf, int buf_len)
+{
+  capture_frame_t frame;
+  int tries = 0;
+
+  while (tries < 2) {
+    while (capture_next(&(emu->capture), &frame)) {
+      if (frame.source == CAPTURE_SRC_DVAP_TX || frame.buf_bytes > buf_len) {
+        continue;
+      }
+      memcpy(buf, frame.buf, frame.buf_bytes);
+      return frame.buf_bytes;
+    }
+    capture_seek(&(emu->capture), emu->capture.data_start);
+    tries += 1;
+  }
+  return 0;
+}
+
+// Build the next synthetic GMSK frame, 0 between streams
+static int
+emu_synthetic_frame(emu_t* emu, unsigned char* buf)
+{
+  int pos = emu->stream_pos;
+
+  emu->stream_pos = (pos + 1) % (EMU_STREAM_FRAMES + EMU_STREAM_GAP);
+  if (pos == 0) {
+    emu->stream_id = (emu->stream_id + 1) & 0xFFFF;
+    gmsk_build_header(buf, emu->stream_id, "N0CALL", "CQCQCQ", "DIRECT",
+                      "DIRECT");
+    return GMSK_HEADER_BYTES;
+  }
+  if (pos <= EMU_STREAM_FRAMES) {
+    gmsk_build_data(buf, emu->stream_id, (pos - 1) % GMSK_FRAMES_PER_SUPER,
+                    pos == EMU_STREAM_FRAMES);
+    return GMSK_DATA_BYTES;
+  }
+  return 0;
+}
+
+static void
+emu_tick(emu_t* emu)
+{
+  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  unsigned char status[3];
+  int len = 0;
+
+  // Stop like the real device does when the host goes quiet
+  if (emu->running &&
+      now_us() - emu->last_host_us > EMU_WATCHDOG_SECS * 1000000ULL) {
+    fprintf(stderr, "Host watchdog expired, stopping\n");
+    emu_set_running(emu, FALSE);
+  }
+  if (!emu->running) return;
+
+  // Transmit one frame per tick
+  if (emu->fifo_len > 0) {
+    emu->fifo_len -= 1;
+    emu->tx_frames += 1;
+    emu_set_ptt(emu, TRUE);
+    emu->ptt_idle = 0;
+  }
+  else if (emu->ptt) {
+    if (!emu->fifo_eos && emu->ptt_idle == 0) {
+      emu->tx_underruns += 1;
+    }
+    emu->ptt_idle += 1;
+    if (emu->fifo_eos || emu->ptt_idle >= EMU_PTT_HANG_FRAMES) {
+      emu_set_ptt(emu, FALSE);
+    }
+  }
+
+  // Receive one frame per tick, the radio is half duplex
+  if (!emu->ptt && emu->modulation == DVAP_MODULATION_GMSK) {
+    if (emu->playing) {
+      len = emu_file_frame(emu, buf, sizeof(buf));
+    }
+    else if (emu->synthetic) {
+      len = emu_synthetic_frame(emu, buf);
+    }
+    if (len > 0) {
+      emu_send(emu, buf, len);
+      emu->rx_frames += 1;
+    }
+  }
+
+  status[0] = (len > 0) ? -60 : -110;
+  status[1] = (len > 0) ? 1 : 0;
+  status[2] = emu->fifo_max - emu->fifo_len;
+  emu_send_ctrl(emu, DVAP_MSG_TARGET_UNSOLICITED,
+                DVAP_CTRL_OPERATIONAL_STATUS, status, 3);
+}
+
+static int
+emu_open(emu_t* emu, char* link)
+{
+  struct termios tty;
+  char* name;
+
+  emu->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (emu->master < 0 || grantpt(emu->master) != 0 ||
+      unlockpt(emu->master) != 0) {
+    fprintf(stderr, "Error creating pseudo-terminal\n");
+    return FALSE;
+  }
+  name = ptsname(emu->master);
+
+  emu->slave = open(name, O_RDWR | O_NOCTTY);
+  if (emu->slave < 0) {
+    fprintf(stderr, "Error opening %s\n", name);
+    return FALSE;
+  }
+
+  // Raw mode so the line discipline never echoes or rewrites frames
+  if (tcgetattr(emu->slave, &tty) == 0) {
+    cfmakeraw(&tty);
+    tcsetattr(emu->slave, TCSANOW, &tty);
+  }
+  fcntl(emu->master, F_SETFL, O_NONBLOCK);
+
+  if (link) {
+    unlink(link);
+    if (symlink(name, link) != 0) {
+      fprintf(stderr, "Error linking %s to %s\n", link, name);
+      return FALSE;
+    }
+    name = link;
+  }
+  printf("DVAP emulator on %s\n", name);
+  fflush(stdout);
+  return TRUE;
+}
+
+void
+print_usage(char* cmd)
+{
+  fprintf(stderr, "Usage: %s [-l <link>] [-f <data file> | -s] [-q <frames>]\n",
+          cmd);
+  fprintf(stderr, "  -l create a symlink to the pseudo-terminal\n");
+  fprintf(stderr, "  -f play recorded GMSK frames as received traffic\n");
+  fprintf(stderr, "  -s play synthetic GMSK streams as received traffic\n");
+  fprintf(stderr, "  -q tx fifo depth in frames (default %d)\n",
+          EMU_FIFO_FRAMES);
+}
+
+int
+main(int argc, char* argv[])
+{
+  emu_t emu;
+  fd_set set;
+  struct timeval timeout;
+  unsigned long long next_tick, now;
+  char* link = NULL;
+  int opt, ret;
+
+  memset(&emu, 0, sizeof(emu));
+  emu.fifo_max = EMU_FIFO_FRAMES;
+  emu.rx_freq = 145670000;
+  emu.tx_freq = 145670000;
+  emu.modulation = DVAP_MODULATION_FM;
+
+  while ((opt = getopt(argc, argv, "l:f:sq:")) != -1) {
+    switch (opt) {
+    case 'l':
+      link = optarg;
+      break;
+    case 'f':
+      if (!capture_open(&(emu.capture), optarg)) {
+        fprintf(stderr, "Error opening file %s\n", optarg);
+        return -1;
+      }
+      emu.playing = TRUE;
+      break;
+    case 's':
+      emu.synthetic = TRUE;
+      break;
+    case 'q':
+      emu.fifo_max = atoi(optarg);
+      if (emu.fifo_max < 1 || emu.fifo_max > 255) {
+        fprintf(stderr, "Fifo depth must be between 1 and 255\n");
+        return -1;
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (!emu_open(&emu, link)) {
+    return -1;
+  }
+  signal(SIGINT, interrupt);
+  signal(SIGTERM, interrupt);
+
+  // Ticks are scheduled on absolute deadlines so the cadence never drifts
+  next_tick = now_us() + EMU_FRAME_USEC;
+  while (!emu_stop) {
+    now = now_us();
+    if (now >= next_tick) {
+      emu_tick(&emu);
+      next_tick += EMU_FRAME_USEC;
+      if (next_tick < now) {
+        next_tick = now + EMU_FRAME_USEC;
+      }
+      continue;
+    }
+
+    FD_ZERO(&set);
+    FD_SET(emu.master, &set);
+    timeout.tv_sec = 0;
+    timeout.tv_usec = next_tick - now;
+    ret = select(emu.master + 1, &set, NULL, NULL, &timeout);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Error waiting for data from host\n");
+      break;
+    }
+    if (ret > 0) {
+      emu_host_read(&emu);
+    }
+  }
+
+  printf("tx frames: %lu, tx overruns: %lu, tx underruns: %lu\n",
+         emu.tx_frames, emu.tx_overruns, emu.tx_underruns);
+  printf("rx frames: %lu, control messages: %lu\n", emu.rx_frames,
+         emu.ctrl_msgs);
+
+  if (link) {
+    unlink(link);
+  }
+  if (emu.playing) {
+    capture_unmap(&(emu.capture));
+  }
+  close(emu.slave);
+  close(emu.master);
+  return 0;
+}
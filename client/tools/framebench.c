@@ -0,0 +1,198 @@
+// framebench.c
+// This utility compares packet_read() with the buffered framer by
+// counting read() calls per frame over a socket pair, and checks that
+// the framer recovers from corrupted length bytes
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "device.h"
+#include "device_gmsk.h"
+#include "framer.h"
+
+#define BENCH_FRAMES 100000
+
+// Linked with -Wl,--wrap=read so every read() is counted
+ssize_t __real_read(int fd, void* buf, size_t count);
+static unsigned long read_calls = 0;
+
+ssize_t
+__wrap_read(int fd, void* buf, size_t count)
+{
+  read_calls += 1;
+  return __real_read(fd, buf, count);
+}
+
+typedef struct {
+  int fd;
+  int frames;
+  int burst;		// frames per write() call
+  int corrupt_every;	// corrupt a length byte every n frames, 0 for never
+} writer_t;
+
+// Build the frame sequence a DVAP sends during a transmission, a header
+// followed by voice frames with an operational status now and then
+static int
+bench_frame(unsigned char* buf, int i)
+{
+  int pos = i % 64;
+
+  if (pos == 0) {
+    gmsk_build_header(buf, i / 64, "N0CALL", "CQCQCQ", "DIRECT", "DIRECT");
+    return GMSK_HEADER_BYTES;
+  }
+  if (pos % 8 == 0) {
+    buf[0] = 0x07;
+    buf[1] = 0x20;
+    buf[2] = DVAP_CTRL_OPERATIONAL_STATUS & 0xFF;
+    buf[3] = DVAP_CTRL_OPERATIONAL_STATUS >> 8;
+    buf[4] = -60;
+    buf[5] = 1;
+    buf[6] = 10;
+    return 7;
+  }
+  gmsk_build_data(buf, i / 64, pos % GMSK_FRAMES_PER_SUPER, pos == 63);
+  return GMSK_DATA_BYTES;
+}
+
+void*
+writer_loop(void* arg)
+{
+  writer_t* w = (writer_t *)arg;
+  unsigned char buf[GMSK_HEADER_BYTES * 64];
+  int i, len, n, sent;
+  int buf_len = 0;
+  int queued = 0;
+
+  for (i = 0; i < w->frames; i++) {
+    len = bench_frame(&buf[buf_len], i);
+    if (w->corrupt_every && i % w->corrupt_every == w->corrupt_every - 1) {
+      buf[buf_len] ^= 0x5A;
+    }
+    buf_len += len;
+    queued += 1;
+
+    if (queued >= w->burst || i == w->frames - 1) {
+      sent = 0;
+      while (sent < buf_len) {
+        n = write(w->fd, &buf[sent], buf_len - sent);
+        if (n <= 0) {
+          fprintf(stderr, "Error writing to socket\n");
+          return NULL;
+        }
+        sent += n;
+      }
+      buf_len = 0;
+      queued = 0;
+    }
+  }
+
+  shutdown(w->fd, SHUT_WR);
+  return NULL;
+}
+
+static int
+bench_start(writer_t* w, pthread_t* thread, int* rfd, int frames,
+            int burst, int corrupt_every)
+{
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    fprintf(stderr, "Error creating socket pair\n");
+    return FALSE;
+  }
+  w->fd = sv[0];
+  w->frames = frames;
+  w->burst = burst;
+  w->corrupt_every = corrupt_every;
+  *rfd = sv[1];
+  read_calls = 0;
+  pthread_create(thread, NULL, writer_loop, w);
+  return TRUE;
+}
+
+static void
+bench_report(char* name, unsigned long frames, unsigned long long usecs)
+{
+  printf("%-12s %8lu frames %8lu reads %6.3f reads/frame %8.1f ns/frame\n",
+         name, frames, read_calls,
+         frames ? (double)read_calls / frames : 0.0,
+         frames ? usecs * 1000.0 / frames : 0.0);
+}
+
+static void
+bench_packet_read(int frames, int burst)
+{
+  writer_t w;
+  pthread_t thread;
+  unsigned char buf[DVAP_MSG_MAX_BYTES];
+  unsigned long count = 0;
+  unsigned long long start;
+  char msg_type;
+  int fd;
+
+  if (!bench_start(&w, &thread, &fd, frames, burst, 0)) return;
+  start = now_us();
+  while (packet_read(fd, &msg_type, buf, DVAP_MSG_MAX_BYTES) > 0) {
+    count += 1;
+  }
+  bench_report("packet_read", count, now_us() - start);
+  pthread_join(thread, NULL);
+  close(w.fd);
+  close(fd);
+}
+
+static void
+bench_framer(int frames, int burst, int corrupt_every)
+{
+  writer_t w;
+  pthread_t thread;
+  framer_t f;
+  unsigned char* frame;
+  unsigned long long start;
+  char msg_type;
+  int fd;
+
+  if (!bench_start(&w, &thread, &fd, frames, burst, corrupt_every)) return;
+  framer_init(&f, fd);
+  start = now_us();
+  while (framer_fill(&f) > 0) {
+    while (framer_next(&f, &frame, &msg_type) > 0);
+  }
+  bench_report(corrupt_every ? "framer/bad" : "framer", f.frames,
+               now_us() - start);
+  if (corrupt_every) {
+    printf("%-12s %8d sent, %lu resyncs, %lu bytes skipped\n", "",
+           frames, f.resyncs, f.skipped_bytes);
+  }
+  pthread_join(thread, NULL);
+  close(w.fd);
+  close(fd);
+}
+
+int
+main(int argc, char* argv[])
+{
+  int frames = BENCH_FRAMES;
+  int bursts[] = { 1, 4, 16 };
+  int i;
+
+  if (argc > 1) {
+    frames = atoi(argv[1]);
+  }
+
+  for (i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++) {
+    printf("%d frames per write:\n", bursts[i]);
+    bench_packet_read(frames, bursts[i]);
+    bench_framer(frames, bursts[i], 0);
+  }
+
+  printf("corrupt length byte every 1000 frames:\n");
+  bench_framer(frames, 1, 1000);
+  return 0;
+}
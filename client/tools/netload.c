@@ -0,0 +1,491 @@
+// netload.c
+// This utility loads the server with many client connections from one
+// process. A number of them transmit synthetic D-STAR streams and every
+// connection acts as a sink, measuring how late, how completely and how
+// fast the server delivers the frames to everyone else.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "common.h"
+#include "device_gmsk.h"
+#include "framer.h"
+#include "hist.h"
+#include "txsched.h"
+
+#define PORT 8191
+
+#define NETLOAD_STREAM_BASE   0x4000	// stream ids used by the generator
+#define NETLOAD_STAMP_OFFSET  6		// send time goes in the AMBE bytes
+#define NETLOAD_PENDING_BYTES 4096	// unsent frames held per connection
+#define NETLOAD_SETTLE_US     500000	// after connecting, before sending
+#define NETLOAD_DRAIN_US      1000000	// quiet time before the report
+#define NETLOAD_DRAIN_MAX_US  30000000	// give up waiting after this long
+#define NETLOAD_MAX_EVENTS    64
+
+typedef struct {
+  int fd;
+  int open;
+  framer_t framer;
+  unsigned char pending[NETLOAD_PENDING_BYTES];
+  int pending_bytes;
+} conn_t;
+
+typedef struct {
+  int stream_id;
+  conn_t* conn;
+  unsigned long long next_us;		// deadline of the next frame
+  unsigned long frames;			// data frames sent
+  int done;
+} stream_t;
+
+static conn_t* conns;
+static stream_t* streams;
+static int conn_count = 10;
+static int stream_count = 1;
+static int epfd;
+static int timerfd;
+static volatile int stop = FALSE;
+
+static unsigned long long end_us;	// streams end at this time
+static unsigned long long deadline_us = TXSCHED_FRAME_US;
+
+// Totals and the same for the current one second interval
+static unsigned long sent, tx_dropped, headers, delivered, late;
+static unsigned long long rx_bytes;
+static int closed;
+static hist_t latency;
+static unsigned long i_sent, i_delivered, i_late;
+static hist_t i_latency;
+
+void
+interrupt()
+{
+  stop = TRUE;
+}
+
+static void
+stamp_put(unsigned char* buf, unsigned long long value)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    buf[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static unsigned long long
+stamp_get(unsigned char* buf)
+{
+  unsigned long long value = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+static void
+conn_close(conn_t* c)
+{
+  if (!c->open) return;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->open = FALSE;
+  closed++;
+}
+
+static void
+conn_watch_output(conn_t* c, int enable)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int
+conn_flush(conn_t* c)
+{
+  int n;
+
+  while (c->pending_bytes > 0) {
+    n = send(c->fd, c->pending, c->pending_bytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return TRUE;
+    }
+    if (n <= 0) {
+      return FALSE;
+    }
+    memmove(c->pending, &c->pending[n], c->pending_bytes - n);
+    c->pending_bytes -= n;
+  }
+  conn_watch_output(c, FALSE);
+  return TRUE;
+}
+
+// Send a frame or hold it until the socket drains. A server that has
+// stopped reading shows up as dropped frames rather than blocking the
+// other connections.
+static void
+conn_send(conn_t* c, unsigned char* buf, int buf_bytes)
+{
+  int n = 0;
+
+  if (!c->open) return;
+  if (c->pending_bytes == 0) {
+    n = send(c->fd, buf, buf_bytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n == buf_bytes) return;
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        conn_close(c);
+        return;
+      }
+      n = 0;
+    }
+    conn_watch_output(c, TRUE);
+  }
+
+  if (c->pending_bytes + buf_bytes - n > NETLOAD_PENDING_BYTES) {
+    tx_dropped++;
+    return;
+  }
+  memcpy(&c->pending[c->pending_bytes], &buf[n], buf_bytes - n);
+  c->pending_bytes += buf_bytes - n;
+}
+
+static void
+stream_send(stream_t* s, unsigned long long now)
+{
+  unsigned char buf[GMSK_HEADER_BYTES];
+  int last = (s->next_us >= end_us);
+
+  if (s->frames == 0 && !s->done) {
+    gmsk_build_header(buf, s->stream_id, "N0LOAD", "CQCQCQ", "DIRECT",
+                      "DIRECT");
+    conn_send(s->conn, buf, GMSK_HEADER_BYTES);
+  }
+
+  gmsk_build_data(buf, s->stream_id, s->frames % GMSK_FRAMES_PER_SUPER, last);
+  stamp_put(&buf[NETLOAD_STAMP_OFFSET], now);
+  conn_send(s->conn, buf, GMSK_DATA_BYTES);
+  s->frames++;
+  sent++;
+  i_sent++;
+
+  s->next_us += TXSCHED_FRAME_US;
+  s->done = last;
+}
+
+static void
+sink_frame(unsigned char* buf, int buf_bytes, unsigned long long now)
+{
+  unsigned int header = (buf[1] << 8) + buf[0];
+  unsigned long long stamp, lateness;
+  int stream_id;
+
+  rx_bytes += buf_bytes;
+  if (buf_bytes < 4) return;
+  stream_id = (buf[3] << 8) + buf[2];
+  if (stream_id < NETLOAD_STREAM_BASE ||
+      stream_id >= NETLOAD_STREAM_BASE + stream_count) {
+    return;
+  }
+
+  if (header == 0xA02F && buf_bytes == GMSK_HEADER_BYTES) {
+    headers++;
+  }
+  else if (header == 0xC012 && buf_bytes == GMSK_DATA_BYTES) {
+    stamp = stamp_get(&buf[NETLOAD_STAMP_OFFSET]);
+    lateness = (now > stamp) ? now - stamp : 0;
+    hist_record(&latency, lateness);
+    hist_record(&i_latency, lateness);
+    delivered++;
+    i_delivered++;
+    if (lateness > deadline_us) {
+      late++;
+      i_late++;
+    }
+  }
+}
+
+static void
+conn_read(conn_t* c)
+{
+  unsigned char* frame;
+  unsigned long long now;
+  int n, len;
+
+  n = framer_fill(&c->framer);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    conn_close(c);
+    return;
+  }
+  now = now_us();
+  while ((len = framer_next(&c->framer, &frame, NULL)) > 0) {
+    sink_frame(frame, len, now);
+  }
+}
+
+// Release every frame that is due and arm the timer for the next one
+static int
+streams_run(unsigned long long now)
+{
+  unsigned long long next = 0;
+  struct itimerspec its;
+  int i, active = 0;
+
+  for (i = 0; i < stream_count; i++) {
+    while (!streams[i].done && streams[i].next_us <= now) {
+      stream_send(&streams[i], now);
+    }
+    if (streams[i].done) continue;
+    active++;
+    if (!next || streams[i].next_us < next) next = streams[i].next_us;
+  }
+
+  memset(&its, 0, sizeof(its));
+  if (next) {
+    its.it_value.tv_sec = next / 1000000ULL;
+    its.it_value.tv_nsec = (next % 1000000ULL) * 1000;
+  }
+  timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+  return active;
+}
+
+static void
+print_interval(int second, int sinks)
+{
+  unsigned long expected = i_sent * (sinks - 1);
+
+  printf("%4ds sent %5lu delivered %7lu (%5.1f%%) late %6lu "
+         "p50 %6llu p99 %6llu max %7llu us\n", second, i_sent, i_delivered,
+         expected ? 100.0 * i_delivered / expected : 0.0, i_late,
+         hist_percentile(&i_latency, 50), hist_percentile(&i_latency, 99),
+         i_latency.max);
+  i_sent = i_delivered = i_late = 0;
+  hist_init(&i_latency);
+}
+
+static int
+connect_all(char* host, int port)
+{
+  struct addrinfo hints;
+  struct addrinfo* servinfo;
+  struct epoll_event ev;
+  struct rlimit rl;
+  char portstr[6];
+  int one = 1;
+  int i, fd, ret;
+
+  // Each connection needs a descriptor, ask for as many as allowed
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  snprintf(portstr, 6, "%d", port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((ret = getaddrinfo(host, portstr, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "connect_all - %s\n", gai_strerror(ret));
+    return FALSE;
+  }
+
+  for (i = 0; i < conn_count; i++) {
+    fd = socket(servinfo->ai_family, servinfo->ai_socktype,
+                servinfo->ai_protocol);
+    if (fd < 0 || connect(fd, servinfo->ai_addr, servinfo->ai_addrlen) < 0) {
+      fprintf(stderr, "Error opening connection %d\n", i + 1);
+      if (fd >= 0) close(fd);
+      freeaddrinfo(servinfo);
+      return FALSE;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    conns[i].fd = fd;
+    conns[i].open = TRUE;
+    framer_init(&conns[i].framer, fd);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &conns[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  freeaddrinfo(servinfo);
+  return TRUE;
+}
+
+void
+print_usage(char* cmd)
+{
+  fprintf(stderr, "Usage: %s [-c clients] [-s streams] [-d seconds] "
+          "[-l late_ms] [-p port] <hostname>\n", cmd);
+  fprintf(stderr, "  -c connections to open, default 10\n");
+  fprintf(stderr, "  -s connections transmitting a stream, default 1\n");
+  fprintf(stderr, "  -d seconds to transmit for, default 10\n");
+  fprintf(stderr, "  -l frames delivered later than this are late, "
+          "default 20\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+  struct epoll_event events[NETLOAD_MAX_EVENTS];
+  unsigned long long now, start_us, report_us, stop_us = 0, quiet_us = 0;
+  unsigned long expected, last_delivered = 0;
+  uint64_t expirations;
+  double elapsed;
+  int port = PORT;
+  int seconds = 10;
+  int second = 0;
+  int i, n, opt;
+
+  while ((opt = getopt(argc, argv, "c:d:l:p:s:")) != -1) {
+    switch (opt) {
+    case 'c':
+      conn_count = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atoi(optarg);
+      break;
+    case 'l':
+      deadline_us = atoi(optarg) * 1000ULL;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 's':
+      stream_count = atoi(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (argc - optind < 1 || conn_count < 2 || stream_count < 1 ||
+      stream_count > conn_count || seconds < 1) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  conns = calloc(conn_count, sizeof(conn_t));
+  streams = calloc(stream_count, sizeof(stream_t));
+  epfd = epoll_create1(0);
+  timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (!conns || !streams || epfd < 0 || timerfd < 0) {
+    fprintf(stderr, "Error allocating %d connections\n", conn_count);
+    return -1;
+  }
+  hist_init(&latency);
+  hist_init(&i_latency);
+  signal(SIGINT, interrupt);
+
+  if (!connect_all(argv[optind], port)) {
+    return -1;
+  }
+  printf("Connected %d clients to %s on port %d, %d streams for %d s\n",
+         conn_count, argv[optind], port, stream_count, seconds);
+
+  // Streams start spread over one frame period so the server sees an
+  // even load rather than a burst every 20 ms
+  start_us = now_us() + NETLOAD_SETTLE_US;
+  end_us = start_us + seconds * 1000000ULL;
+  for (i = 0; i < stream_count; i++) {
+    streams[i].stream_id = NETLOAD_STREAM_BASE + i;
+    streams[i].conn = &conns[i];
+    streams[i].next_us = start_us +
+      (unsigned long long)i * TXSCHED_FRAME_US / stream_count;
+  }
+  memset(&events[0], 0, sizeof(events[0]));
+  events[0].events = EPOLLIN;
+  events[0].data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &events[0]);
+  streams_run(now_us());
+
+  report_us = start_us + 1000000ULL;
+  while (!stop) {
+    now = now_us();
+    n = epoll_wait(epfd, events, NETLOAD_MAX_EVENTS,
+                   now < report_us ? (report_us - now) / 1000 + 1 : 0);
+    if (n < 0 && errno != EINTR) {
+      fprintf(stderr, "Error waiting for events\n");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      conn_t* c = (conn_t *)events[i].data.ptr;
+
+      if (!c) {
+        if (read(timerfd, &expirations, sizeof(expirations)) < 0) continue;
+        if (!streams_run(now_us()) && !stop_us) {
+          stop_us = now_us() + NETLOAD_DRAIN_MAX_US;
+        }
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        if (!conn_flush(c)) conn_close(c);
+      }
+      if (c->open && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        conn_read(c);
+      }
+    }
+
+    now = now_us();
+    if (now >= report_us) {
+      print_interval(++second, conn_count);
+      report_us += 1000000ULL;
+    }
+
+    // Once sending is over wait for the server to catch up, frames still
+    // arriving are late rather than lost
+    if (stop_us) {
+      if (delivered != last_delivered || !quiet_us) {
+        last_delivered = delivered;
+        quiet_us = now + NETLOAD_DRAIN_US;
+      }
+      if (now >= quiet_us || now >= stop_us) break;
+    }
+  }
+
+  elapsed = (now_us() - start_us) / 1000000.0;
+  expected = sent * (conn_count - 1);
+  printf("Sent %lu frames on %d streams, %lu dropped unsent, "
+         "%d connections closed by the server\n", sent, stream_count,
+         tx_dropped, closed);
+  printf("Delivered %lu of %lu frames (%.2f%% lost), %lu headers, "
+         "%.1f frames/s, %.1f kB/s\n", delivered, expected,
+         expected ? 100.0 * (expected - (delivered < expected ?
+                                         delivered : expected)) / expected
+         : 0.0, headers, delivered / elapsed, rx_bytes / elapsed / 1000.0);
+  printf("On time within %llu ms: %.2f%% (%lu late)\n", deadline_us / 1000,
+         delivered ? 100.0 * (delivered - late) / delivered : 0.0, late);
+  hist_print(&latency, "Delivery latency (us)");
+
+  for (i = 0; i < conn_count; i++) {
+    if (conns[i].open) close(conns[i].fd);
+  }
+  close(timerfd);
+  close(epfd);
+  free(conns);
+  free(streams);
+  return 0;
+}
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 
+#include "capture.h"
 #include "common.h"
 #include "device_gmsk.h"
 #include "network.h"
@@ -14,37 +15,27 @@
 #define PORT 8191
 
 static network_t* network_ptr;
-FILE* fp;
+capture_writer_t capture;
+int capture_file = FALSE;
 
 void
 interrupt()
 {
   net_stop(network_ptr, FALSE);
-  if (fp) {
-    fclose(fp);
-  }
 }
 
 void net_rx_callback(unsigned char* buf, int buf_bytes)
 {
   unsigned int header;
-  int write_bytes;
-  int n;
 
   if (buf_bytes < 2) {
     fprintf(stderr, "uh oh...\n");
     return;
   }
 
-  if (fp) {
-    write_bytes = 0;
-    while (write_bytes < buf_bytes) {
-      n = fwrite(&buf[write_bytes], 1, buf_bytes-write_bytes, fp);
-      if (n <= 0) {
-        fprintf(stderr, "Error writing to file\n");
-        return;
-      }
-      write_bytes += n;
+  if (capture_file) {
+    if (!capture_write(&capture, CAPTURE_SRC_NET_RX, buf, buf_bytes)) {
+      fprintf(stderr, "Error writing to file\n");
     }
     return;
   }
@@ -81,11 +72,11 @@ int main(int argc, char* argv[])
   }
 
   if (argc == 3) {
-    fp = fopen(argv[2], "wb");
-    if (!fp) {
+    if (!capture_create(&capture, argv[2])) {
       fprintf(stderr, "Error opening file %s for output\n", argv[2]);
       return -1;
     }
+    capture_file = TRUE;
   }
 
   network_ptr = &ctx;
@@ -97,6 +88,11 @@ int main(int argc, char* argv[])
   }
   printf("Connected to %s on port %d\n", argv[1], PORT);
   
+  // The index is written once the read thread has finished
   net_wait(&ctx);
+  if (capture_file && !capture_close(&capture)) {
+    fprintf(stderr, "Error writing to file\n");
+    return -1;
+  }
   return 0;
 }
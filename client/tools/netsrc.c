@@ -6,86 +6,72 @@
 #include <unistd.h>
 #include <sys/socket.h>
 
-#include "network.h"
+#include "capture.h"
 #include "common.h"
+#include "network.h"
+#include "replay.h"
 
 #define PORT 8191
 
-int read_packet(FILE* fp, unsigned char* buf, int buf_len)
+int main(int argc, char* argv[])
 {
-  int expected_bytes = 2;
-  int received_bytes = 0;
-  int n;
+  capture_reader_t capture;
+  capture_frame_t frame;
+  replay_t replay;
+  double speed = 1.0;
+  int sent_bytes;
+  int n, opt;
+  network_t ctx;
 
-  n = fread(buf, 1, 2, fp);
-  if (n <= 0) {
-    if (feof(fp)) {
-      return n;
-    }
-    fprintf(stderr, "Error reading header\n");
-    return n;
-  }
-  received_bytes += n;
-  
-  expected_bytes = buf[0] + ((buf[1] & 0x1F) << 8);
-  if (expected_bytes >= buf_len) {
-    fprintf(stderr, "Expected %d bytes, buf only %d bytes available\n", expected_bytes, buf_len);
-    return -1;
-  }
-  
-  while (received_bytes < expected_bytes) {
-    n = fread(&buf[received_bytes], 1, expected_bytes-received_bytes, fp);
-    if (n <= 0) {
-      return n;
+  while ((opt = getopt(argc, argv, "x:")) != -1) {
+    switch (opt) {
+    case 'x':
+      if (!replay_parse_speed(optarg, &speed)) {
+        fprintf(stderr, "Invalid speed %s\n", optarg);
+        return -1;
+      }
+      break;
+    default:
+      argc = 0;
+      break;
     }
-    received_bytes += n;
   }
-  return received_bytes;
-}
-
-int main(int argc, char* argv[])
-{
-  FILE* fp;
-  unsigned char buf[8191];
-  int send_bytes, sent_bytes;
-  int n;
-  network_t ctx;
 
-  if (argc < 3) {
-    printf("Usage: %s <hostname> <data file>\n", argv[0]);
+  if (argc - optind < 2) {
+    printf("Usage: %s [-x speed] <hostname> <data file>\n", argv[0]);
+    printf("  -x replay speed, 0.5 for half speed, max for no pacing\n");
     return -1;
   }
   
-  fp = fopen(argv[2], "rb");
-  if (!fp) {
-    fprintf(stderr, "Error opening file %s\n", argv[2]);
+  if (!capture_open(&capture, argv[optind + 1])) {
+    fprintf(stderr, "Error opening file %s\n", argv[optind + 1]);
     return -1;
   }
 
-  if (!net_init(&ctx, argv[1], PORT, NULL)) {
-    fprintf(stderr, "Error connecting to %s on port %d\n", argv[1], PORT);
+  if (!net_init(&ctx, argv[optind], PORT, NULL)) {
+    fprintf(stderr, "Error connecting to %s on port %d\n", argv[optind],
+            PORT);
     return -1;
   }
-  printf("Connected to %s on port %d\n", argv[1], PORT);
+  printf("Connected to %s on port %d\n", argv[optind], PORT);
 
-  while(1) {
-    send_bytes = read_packet(fp, buf, 8191);
+  // Frames go out with the spacing they were captured with
+  replay_init(&replay, &capture, speed);
+  while(capture_next(&capture, &frame)) {
+    replay_wait(&replay, &frame);
     sent_bytes = 0;
-    while (sent_bytes < send_bytes) {
-      n = send(ctx.fd, &buf[sent_bytes], send_bytes-sent_bytes, 0);
+    while (sent_bytes < frame.buf_bytes) {
+      n = send(ctx.fd, &frame.buf[sent_bytes], frame.buf_bytes-sent_bytes, 0);
       if (n <= 0) {
         fprintf(stderr, "Error sending data to server\n");
         return -1;
       }
       sent_bytes += n;
     }
-    sleep_ms(send_bytes);
-    if (feof(fp)) {
-      break;
-    }
   }
+  replay_print(&replay, "replay");
 
   close(ctx.fd);
-  fclose(fp);
+  capture_unmap(&capture);
   return 0;
 }
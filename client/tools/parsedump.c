@@ -2,68 +2,107 @@
 // Parse data dump files
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
 #include "common.h"
 
-int rx(FILE* fp)
+void
+print_usage(char* cmd)
 {
-  unsigned char buf[8191];
-  int expected_bytes = 2;
-  int received_bytes = 0;
-  int n;
+  fprintf(stderr, "Usage: %s [-i] [-s stream_id] <data file>\n", cmd);
+  fprintf(stderr, "  -i list the streams in the file\n");
+  fprintf(stderr, "  -s only dump the stream with this id\n");
+}
 
-  n = fread(buf, 1, 2, fp);
-  if (n <= 0) {
-    if (feof(fp)) {
-      return 0;
-    }
-    fprintf(stderr, "Error reading header\n");
-    return -1;
-  }
-  received_bytes += n;
-  
-  expected_bytes = buf[0] + ((buf[1] & 0x1F) << 8);
-  if (expected_bytes >= 8191) {
-    fprintf(stderr, "Expected %d bytes, buf only 8191 bytes available\n", expected_bytes);
-    return -1;
-  }
-  
-  while (received_bytes < expected_bytes) {
-    n = fread(&buf[received_bytes], 1, expected_bytes-received_bytes, fp);
-    if (n <= 0) {
-      if (feof(fp)) {
-        break;
-      }
-      fprintf(stderr, "read returned %d\n", n);
-      break;
-    }
-    received_bytes += n;
+void
+print_index(capture_reader_t* r)
+{
+  int i;
+
+  printf("%d streams\n", r->stream_count);
+  for (i = 0; i < r->stream_count; i++) {
+    printf("  stream_id %5d at %10.3f s, offset %llu, %lu frames\n",
+           r->streams[i].stream_id, r->streams[i].time_us / 1000000.0,
+           r->streams[i].offset, r->streams[i].frames);
   }
-  
-  hex_dump("dump", buf, received_bytes);
-  return 0;
 }
 
 int main(int argc, char* argv[])
 {
-  FILE* fp;
+  capture_reader_t r;
+  capture_frame_t frame;
+  capture_stream_t* stream = NULL;
+  unsigned long frames = 0;
+  int stream_id = -1;
+  int index_only = FALSE;
+  char prefix[64];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "is:")) != -1) {
+    switch (opt) {
+    case 'i':
+      index_only = TRUE;
+      break;
+    case 's':
+      stream_id = atoi(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
 
-  if (argc < 2) {
-    printf("Usage: %s <data file>\n", argv[0]);
+  if (argc - optind < 1) {
+    print_usage(argv[0]);
     return -1;
   }
 
-  fp = fopen(argv[1], "rb");
-  if (!fp) {
-    fprintf(stderr, "Error opening file %s\n", argv[1]);
+  if (!capture_open(&r, argv[optind])) {
+    fprintf(stderr, "Error opening file %s\n", argv[optind]);
     return -1;
   }
 
-  while(1) {
-    rx(fp);
-    if (feof(fp)) {
-      break;
+  if (index_only) {
+    print_index(&r);
+    capture_unmap(&r);
+    return 0;
+  }
+
+  // Jump straight to the stream's header, frames of other streams are
+  // skipped until its last frame has been seen
+  if (stream_id >= 0) {
+    stream = capture_find_stream(&r, stream_id);
+    if (!stream || !capture_seek(&r, stream->offset)) {
+      fprintf(stderr, "Stream %d not found in %s\n", stream_id,
+              argv[optind]);
+      capture_unmap(&r);
+      return -1;
+    }
+  }
+
+  while (capture_next(&r, &frame)) {
+    if (stream) {
+      if (frame.buf_bytes < 4 ||
+          (frame.buf[3] << 8) + frame.buf[2] != stream_id) {
+        continue;
+      }
+      if (++frames > stream->frames) break;
+    }
+
+    if (r.raw) {
+      hex_dump("dump", frame.buf, frame.buf_bytes);
+    }
+    else {
+      snprintf(prefix, sizeof(prefix), "%10.6f %-7s %3d dump",
+               frame.time_us / 1000000.0, capture_source_name(frame.source),
+               frame.sender);
+      hex_dump(prefix, frame.buf, frame.buf_bytes);
     }
   }
 
+  capture_unmap(&r);
   return 0;
 }
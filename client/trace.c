@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "trace.h"
+
+static char* trace_hop_names[TRACE_HOPS] = {
+  "dvap rx -> net tx",
+  "net tx -> server in",
+  "server in -> server out",
+  "server out -> net rx",
+  "net rx -> dvap tx",
+  "end to end",
+};
+
+unsigned long long
+trace_now(void)
+{
+  struct timespec ts;
+
+  // Stamps are compared across hosts, so use the wall clock
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int
+trace_is_frame(unsigned char* buf, int buf_bytes)
+{
+  return (buf_bytes == TRACE_FRAME_BYTES &&
+          ((buf[1] << 8) + buf[0]) == TRACE_FRAME_TYPE);
+}
+
+static unsigned long long
+trace_get(unsigned char* buf, int hop)
+{
+  unsigned long long value = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+    value = (value << 8) | buf[6 + hop * 8 + i];
+  }
+  return value;
+}
+
+static void
+trace_put(unsigned char* buf, int hop, unsigned long long value)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    buf[6 + hop * 8 + i] = (value >> (i * 8)) & 0xFF;
+  }
+}
+
+// Slot for a GMSK frame, or -1 if buf is not one
+static int
+trace_slot(unsigned char* buf, int buf_bytes)
+{
+  unsigned int header;
+
+  if (buf_bytes < 6) return -1;
+  header = (buf[1] << 8) + buf[0];
+  if (header == 0xA02F && buf_bytes == GMSK_HEADER_BYTES) {
+    return GMSK_FRAMES_PER_SUPER;
+  }
+  if (header == 0xC012 && buf_bytes == GMSK_DATA_BYTES) {
+    return buf[5] % GMSK_FRAMES_PER_SUPER;
+  }
+  return -1;
+}
+
+int
+trace_build(unsigned char* trace, unsigned char* buf, int buf_bytes,
+            unsigned long long rx_us)
+{
+  int slot = trace_slot(buf, buf_bytes);
+
+  if (slot < 0) return FALSE;
+
+  memset(trace, 0, TRACE_FRAME_BYTES);
+  trace[0] = TRACE_FRAME_TYPE & 0xFF;
+  trace[1] = TRACE_FRAME_TYPE >> 8;
+  trace[2] = buf[2];
+  trace[3] = buf[3];
+  trace[4] = (slot == GMSK_FRAMES_PER_SUPER) ? TRACE_SEQ_HEADER : slot;
+  trace_put(trace, TRACE_DVAP_RX, rx_us);
+  return TRUE;
+}
+
+void
+trace_stamp(unsigned char* buf, int buf_bytes, int hop)
+{
+  if (trace_is_frame(buf, buf_bytes)) {
+    trace_put(buf, hop, trace_now());
+  }
+}
+
+int
+trace_init(trace_t* t)
+{
+  int i;
+
+  memset(t->pending_valid, 0, sizeof(t->pending_valid));
+  for (i = 0; i < TRACE_HOPS; i++) {
+    hist_init(&(t->hops[i]));
+  }
+  t->unmatched = 0;
+
+  if (pthread_mutex_init(&(t->mutex), NULL)) {
+    fprintf(stderr, "trace_init - error creating mutex\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void
+trace_delete(trace_t* t)
+{
+  pthread_mutex_destroy(&(t->mutex));
+}
+
+void
+trace_receive(trace_t* t, unsigned char* buf, int buf_bytes)
+{
+  int slot;
+
+  if (!trace_is_frame(buf, buf_bytes)) return;
+  trace_put(buf, TRACE_NET_RX, trace_now());
+  slot = (buf[4] == TRACE_SEQ_HEADER) ? GMSK_FRAMES_PER_SUPER :
+         buf[4] % GMSK_FRAMES_PER_SUPER;
+
+  pthread_mutex_lock(&(t->mutex));
+  if (t->pending_valid[slot]) {
+    t->unmatched++;
+  }
+  memcpy(t->pending[slot], buf, TRACE_FRAME_BYTES);
+  t->pending_valid[slot] = TRUE;
+  pthread_mutex_unlock(&(t->mutex));
+}
+
+static void
+trace_record(hist_t* h, unsigned long long from, unsigned long long to)
+{
+  // Unstamped hops are skipped, clocks running behind count as zero
+  if (!from || !to) return;
+  hist_record(h, (to > from) ? to - from : 0);
+}
+
+void
+trace_complete(trace_t* t, unsigned char* buf, int buf_bytes)
+{
+  unsigned char* trace;
+  int slot = trace_slot(buf, buf_bytes);
+  int i;
+
+  if (slot < 0) return;
+
+  pthread_mutex_lock(&(t->mutex));
+  trace = t->pending[slot];
+  if (t->pending_valid[slot] && trace[2] == buf[2] && trace[3] == buf[3]) {
+    trace_put(trace, TRACE_DVAP_TX, trace_now());
+    for (i = 0; i < TRACE_STAMPS - 1; i++) {
+      trace_record(&(t->hops[i]), trace_get(trace, i), trace_get(trace, i + 1));
+    }
+    trace_record(&(t->hops[TRACE_HOPS - 1]), trace_get(trace, TRACE_DVAP_RX),
+                 trace_get(trace, TRACE_DVAP_TX));
+    t->pending_valid[slot] = FALSE;
+  }
+  pthread_mutex_unlock(&(t->mutex));
+}
+
+void
+trace_print(trace_t* t)
+{
+  int i;
+
+  pthread_mutex_lock(&(t->mutex));
+  printf("Latency by hop (us), %lu traced frames not played:\n",
+         t->unmatched);
+  for (i = 0; i < TRACE_HOPS; i++) {
+    hist_print(&(t->hops[i]), trace_hop_names[i]);
+  }
+  pthread_mutex_unlock(&(t->mutex));
+}
@@ -0,0 +1,66 @@
+// Per-frame latency tracing. A client started with tracing follows each
+// GMSK frame it sends with a trace frame, every hop on the way to the
+// radio at the far end stamps it with the wall clock time.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+
+#include "device_gmsk.h"
+#include "hist.h"
+
+// Trace frames use DVAP message type 7, which the device never sends.
+// They are consumed by the receiving client and never reach a device.
+//
+//   bytes 0-1   length and type, 0xE036 little endian
+//   bytes 2-3   stream_id of the traced frame
+//   byte  4     seq of the traced frame, 0xFF for a header
+//   byte  5     reserved, 0
+//   bytes 6-53  TRACE_* stamps, us since the epoch, little endian,
+//               0 until the hop is passed
+#define TRACE_FRAME_BYTES 54
+#define TRACE_FRAME_TYPE  0xE036
+#define TRACE_SEQ_HEADER  0xFF
+
+#define TRACE_DVAP_RX     0	// frame read from the sending device
+#define TRACE_NET_TX      1	// frame taken off the network send queue
+#define TRACE_SERVER_IN   2	// read by the server
+#define TRACE_SERVER_OUT  3	// written by the server to this client
+#define TRACE_NET_RX      4	// read by the receiving client
+#define TRACE_DVAP_TX     5	// written to the receiving device
+#define TRACE_STAMPS      6
+
+#define TRACE_HOPS        TRACE_STAMPS	// between stamps, plus end to end
+#define TRACE_SLOTS       (GMSK_FRAMES_PER_SUPER + 1)	// by seq, then header
+
+// Receiving side, pairs trace frames with the frames they follow
+typedef struct {
+  pthread_mutex_t mutex;	// acquire before using anything below
+  unsigned char pending[TRACE_SLOTS][TRACE_FRAME_BYTES];
+  int pending_valid[TRACE_SLOTS];
+  hist_t hops[TRACE_HOPS];
+  unsigned long unmatched;	// traced frames never written to the device
+} trace_t;
+
+unsigned long long trace_now(void);
+
+// Build a trace frame for a GMSK frame read from the device at rx_us
+int trace_build(unsigned char* trace, unsigned char* buf, int buf_bytes,
+                unsigned long long rx_us);
+
+// Stamp hop if buf is a trace frame, anything else is left alone
+void trace_stamp(unsigned char* buf, int buf_bytes, int hop);
+
+int trace_init(trace_t* t);
+void trace_delete(trace_t* t);
+
+// A trace frame arrived from the network, hold it until its frame plays
+void trace_receive(trace_t* t, unsigned char* buf, int buf_bytes);
+
+// A GMSK frame was written to the device, record the hops if it was traced
+void trace_complete(trace_t* t, unsigned char* buf, int buf_bytes);
+
+// Print a histogram per hop
+void trace_print(trace_t* t);
+
+#endif
@@ -0,0 +1,73 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "txsched.h"
+
+void
+txsched_init(txsched_t* s, int period_us)
+{
+  memset(s, 0, sizeof(txsched_t));
+  s->period_us = period_us;
+  s->start_us = now_us() + period_us;
+}
+
+static unsigned long long
+txsched_deadline(txsched_t* s)
+{
+  return s->start_us + s->periods * s->period_us;
+}
+
+int
+txsched_release(txsched_t* s)
+{
+  unsigned long long now = now_us();
+  unsigned long long deadline = txsched_deadline(s);
+  unsigned long long lateness;
+  int n;
+
+  if (now < deadline) return 0;
+
+  // Every period that has gone by is released, so a stall delays frames
+  // but does not lose them unless it runs on too long
+  lateness = now - deadline;
+  n = lateness / s->period_us + 1;
+  if (n > TXSCHED_MAX_CATCHUP) {
+    s->skipped += n - TXSCHED_MAX_CATCHUP;
+    s->periods += n - TXSCHED_MAX_CATCHUP;
+    n = TXSCHED_MAX_CATCHUP;
+  }
+  s->periods += n;
+  s->ticks += n;
+  s->wakeups++;
+
+  if (lateness > TXSCHED_LATE_US) s->late++;
+  if (lateness > s->lateness_max_us) s->lateness_max_us = lateness;
+  s->lateness_total_us += lateness;
+  s->drift_us = (long long)now - (long long)(txsched_deadline(s) -
+                                             s->period_us);
+  return n;
+}
+
+int
+txsched_wait(txsched_t* s)
+{
+  unsigned long long deadline = txsched_deadline(s);
+  struct timespec ts;
+
+  ts.tv_sec = deadline / 1000000ULL;
+  ts.tv_nsec = (deadline % 1000000ULL) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  return txsched_release(s);
+}
+
+void
+txsched_print(txsched_t* s, char* name)
+{
+  printf("%s: %lu frames, %lu late, %lu skipped, lateness mean %llu us "
+         "max %llu us, drift %lld us\n", name, s->ticks, s->late, s->skipped,
+         s->wakeups ? s->lateness_total_us / s->wakeups : 0, s->lateness_max_us,
+         s->drift_us);
+}
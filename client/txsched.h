@@ -0,0 +1,39 @@
+// Releases transmit frames on absolute CLOCK_MONOTONIC deadlines one
+// frame period apart, so sleep error does not add up over a long
+// transmission, and keeps lateness and drift statistics
+#ifndef TXSCHED_H
+#define TXSCHED_H
+
+#define TXSCHED_FRAME_US    20000	// one AMBE frame
+#define TXSCHED_LATE_US     2000	// released later than this counts late
+#define TXSCHED_MAX_CATCHUP 5		// periods made up after a stall
+
+typedef struct {
+  int period_us;
+  unsigned long long start_us;		// deadline of the first period
+  unsigned long long periods;		// periods released or skipped
+
+  unsigned long ticks;			// periods released
+  unsigned long late;			// released over TXSCHED_LATE_US late
+  unsigned long skipped;		// given up on after a long stall
+  unsigned long wakeups;		// releases of one or more periods
+  unsigned long long lateness_total_us;
+  unsigned long long lateness_max_us;
+  long long drift_us;			// last release against the ideal
+} txsched_t;
+
+// Start the schedule, the first deadline is one period from now
+void txsched_init(txsched_t* s, int period_us);
+
+// Sleep until the next deadline. Returns the number of periods to
+// release, more than one when the caller fell behind.
+int txsched_wait(txsched_t* s);
+
+// For callers woken by something else, such as an event loop timer.
+// Returns the number of periods due now, possibly none.
+int txsched_release(txsched_t* s);
+
+// Print a one line summary prefixed with name
+void txsched_print(txsched_t* s, char* name);
+
+#endif
@@ -0,0 +1,294 @@
+// archive.go
+// Stream archive, every frame the server receives is queued once and
+// written by its own goroutine in the client capture format
+
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"os"
+	"sort"
+	"sync/atomic"
+	"time"
+)
+
+// Must match client/capture.h, archives can be read with parsedump and
+// replayed with netsrc.
+//
+//	file header  "DVCAPTR1", u64 start realtime us, u64 0
+//	record       u64 us since start, u16 frame bytes, u8 source,
+//	             u8 sender, u32 record number, frame
+//	index entry  u64 record offset, u64 us since start, u16 stream_id,
+//	             u16 reserved, u32 frames
+//	footer       "DVINDEX1", u64 index offset, u32 entries, u32 reserved
+//
+// Senders are numbered per file, <file>.senders lists who they are.
+const (
+	CAPTURE_MAGIC        = "DVCAPTR1"
+	CAPTURE_INDEX_MAGIC  = "DVINDEX1"
+	CAPTURE_HEADER_SIZE  = 24
+	CAPTURE_RECORD_SIZE  = 16
+	CAPTURE_INDEX_SIZE   = 24
+	CAPTURE_SRC_SERVER   = 5
+	ARCHIVE_QUEUE        = 4096 // frames waiting for the writer
+	ARCHIVE_BUFFER       = 256 * 1024
+	ARCHIVE_FLUSH        = time.Second
+	ARCHIVE_MAX_SENDERS  = 255
+	ARCHIVE_BACKLOG_WARN = ARCHIVE_QUEUE / 2
+)
+
+type archiveFrame struct {
+	at     time.Time
+	sender string
+	data   []byte
+}
+
+type archiveStream struct {
+	offset   uint64
+	at       uint64
+	streamId uint16
+	frames   uint32
+}
+
+type Archive struct {
+	path     string
+	maxBytes int64
+	maxAge   time.Duration
+	frames   chan archiveFrame
+	stop     chan chan bool
+
+	// Owned by the writer goroutine
+	file    *os.File
+	writer  *bufio.Writer
+	name    string
+	opened  time.Time
+	offset  uint64
+	records uint32
+	senders map[string]byte
+	streams []archiveStream
+
+	// Updated by the writer, read by Print
+	written uint64
+	files   uint64
+	dropped uint64 // frames lost because the queue was full
+}
+
+func NewArchive(path string, maxBytes int64, maxAge time.Duration) *Archive {
+	archive := &Archive{
+		path:     path,
+		maxBytes: maxBytes,
+		maxAge:   maxAge,
+		frames:   make(chan archiveFrame, ARCHIVE_QUEUE),
+		stop:     make(chan chan bool),
+	}
+	if !archive.open() {
+		return nil
+	}
+	go archive.run()
+	return archive
+}
+
+// Queue a frame, never blocks. The data must not be changed afterwards.
+func (archive *Archive) Write(msg Message) {
+	select {
+	case archive.frames <- archiveFrame{time.Now(), msg.sender, msg.data}:
+	default:
+		atomic.AddUint64(&archive.dropped, 1)
+	}
+}
+
+func (archive *Archive) open() bool {
+	now := time.Now()
+	name := fmt.Sprintf("%s.%s", archive.path, now.Format("20060102-150405"))
+
+	// Files rotated within the same second get a suffix
+	f, err := os.OpenFile(name, os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+	for n := 1; os.IsExist(err) && n < 100; n++ {
+		name = fmt.Sprintf("%s.%s.%d", archive.path,
+			now.Format("20060102-150405"), n)
+		f, err = os.OpenFile(name, os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+	}
+	if err != nil {
+		Printf("Error creating archive %s: %s\n", name, err.Error())
+		return false
+	}
+	Printf("Archiving to \"%s\"\n", name)
+
+	archive.file = f
+	archive.writer = bufio.NewWriterSize(f, ARCHIVE_BUFFER)
+	archive.name = name
+	archive.opened = now
+	archive.offset = CAPTURE_HEADER_SIZE
+	archive.records = 0
+	archive.senders = make(map[string]byte)
+	archive.streams = archive.streams[:0]
+
+	var header [CAPTURE_HEADER_SIZE]byte
+	copy(header[0:8], CAPTURE_MAGIC)
+	binary.LittleEndian.PutUint64(header[8:16],
+		uint64(now.UnixNano()/1000))
+	archive.writer.Write(header[:])
+	atomic.AddUint64(&archive.files, 1)
+	return true
+}
+
+// Write the stream index and the sender list, then close the file
+func (archive *Archive) close() {
+	if archive.file == nil {
+		return
+	}
+	var entry [CAPTURE_INDEX_SIZE]byte
+	for _, s := range archive.streams {
+		binary.LittleEndian.PutUint64(entry[0:8], s.offset)
+		binary.LittleEndian.PutUint64(entry[8:16], s.at)
+		binary.LittleEndian.PutUint16(entry[16:18], s.streamId)
+		binary.LittleEndian.PutUint16(entry[18:20], 0)
+		binary.LittleEndian.PutUint32(entry[20:24], s.frames)
+		archive.writer.Write(entry[:])
+	}
+	copy(entry[0:8], CAPTURE_INDEX_MAGIC)
+	binary.LittleEndian.PutUint64(entry[8:16], archive.offset)
+	binary.LittleEndian.PutUint32(entry[16:20], uint32(len(archive.streams)))
+	binary.LittleEndian.PutUint32(entry[20:24], 0)
+	archive.writer.Write(entry[:])
+	if err := archive.writer.Flush(); err != nil {
+		Printf("Error writing archive %s: %s\n", archive.name, err.Error())
+	}
+	archive.file.Close()
+
+	ids := make([]string, 0, len(archive.senders))
+	for id := range archive.senders {
+		ids = append(ids, id)
+	}
+	sort.Slice(ids, func(i, j int) bool {
+		return archive.senders[ids[i]] < archive.senders[ids[j]]
+	})
+	f, err := os.Create(archive.name + ".senders")
+	if err != nil {
+		Printf("Error creating %s.senders\n", archive.name)
+		return
+	}
+	for _, id := range ids {
+		fmt.Fprintf(f, "%d %s\n", archive.senders[id], id)
+	}
+	f.Close()
+}
+
+func (archive *Archive) sender(id string) byte {
+	n, ok := archive.senders[id]
+	if !ok && len(archive.senders) < ARCHIVE_MAX_SENDERS {
+		n = byte(len(archive.senders) + 1)
+		archive.senders[id] = n
+	}
+	return n
+}
+
+// Add a stream for each GMSK header and count the frames of each stream,
+// looking back only a few streams since data follows its header
+func (archive *Archive) index(offset uint64, at uint64, data []byte) {
+	if len(data) < 4 {
+		return
+	}
+	header := binary.LittleEndian.Uint16(data[0:2])
+	streamId := binary.LittleEndian.Uint16(data[2:4])
+	if header == 0xA02F && len(data) == 47 {
+		archive.streams = append(archive.streams,
+			archiveStream{offset, at, streamId, 1})
+	} else if header == 0xC012 && len(data) == 18 {
+		for i := len(archive.streams) - 1; i >= 0 &&
+			i >= len(archive.streams)-8; i-- {
+			if archive.streams[i].streamId == streamId {
+				archive.streams[i].frames++
+				break
+			}
+		}
+	}
+}
+
+func (archive *Archive) record(frame archiveFrame) {
+	at := uint64(frame.at.Sub(archive.opened) / time.Microsecond)
+	var rec [CAPTURE_RECORD_SIZE]byte
+	binary.LittleEndian.PutUint64(rec[0:8], at)
+	binary.LittleEndian.PutUint16(rec[8:10], uint16(len(frame.data)))
+	rec[10] = CAPTURE_SRC_SERVER
+	rec[11] = archive.sender(frame.sender)
+	binary.LittleEndian.PutUint32(rec[12:16], archive.records)
+	archive.writer.Write(rec[:])
+	archive.writer.Write(frame.data)
+
+	archive.index(archive.offset, at, frame.data)
+	archive.offset += uint64(CAPTURE_RECORD_SIZE + len(frame.data))
+	archive.records++
+	atomic.AddUint64(&archive.written, 1)
+}
+
+// Start a new file once this one is big or old enough. Opening a file
+// that failed before is only retried when retry is set.
+func (archive *Archive) rotate(retry bool) {
+	if archive.file == nil && !retry {
+		return
+	}
+	if archive.file != nil {
+		if (archive.maxBytes <= 0 || int64(archive.offset) < archive.maxBytes) &&
+			(archive.maxAge <= 0 || time.Since(archive.opened) < archive.maxAge) {
+			return
+		}
+		archive.close()
+	}
+	if !archive.open() {
+		// Keep draining the queue so nothing backs up, frames are lost
+		archive.file = nil
+		archive.writer = bufio.NewWriterSize(nilWriter{}, ARCHIVE_BUFFER)
+		archive.opened = time.Now()
+	}
+}
+
+type nilWriter struct{}
+
+func (nilWriter) Write(p []byte) (int, error) { return len(p), nil }
+
+// Records are gathered in a large buffer that is written out when full
+// and at least once a second, rather than once per frame
+func (archive *Archive) run() {
+	ticker := time.NewTicker(ARCHIVE_FLUSH)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case frame := <-archive.frames:
+			archive.record(frame)
+			for pending := len(archive.frames); pending > 0; pending-- {
+				archive.record(<-archive.frames)
+			}
+			archive.rotate(false)
+		case <-ticker.C:
+			archive.writer.Flush()
+			archive.rotate(true)
+			if backlog := len(archive.frames); backlog > ARCHIVE_BACKLOG_WARN {
+				Printf("Archive backlog %d frames\n", backlog)
+			}
+		case done := <-archive.stop:
+			for pending := len(archive.frames); pending > 0; pending-- {
+				archive.record(<-archive.frames)
+			}
+			archive.close()
+			done <- true
+			return
+		}
+	}
+}
+
+// Write out what is queued and finish the file, for server shutdown
+func (archive *Archive) Close() {
+	done := make(chan bool)
+	archive.stop <- done
+	<-done
+}
+
+func (archive *Archive) Print() {
+	Printf("Archive: %d frames written, %d files, %d dropped, backlog %d\n",
+		atomic.LoadUint64(&archive.written), atomic.LoadUint64(&archive.files),
+		atomic.LoadUint64(&archive.dropped), len(archive.frames))
+}
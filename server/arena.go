@@ -0,0 +1,28 @@
+// arena.go
+// Frames read from a client are sliced out of large chunks rather than
+// each getting its own CONN_MAX_SIZE buffer
+
+package main
+
+const ARENA_CHUNK = 64 * 1024 // holds thousands of GMSK frames
+
+// A frame handed out is never written by the arena again, so it can be
+// queued to any number of clients and the archive without copying or
+// reference counting. A chunk that is nearly used up is left to the GC,
+// which frees it once every frame sliced from it has been sent.
+//
+// Each arena belongs to the goroutine reading its client.
+type FrameArena struct {
+	chunk []byte
+}
+
+// A frame of n bytes, n must not exceed CONN_MAX_SIZE
+func (arena *FrameArena) Alloc(n int) []byte {
+	if len(arena.chunk) < n {
+		arena.chunk = make([]byte, ARENA_CHUNK)
+	}
+	// Capped so an append cannot run into the next frame
+	data := arena.chunk[:n:n]
+	arena.chunk = arena.chunk[n:]
+	return data
+}
@@ -0,0 +1,87 @@
+// histogram.go
+// Log-linear latency histogram, same layout as client/hist.c
+
+package main
+
+import (
+	"fmt"
+)
+
+const (
+	HIST_SUB_BITS  = 6
+	HIST_SUB       = 1 << HIST_SUB_BITS
+	HIST_MAX_SHIFT = 25
+	HIST_BUCKETS   = (HIST_MAX_SHIFT + 2) * HIST_SUB
+)
+
+// Values below 128 are counted exactly, above that each power of two is
+// split into 64 buckets
+type Histogram struct {
+	counts [HIST_BUCKETS]uint64
+	total  uint64
+	sum    uint64
+	min    uint64
+	max    uint64
+}
+
+func histIndex(value uint64) int {
+	if value>>(HIST_MAX_SHIFT+HIST_SUB_BITS+1) != 0 {
+		value = 1<<(HIST_MAX_SHIFT+HIST_SUB_BITS+1) - 1
+	}
+	shift := uint(0)
+	for value>>shift >= 2*HIST_SUB {
+		shift++
+	}
+	return int(shift)*HIST_SUB + int(value>>shift)
+}
+
+// Lowest value counted in a bucket
+func histValue(index int) uint64 {
+	shift := 0
+	if index >= 2*HIST_SUB {
+		shift = index/HIST_SUB - 1
+	}
+	return uint64(index-shift*HIST_SUB) << uint(shift)
+}
+
+func (h *Histogram) Record(value uint64) {
+	h.counts[histIndex(value)]++
+	if h.total == 0 || value < h.min {
+		h.min = value
+	}
+	if value > h.max {
+		h.max = value
+	}
+	h.total++
+	h.sum += value
+}
+
+// Smallest recorded value that percent of the samples are at or below
+func (h *Histogram) Percentile(percent float64) uint64 {
+	want := uint64(float64(h.total)*percent/100.0 + 0.5)
+	if want < 1 {
+		want = 1
+	}
+	seen := uint64(0)
+	for i := range h.counts {
+		seen += h.counts[i]
+		if seen >= want {
+			if v := histValue(i); v < h.max {
+				return v
+			}
+			return h.max
+		}
+	}
+	return h.max
+}
+
+func (h *Histogram) Print(name string) {
+	if h.total == 0 {
+		fmt.Printf("  %-24s no samples\n", name)
+		return
+	}
+	fmt.Printf("  %-24s %7d  mean %7d  p50 %7d  p90 %7d  p99 %7d  "+
+		"p99.9 %7d  max %7d\n", name, h.total, h.sum/h.total,
+		h.Percentile(50), h.Percentile(90), h.Percentile(99),
+		h.Percentile(99.9), h.max)
+}
@@ -11,13 +11,23 @@ import (
 	"fmt"
 	"github.com/alecthomas/kingpin"
 	"os"
+	"os/signal"
+	"syscall"
 	"time"
 )
 
 var (
 	app     = kingpin.New("server", "DVAP Bridge Server")
 	debug   = app.Flag("debug", "Enable debug mode").Short('d').Bool()
-	logfile = app.Flag("logfile", "Log data to file").Short('l').String()
+	logfile = app.Flag("logfile", "Archive data to files starting with this name").Short('l').String()
+	udp     = app.Flag("udp", "Also accept clients over UDP").Default("true").Bool()
+
+	queueFrames  = app.Flag("queue", "Frames queued per client before dropping").Default("50").Int()
+	queueTimeout = app.Flag("queue-timeout", "Disconnect clients overflowing their queue this long").Default("5s").Duration()
+	coalesce     = app.Flag("coalesce", "Hold frames this long to batch writes to each client, at most half a frame time").Default("0s").Duration()
+
+	logfileSize = app.Flag("logfile-size", "Start a new archive file after this many bytes").Default("67108864").Int64()
+	logfileAge  = app.Flag("logfile-age", "Start a new archive file after this long").Default("1h").Duration()
 )
 
 func Printf(format string, a ...interface{}) {
@@ -27,11 +37,39 @@ func Printf(format string, a ...interface{}) {
 
 func main() {
 	kingpin.MustParse(app.Parse(os.Args[1:]))
+	if *coalesce > COALESCE_MAX {
+		Printf("Coalescing frames for %s, not %s\n", COALESCE_MAX, *coalesce)
+		*coalesce = COALESCE_MAX
+	}
 	server := NewServer()
 
 	if *logfile != "" {
-		server.SetLogfile(*logfile)
+		server.SetLogfile(*logfile, *logfileSize, *logfileAge)
 	}
 
+	// Finish the archive so it keeps its stream index
+	quit := make(chan os.Signal, 1)
+	signal.Notify(quit, syscall.SIGINT, syscall.SIGTERM)
+	go func() {
+		<-quit
+		if server.archive != nil {
+			server.archive.Close()
+		}
+		os.Exit(0)
+	}()
+
+	// Dump trace latency histograms and client queues on demand
+	dump := make(chan os.Signal, 1)
+	signal.Notify(dump, syscall.SIGUSR1)
+	go func() {
+		for range dump {
+			tracer.Print()
+			server.stats <- true
+		}
+	}()
+
+	if *udp {
+		server.StartUDP()
+	}
 	server.Start()
 }
@@ -0,0 +1,193 @@
+// sendqueue.go
+// Bounded per-client send queue, so one slow client cannot hold up the
+// broadcast to everyone else
+
+package main
+
+import (
+	"encoding/binary"
+	"sync"
+	"time"
+)
+
+// A ring of frames waiting to be written to one client. Push never
+// blocks: when the ring is full the oldest data frame is dropped to make
+// room, GMSK headers are kept so the client can still follow streams.
+type SendQueue struct {
+	mutex  sync.Mutex // acquire before using the fields below
+	ring   []Message
+	head   int
+	count  int
+	closed bool
+	notify chan struct{} // signalled when frames are added or on Close
+
+	overflowSince time.Time // zero unless the queue has been overflowing
+	limit         time.Duration
+
+	queued   uint64
+	sent     uint64
+	dropped  uint64 // data frames dropped to make room
+	headers  uint64 // headers dropped, only when nothing else could be
+	maxDepth int
+}
+
+type SendQueueStats struct {
+	Queued, Sent, Dropped, Headers uint64
+	Depth, MaxDepth                int
+}
+
+func NewSendQueue(size int, limit time.Duration) *SendQueue {
+	if size < 2 {
+		size = 2
+	}
+	return &SendQueue{
+		ring:   make([]Message, size),
+		notify: make(chan struct{}, 1),
+		limit:  limit,
+	}
+}
+
+func isGmskHeader(data []byte) bool {
+	return len(data) >= 2 && binary.LittleEndian.Uint16(data[0:2]) == 0xA02F
+}
+
+func (q *SendQueue) signal() {
+	select {
+	case q.notify <- struct{}{}:
+	default:
+	}
+}
+
+// Remove the frame at position i from the front of the queue
+func (q *SendQueue) remove(i int) {
+	size := len(q.ring)
+	for ; i > 0; i-- {
+		q.ring[(q.head+i)%size] = q.ring[(q.head+i-1)%size]
+	}
+	q.ring[q.head] = Message{}
+	q.head = (q.head + 1) % size
+	q.count--
+}
+
+// Make room for msg, returns false if msg itself should be dropped
+func (q *SendQueue) evict(msg Message) bool {
+	for i := 0; i < q.count; i++ {
+		if !isGmskHeader(q.ring[(q.head+i)%len(q.ring)].data) {
+			q.remove(i)
+			q.dropped++
+			return true
+		}
+	}
+
+	// Nothing but headers queued, the newest header matters most
+	if isGmskHeader(msg.data) {
+		q.remove(0)
+		q.headers++
+		return true
+	}
+	q.dropped++
+	return false
+}
+
+// Queue msg for the client. Returns false once the queue has been
+// overflowing for longer than its limit, the client should then be
+// disconnected.
+func (q *SendQueue) Push(msg Message) bool {
+	q.mutex.Lock()
+	defer q.mutex.Unlock()
+	if q.closed {
+		return true
+	}
+
+	if q.count == len(q.ring) {
+		now := time.Now()
+		if q.overflowSince.IsZero() {
+			q.overflowSince = now
+		}
+		if !q.evict(msg) {
+			return q.limit <= 0 || now.Sub(q.overflowSince) < q.limit
+		}
+	}
+
+	q.ring[(q.head+q.count)%len(q.ring)] = msg
+	q.count++
+	q.queued++
+	if q.count > q.maxDepth {
+		q.maxDepth = q.count
+	}
+	q.signal()
+	return q.limit <= 0 || q.overflowSince.IsZero() ||
+		time.Since(q.overflowSince) < q.limit
+}
+
+// Take the next frame without waiting
+func (q *SendQueue) TryPop() (Message, bool) {
+	q.mutex.Lock()
+	defer q.mutex.Unlock()
+	if q.count == 0 {
+		return Message{}, false
+	}
+	msg := q.ring[q.head]
+	q.remove(0)
+	q.sent++
+
+	// Caught up to half full, the client is keeping up again
+	if q.count <= len(q.ring)/2 {
+		q.overflowSince = time.Time{}
+	}
+	return msg, true
+}
+
+// Take every queued frame without waiting, appended to batch
+func (q *SendQueue) TryPopAll(batch []Message) []Message {
+	q.mutex.Lock()
+	defer q.mutex.Unlock()
+	for q.count > 0 {
+		batch = append(batch, q.ring[q.head])
+		q.remove(0)
+		q.sent++
+	}
+	q.overflowSince = time.Time{}
+	return batch
+}
+
+// Wait for frames and take all of them, returns false once the queue is
+// closed
+func (q *SendQueue) PopAll(batch []Message) ([]Message, bool) {
+	for {
+		if batch = q.TryPopAll(batch); len(batch) > 0 {
+			return batch, true
+		}
+		q.mutex.Lock()
+		closed := q.closed
+		q.mutex.Unlock()
+		if closed {
+			return batch, false
+		}
+		<-q.notify
+	}
+}
+
+// Channel signalled when frames may be waiting, for writers that also
+// wait on other events
+func (q *SendQueue) Ready() <-chan struct{} {
+	return q.notify
+}
+
+// Stop queueing and wake the writer, frames still queued are dropped
+func (q *SendQueue) Close() {
+	q.mutex.Lock()
+	q.closed = true
+	for q.count > 0 {
+		q.remove(0)
+	}
+	q.mutex.Unlock()
+	q.signal()
+}
+
+func (q *SendQueue) Stats() SendQueueStats {
+	q.mutex.Lock()
+	defer q.mutex.Unlock()
+	return SendQueueStats{q.queued, q.sent, q.dropped, q.headers, q.count,
+		q.maxDepth}
+}
@@ -7,7 +7,8 @@ import (
 	"fmt"
 	"io"
 	"net"
-	"os"
+	"sync"
+	"sync/atomic"
 	"time"
 )
 
@@ -17,6 +18,7 @@ const (
 	CONN_PORT     = "8191"
 	CONN_TYPE     = "tcp"
 	CONN_MAX_SIZE = 8191
+	COALESCE_MAX  = 10 * time.Millisecond // half a GMSK frame
 )
 
 // Message
@@ -37,45 +39,51 @@ type Server struct {
 	clients   map[string]*Client
 	callsigns map[string]string
 	joins     chan net.Conn
-	incoming  chan Message
+	leaves    chan *Client // disconnects, frames never pass through Listen
 	outgoing  chan Message
-	log       *bufio.Writer
+	stats     chan bool
+	archive   *Archive
+
+	// []*Client read by Broadcast, a new copy is stored by Listen
+	// whenever clients changes
+	snapshot atomic.Value
+
+	udpJoins    chan *Client
+	udpSessions map[string]*Client // owned by the udp reader
+	udpMutex    sync.Mutex         // acquire before using udpSessions
 }
 
-func (server *Server) SetLogfile(logfile string) {
-	Printf("Logging data to file \"%s\"\n", logfile)
-	f, err := os.Create(logfile)
-	if err != nil {
-		Printf("Error creating log file\n")
-		return
-	}
-	server.log = bufio.NewWriter(f)
+// Archive every frame received to files starting with logfile
+func (server *Server) SetLogfile(logfile string, maxBytes int64,
+	maxAge time.Duration) {
+	server.archive = NewArchive(logfile, maxBytes, maxAge)
 }
 
 func (server *Server) PrintClients() {
 	Printf("Clients:\n")
 	if len(server.clients) > 0 {
 		for k := range server.clients {
-			callsign := server.clients[k].callsign
+			callsign := server.clients[k].Callsign()
 			if callsign != "" {
 				fmt.Printf("                          %s [%s]\n", k, callsign)
 			} else {
 				fmt.Printf("                          %s\n", k)
 			}
+			server.clients[k].PrintQueue("                            ")
 		}
 	} else {
 		fmt.Println("                          None")
 	}
 }
 
-func (server *Server) parsePacket(msg Message) {
+// Runs on the goroutine reading from the sender, so frames from
+// different clients are parsed and fanned out in parallel
+func (server *Server) parsePacket(client *Client, msg Message) {
 	header := binary.LittleEndian.Uint16(msg.data[0:2])
 	switch header {
 	case 0xA02F: // GMSK header
 		urcall, mycall := gmskParseHeader(msg)
-		if server.clients[msg.sender] != nil {
-			server.clients[msg.sender].callsign = mycall
-		}
+		client.SetCallsign(mycall)
 		if urcall != "CQCQCQ  " {
 			Printf("Non-CQ packet: [%s] => [%s]\n", mycall, urcall)
 		}
@@ -83,6 +91,8 @@ func (server *Server) parsePacket(msg Message) {
 	case 0xC012: // GMSK data
 		//gmskParseData(msg)
 		server.Broadcast(msg)
+	case TRACE_FRAME_TYPE: // Latency trace, stamped on the way in
+		server.Broadcast(msg)
 	default:
 		// Everything else
 		if *debug {
@@ -91,41 +101,61 @@ func (server *Server) parsePacket(msg Message) {
 	}
 }
 
+// Never blocks, a client that cannot keep up loses frames from its own
+// queue and is disconnected if it stays behind. Safe to call from any
+// goroutine, clients joining or leaving meanwhile may miss the frame.
 func (server *Server) Broadcast(msg Message) {
-	for _, client := range server.clients {
+	if server.archive != nil {
+		server.archive.Write(msg)
+	}
+	for _, client := range server.snapshot.Load().([]*Client) {
 		if msg.sender != client.id {
-			client.outgoing <- msg
+			if !client.queue.Push(msg) &&
+				atomic.CompareAndSwapInt32(&client.kicked, 0, 1) {
+				Printf("%s is not keeping up, disconnecting\n", client.id)
+				client.Kick()
+			}
 		} else {
 			//fmt.Printf("rx from %s\n", client.id);
 		}
-		if server.log != nil {
-			server.log.Write(msg.data)
-			server.log.Flush()
-		}
 	}
 }
 
 func (server *Server) Join(connection net.Conn) {
-	client := NewClient(connection)
+	server.addClient(NewClient(server, connection))
+}
+
+// Copy the clients for Broadcast, called from Listen after every change
+func (server *Server) publish() {
+	clients := make([]*Client, 0, len(server.clients))
+	for _, client := range server.clients {
+		clients = append(clients, client)
+	}
+	server.snapshot.Store(clients)
+}
+
+func (server *Server) addClient(client *Client) {
 	server.clients[client.id] = client
+	server.publish()
 	Printf("%s connected\n", client.id)
 	server.PrintClients()
-	go func() {
-		for {
-			server.incoming <- <-client.incoming
-		}
-	}()
 }
 
-func (server *Server) Disconnect(msg Message) {
-	client := server.clients[msg.sender]
-	if client == nil || msg.msgtype != MsgDisconnect {
-		return
+// Called once for each client. The client itself is matched, not its id,
+// so a late disconnect cannot drop a new client that reconnected from the
+// same address.
+func (server *Server) Disconnect(client *Client) {
+	if server.clients[client.id] == client {
+		if callsign := client.Callsign(); callsign != "" {
+			delete(server.callsigns, callsign)
+		}
+		delete(server.clients, client.id)
+		server.publish()
 	}
-	if client.callsign != "" {
-		delete(server.callsigns, client.callsign)
+	if client.udp != nil {
+		server.udpRemove(client)
 	}
-	delete(server.clients, msg.sender)
+	client.PrintQueue(client.id + " ")
 	server.PrintClients()
 }
 
@@ -133,14 +163,17 @@ func (server *Server) Listen() {
 	go func() {
 		for {
 			select {
-			case msg := <-server.incoming:
-				if msg.msgtype == MsgDisconnect {
-					server.Disconnect(msg)
-				} else if msg.msgtype == MsgData {
-					server.parsePacket(msg)
-				}
+			case client := <-server.leaves:
+				server.Disconnect(client)
 			case conn := <-server.joins:
 				server.Join(conn)
+			case client := <-server.udpJoins:
+				server.addClient(client)
+			case <-server.stats:
+				server.PrintClients()
+				if server.archive != nil {
+					server.archive.Print()
+				}
 			}
 		}
 	}()
@@ -168,23 +201,47 @@ func (server *Server) Start() {
 
 func NewServer() *Server {
 	server := &Server{
-		clients:  make(map[string]*Client),
-		joins:    make(chan net.Conn),
-		incoming: make(chan Message),
-		outgoing: make(chan Message),
+		clients:     make(map[string]*Client),
+		joins:       make(chan net.Conn),
+		leaves:      make(chan *Client),
+		outgoing:    make(chan Message),
+		stats:       make(chan bool),
+		udpJoins:    make(chan *Client),
+		udpSessions: make(map[string]*Client),
 	}
+	server.snapshot.Store([]*Client{})
 	server.Listen()
 	return server
 }
 
 type Client struct {
 	id         string
-	callsign   string
+	server     *Server
 	connection *net.Conn
-	incoming   chan Message
-	outgoing   chan Message
+	queue      *SendQueue
+	kicked     int32 // set once when a disconnect is requested, atomic
 	reader     *bufio.Reader
-	writer     *bufio.Writer
+	writes     uint64      // system calls sending frames, atomic
+	udp        *UDPSession // set for clients connected over UDP
+
+	// Owned by the goroutine reading from the client
+	header [2]byte
+	arena  FrameArena
+
+	mutex    sync.Mutex // acquire before using callsign
+	callsign string
+}
+
+func (client *Client) Callsign() string {
+	client.mutex.Lock()
+	defer client.mutex.Unlock()
+	return client.callsign
+}
+
+func (client *Client) SetCallsign(callsign string) {
+	client.mutex.Lock()
+	client.callsign = callsign
+	client.mutex.Unlock()
 }
 
 func (client *Client) ReadPacketError(err error) error {
@@ -195,28 +252,34 @@ func (client *Client) ReadPacketError(err error) error {
 	return fmt.Errorf("Error reading from client, disconnecting...\n")
 }
 
+// The frame is sliced from the client's arena, sized to the length in
+// its header, and stays valid after the next read
 func (client *Client) ReadPacket() (data []byte, err error) {
-	data = make([]byte, CONN_MAX_SIZE)
+	header := client.header[:]
 	expectedBytes := 0
 	receivedBytes := 0
 	n := 0
 
-	n, err = client.reader.Read(data[:2])
+	n, err = io.ReadFull(client.reader, header)
 	if err != nil {
+		if n > 0 {
+			err = fmt.Errorf("Client unable to read packet header\n")
+			return nil, err
+		}
 		return nil, client.ReadPacketError(err)
 	}
-	if n < 2 {
-		err = fmt.Errorf("Client unable to read packet header\n")
-		return nil, err
-	}
 
-	receivedBytes += n
-	expectedBytes = int(data[0]) + int(data[1] & 0x1F) << 8
-	if expectedBytes >= cap(data) {
-		err = fmt.Errorf("Client read expected %d bytes but only %d bytes available", expectedBytes, cap(data))
+	expectedBytes = int(header[0]) + int(header[1]&0x1F)<<8
+	if expectedBytes >= CONN_MAX_SIZE {
+		err = fmt.Errorf("Client read expected %d bytes but only %d bytes available", expectedBytes, CONN_MAX_SIZE)
 		return nil, err
 	}
+	if expectedBytes < len(header) {
+		expectedBytes = len(header)
+	}
 
+	data = client.arena.Alloc(expectedBytes)
+	receivedBytes = copy(data, header)
 	for receivedBytes < expectedBytes {
 		n, err = client.reader.Read(data[receivedBytes:expectedBytes])
 		if err != nil {
@@ -230,7 +293,7 @@ func (client *Client) ReadPacket() (data []byte, err error) {
 		Printf("%d bytes\n%s", receivedBytes, datastr)
 	}
 
-	return data[:receivedBytes], nil
+	return data, nil
 }
 
 func (client *Client) Read() {
@@ -240,22 +303,46 @@ func (client *Client) Read() {
 			Printf("%s", err)
 			break
 		} else {
-			client.incoming <- Message{MsgData, client.id, data}
+			tracer.Ingress(data)
+			client.server.parsePacket(client, Message{MsgData, client.id, data})
 		}
 	}
 
 	// Stop Write() for loop and close connection
-	close(client.outgoing)
+	client.queue.Close()
 	(*client.connection).Close()
 
 	// Notify server of disconnect
-	client.incoming <- Message{MsgDisconnect, client.id, []byte{}}
+	client.server.leaves <- client
 }
 
+// Everything queued for the client goes out in one vectored write. With
+// --coalesce set the first frame waits that long for others to join it,
+// so frames of several streams share a TCP segment.
 func (client *Client) Write() {
-	for msg := range client.outgoing {
-		_, err := client.writer.Write(msg.data)
-		client.writer.Flush()
+	var batch []Message
+	var iov [][]byte
+	var buffers net.Buffers
+	var ok bool
+	for {
+		batch, ok = client.queue.PopAll(batch[:0])
+		if !ok {
+			break
+		}
+		if *coalesce > 0 {
+			time.Sleep(*coalesce)
+			batch = client.queue.TryPopAll(batch)
+		}
+
+		iov = iov[:0]
+		for i := range batch {
+			iov = append(iov, tracer.Egress(batch[i].data))
+			batch[i] = Message{}
+		}
+		// WriteTo consumes the slices it is given, keep iov for reuse
+		buffers = iov
+		_, err := buffers.WriteTo(*client.connection)
+		atomic.AddUint64(&client.writes, 1)
 		if err != nil {
 			Printf("Error writing to client\n")
 			continue
@@ -263,14 +350,31 @@ func (client *Client) Write() {
 	}
 }
 
-func NewClient(connection net.Conn) *Client {
+// Drop the connection, Read() then notices and the server disconnects
+// the client as usual
+func (client *Client) Kick() {
+	if client.udp != nil {
+		client.udpClose()
+		return
+	}
+	(*client.connection).Close()
+}
+
+func (client *Client) PrintQueue(prefix string) {
+	stats := client.queue.Stats()
+	fmt.Printf("%squeue: %d sent in %d writes, %d dropped, "+
+		"%d headers dropped, depth %d, max %d\n", prefix, stats.Sent,
+		atomic.LoadUint64(&client.writes), stats.Dropped, stats.Headers,
+		stats.Depth, stats.MaxDepth)
+}
+
+func NewClient(server *Server, connection net.Conn) *Client {
 	client := &Client{
 		id:         connection.RemoteAddr().String(),
+		server:     server,
 		connection: &connection,
-		incoming:   make(chan Message),
-		outgoing:   make(chan Message),
+		queue:      NewSendQueue(*queueFrames, *queueTimeout),
 		reader:     bufio.NewReader(connection),
-		writer:     bufio.NewWriter(connection),
 	}
 
 	// Start read and write threads
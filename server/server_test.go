@@ -0,0 +1,133 @@
+// server_test.go
+// Benchmarks of the frame path, go test -bench . and for fan-out scaling
+// go test -bench Fanout -cpu 1,2,4,8
+
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"sync/atomic"
+	"testing"
+)
+
+// Flags are not parsed under go test
+const (
+	BENCH_QUEUE           = 50
+	BENCH_CLIENTS         = 8
+	BENCH_FANOUT_CLIENTS  = 50
+	BENCH_SENDERS_PER_CPU = 2 // more senders than cores, as when busy
+)
+
+// Endless stream of the same frames, standing in for a connection
+type loopReader struct {
+	data []byte
+	pos  int
+}
+
+func (r *loopReader) Read(p []byte) (int, error) {
+	n := copy(p, r.data[r.pos:])
+	r.pos = (r.pos + n) % len(r.data)
+	return n, nil
+}
+
+// One GMSK header followed by a superframe of data frames
+func benchStream() []byte {
+	stream := make([]byte, 0, 47+21*18)
+	header := make([]byte, 47)
+	header[0], header[1], header[2] = 0x2F, 0xA0, 0x01
+	copy(header[9:], "DIRECT  DIRECT  CQCQCQ  N0CALL      ")
+	stream = append(stream, header...)
+	for seq := 0; seq < 21; seq++ {
+		data := make([]byte, 18)
+		data[0], data[1], data[2], data[5] = 0x12, 0xC0, 0x01, byte(seq)
+		stream = append(stream, data...)
+	}
+	return stream
+}
+
+func BenchmarkReadPacket(b *testing.B) {
+	client := &Client{
+		id:     "bench",
+		reader: bufio.NewReader(&loopReader{data: benchStream()}),
+	}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := client.ReadPacket(); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// A server with clients that are never disconnected, not listening
+func benchServer(clients int) *Server {
+	server := &Server{clients: make(map[string]*Client)}
+	for i := 0; i < clients; i++ {
+		id := fmt.Sprintf("client%d", i)
+		server.clients[id] = &Client{
+			id:     id,
+			server: server,
+			queue:  NewSendQueue(BENCH_QUEUE, 0),
+		}
+	}
+	server.publish()
+	return server
+}
+
+// Fan a data frame out to every client and empty their queues, as the
+// client writers would
+func BenchmarkBroadcast(b *testing.B) {
+	server := benchServer(BENCH_CLIENTS)
+	msg := Message{MsgData, "sender", benchStream()[47 : 47+18]}
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		server.Broadcast(msg)
+		for _, client := range server.clients {
+			client.queue.TryPop()
+		}
+	}
+}
+
+// Every sender parses and fans out its frames on its own goroutine, as
+// client readers do, while a writer goroutine per client drains its queue.
+// frames/s should grow with -cpu.
+func BenchmarkFanout(b *testing.B) {
+	server := benchServer(BENCH_FANOUT_CLIENTS)
+	done := make(chan bool)
+	for _, client := range server.clients {
+		go func(queue *SendQueue) {
+			var batch []Message
+			var ok bool
+			for {
+				if batch, ok = queue.PopAll(batch[:0]); !ok {
+					done <- true
+					return
+				}
+			}
+		}(client.queue)
+	}
+	frame := benchStream()[47 : 47+18]
+	var senders int32
+
+	b.ReportAllocs()
+	b.SetParallelism(BENCH_SENDERS_PER_CPU)
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		n := atomic.AddInt32(&senders, 1) % BENCH_FANOUT_CLIENTS
+		client := server.clients[fmt.Sprintf("client%d", n)]
+		msg := Message{MsgData, client.id, frame}
+		for pb.Next() {
+			server.parsePacket(client, msg)
+		}
+	})
+	b.StopTimer()
+	b.ReportMetric(float64(b.N)/b.Elapsed().Seconds(), "frames/s")
+
+	for _, client := range server.clients {
+		client.queue.Close()
+		<-done
+	}
+}
@@ -0,0 +1,105 @@
+// trace.go
+// Per-frame latency tracing, stamps trace frames on their way through
+// and keeps a histogram for each hop up to the server
+
+package main
+
+import (
+	"encoding/binary"
+	"sync"
+	"time"
+)
+
+// Trace frames follow traced GMSK frames from clients started with
+// tracing. Must match client/trace.h.
+//
+//	bytes 0-1   length and type, 0xE036 little endian
+//	bytes 2-3   stream_id of the traced frame
+//	byte  4     seq of the traced frame, 0xFF for a header
+//	byte  5     reserved, 0
+//	bytes 6-53  TRACE_* stamps, us since the epoch, little endian
+const (
+	TRACE_FRAME_SIZE = 54
+	TRACE_FRAME_TYPE = 0xE036
+
+	TRACE_DVAP_RX    = 0
+	TRACE_NET_TX     = 1
+	TRACE_SERVER_IN  = 2
+	TRACE_SERVER_OUT = 3
+)
+
+var traceHopNames = []string{
+	"dvap rx -> net tx",
+	"net tx -> server in",
+	"server in -> server out",
+}
+
+type Tracer struct {
+	mutex sync.Mutex // acquire before using hops
+	hops  [TRACE_SERVER_OUT]Histogram
+}
+
+// Shared by the per client writers, which have no server to hand
+var tracer = &Tracer{}
+
+func isTraceFrame(data []byte) bool {
+	return len(data) == TRACE_FRAME_SIZE &&
+		binary.LittleEndian.Uint16(data[0:2]) == TRACE_FRAME_TYPE
+}
+
+func traceGet(data []byte, hop int) uint64 {
+	return binary.LittleEndian.Uint64(data[6+hop*8:])
+}
+
+func traceStamp(data []byte, hop int) {
+	binary.LittleEndian.PutUint64(data[6+hop*8:],
+		uint64(time.Now().UnixNano()/1000))
+}
+
+func (t *Tracer) record(hop int, data []byte) {
+	from, to := traceGet(data, hop), traceGet(data, hop+1)
+	if from == 0 || to == 0 {
+		return
+	}
+	if to < from {
+		to = from
+	}
+	t.hops[hop].Record(to - from)
+}
+
+// Stamp a frame just read from a client, anything but a trace frame is
+// left alone
+func (t *Tracer) Ingress(data []byte) {
+	if !isTraceFrame(data) {
+		return
+	}
+	traceStamp(data, TRACE_SERVER_IN)
+	t.mutex.Lock()
+	t.record(TRACE_DVAP_RX, data)
+	t.record(TRACE_NET_TX, data)
+	t.mutex.Unlock()
+}
+
+// Returns the frame to write to a client, trace frames are copied as
+// every client gets its own egress stamp
+func (t *Tracer) Egress(data []byte) []byte {
+	if !isTraceFrame(data) {
+		return data
+	}
+	out := make([]byte, len(data))
+	copy(out, data)
+	traceStamp(out, TRACE_SERVER_OUT)
+	t.mutex.Lock()
+	t.record(TRACE_SERVER_IN, out)
+	t.mutex.Unlock()
+	return out
+}
+
+func (t *Tracer) Print() {
+	t.mutex.Lock()
+	defer t.mutex.Unlock()
+	Printf("Latency by hop (us):\n")
+	for i := range t.hops {
+		t.hops[i].Print(traceHopNames[i])
+	}
+}
@@ -0,0 +1,300 @@
+// udp.go
+// UDP transport, one session per remote address
+
+package main
+
+import (
+	"encoding/binary"
+	"net"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Each datagram starts with a header, data datagrams then carry one
+// DVAP frame. Must match client/network.h.
+//
+//	byte 0     UDP_* type
+//	byte 1     reserved, 0
+//	bytes 2-5  sequence number, little endian, counts data datagrams
+const (
+	UDP_HEADER_SIZE = 6
+	UDP_DATA        = 1
+	UDP_HEARTBEAT   = 2
+	UDP_BYE         = 3
+
+	UDP_HEARTBEAT_INTERVAL = time.Second
+	UDP_TIMEOUT            = 5 * time.Second
+)
+
+// Tracks received sequence numbers to count loss and reordering
+type SeqTracker struct {
+	started   bool
+	first     uint32 // number tracking (re)started from
+	next      uint32
+	window    uint64 // bit n set if next - 1 - n arrived
+	received  uint64
+	lost      uint64
+	late      uint64
+	duplicate uint64
+	resyncs   uint64 // the peer restarted its numbering
+}
+
+// Accept returns false for a sequence number that is late or a
+// duplicate, those frames are dropped rather than played out of order.
+// One more than 64 behind is taken as the peer restarting its numbering,
+// such as a client that comes back from the same address.
+func (t *SeqTracker) Accept(seq uint32) bool {
+	if !t.started {
+		t.started = true
+		t.first = seq
+		t.next = seq + 1
+		t.window = 1
+		t.received++
+		return true
+	}
+
+	diff := int32(seq - t.next)
+	if diff >= 0 {
+		t.lost += uint64(diff)
+		if diff+1 >= 64 {
+			t.window = 1
+		} else {
+			t.window = t.window<<uint(diff+1) | 1
+		}
+		t.next = seq + 1
+		t.received++
+		return true
+	}
+
+	back := uint32(-diff) - 1
+	if back >= 64 {
+		t.resyncs++
+		t.started = false
+		return t.Accept(seq)
+	}
+	if t.window&(1<<back) != 0 {
+		t.duplicate++
+		return false
+	}
+	t.window |= 1 << back
+
+	// Only gaps after the first frame were counted as lost
+	if int32(seq-t.first) > 0 {
+		t.lost--
+	}
+	t.late++
+	return false
+}
+
+// State for a client connected over UDP
+type UDPSession struct {
+	conn     *net.UDPConn
+	addr     *net.UDPAddr
+	txSeq    uint32
+	rx       SeqTracker
+	mutex    sync.Mutex // acquire before using lastSeen or rx
+	lastSeen time.Time
+	done     chan bool // closed once the server has dropped the client
+	closing  sync.Once // the server is asked to drop the client only once
+}
+
+func udpHeader(buf []byte, msgtype byte, seq uint32) {
+	buf[0] = msgtype
+	buf[1] = 0
+	binary.LittleEndian.PutUint32(buf[2:6], seq)
+}
+
+func (session *UDPSession) sendCtrl(msgtype byte) {
+	buf := make([]byte, UDP_HEADER_SIZE)
+	udpHeader(buf, msgtype, 0)
+	session.conn.WriteToUDP(buf, session.addr)
+}
+
+// Send outgoing frames with sequence numbers, heartbeat while idle and
+// notice when the client has gone quiet
+func (client *Client) udpRun() {
+	session := client.udp
+	ticker := time.NewTicker(UDP_HEARTBEAT_INTERVAL)
+	defer ticker.Stop()
+	buf := make([]byte, UDP_HEADER_SIZE+CONN_MAX_SIZE)
+	timedOut := false
+
+	for {
+		select {
+		case <-client.queue.Ready():
+			for {
+				msg, ok := client.queue.TryPop()
+				if !ok {
+					break
+				}
+				if timedOut || len(msg.data) > CONN_MAX_SIZE {
+					continue
+				}
+				udpHeader(buf, UDP_DATA, session.txSeq)
+				n := copy(buf[UDP_HEADER_SIZE:], tracer.Egress(msg.data))
+				_, err := session.conn.WriteToUDP(buf[:UDP_HEADER_SIZE+n],
+					session.addr)
+				atomic.AddUint64(&client.writes, 1)
+				if err != nil {
+					Printf("Error writing to client\n")
+					continue
+				}
+				session.txSeq++
+			}
+		case <-ticker.C:
+			if timedOut {
+				continue
+			}
+			session.mutex.Lock()
+			idle := time.Since(session.lastSeen)
+			session.mutex.Unlock()
+			if idle > UDP_TIMEOUT {
+				Printf("%s timed out\n", client.id)
+				client.udpClose()
+				timedOut = true
+				continue
+			}
+			session.sendCtrl(UDP_HEARTBEAT)
+		case <-session.done:
+			return
+		}
+	}
+}
+
+// Ask the server to drop the client, later calls do nothing
+func (client *Client) udpClose() {
+	client.udp.closing.Do(func() {
+		go func() {
+			client.server.leaves <- client
+		}()
+	})
+}
+
+func (client *Client) udpReceive(buf []byte) {
+	session := client.udp
+	session.mutex.Lock()
+	session.lastSeen = time.Now()
+	session.mutex.Unlock()
+
+	switch buf[0] {
+	case UDP_BYE:
+		// A reconnect from the same address gets a new session
+		Printf("%s disconnected\n", client.id)
+		client.server.udpForget(client)
+		client.udpClose()
+		return
+	case UDP_DATA:
+	default:
+		return
+	}
+
+	session.mutex.Lock()
+	ok := session.rx.Accept(binary.LittleEndian.Uint32(buf[2:6]))
+	session.mutex.Unlock()
+	if !ok {
+		return
+	}
+
+	// Copy, the read buffer is reused for the next datagram
+	frame := buf[UDP_HEADER_SIZE:]
+	for len(frame) >= 2 {
+		n := int(frame[0]) + int(frame[1]&0x1F)<<8
+		if n < 2 || n > len(frame) {
+			break
+		}
+		data := client.arena.Alloc(n)
+		copy(data, frame[:n])
+		tracer.Ingress(data)
+		client.server.parsePacket(client, Message{MsgData, client.id, data})
+		frame = frame[n:]
+	}
+}
+
+func NewUDPClient(server *Server, conn *net.UDPConn,
+	addr *net.UDPAddr) *Client {
+	client := &Client{
+		id:     "udp://" + addr.String(),
+		server: server,
+		queue:  NewSendQueue(*queueFrames, *queueTimeout),
+		udp: &UDPSession{
+			conn:     conn,
+			addr:     addr,
+			lastSeen: time.Now(),
+			done:     make(chan bool),
+		},
+	}
+	go client.udpRun()
+	return client
+}
+
+// Accept UDP clients alongside TCP ones, sessions are keyed on the
+// remote address
+func (server *Server) StartUDP() {
+	addr, err := net.ResolveUDPAddr("udp", CONN_HOST+":"+CONN_PORT)
+	if err != nil {
+		Printf("Error resolving %s:%s: %s\n", CONN_HOST, CONN_PORT,
+			err.Error())
+		return
+	}
+	conn, err := net.ListenUDP("udp", addr)
+	if err != nil {
+		Printf("Error listening on udp %s:%s: %s\n", CONN_HOST, CONN_PORT,
+			err.Error())
+		return
+	}
+
+	Printf("Listening on udp %s:%s\n", CONN_HOST, CONN_PORT)
+	go func() {
+		defer conn.Close()
+		buf := make([]byte, UDP_HEADER_SIZE+CONN_MAX_SIZE)
+		for {
+			n, from, err := conn.ReadFromUDP(buf)
+			if err != nil {
+				Printf("Error reading udp: %s\n", err.Error())
+				return
+			}
+			if n < UDP_HEADER_SIZE {
+				continue
+			}
+
+			id := "udp://" + from.String()
+			server.udpMutex.Lock()
+			client := server.udpSessions[id]
+			server.udpMutex.Unlock()
+			if client == nil {
+				if buf[0] == UDP_BYE {
+					continue
+				}
+				client = NewUDPClient(server, conn, from)
+				server.udpMutex.Lock()
+				server.udpSessions[id] = client
+				server.udpMutex.Unlock()
+				server.udpJoins <- client
+			}
+			client.udpReceive(buf[:n])
+		}
+	}()
+}
+
+// Stop routing datagrams from the client's address to it
+func (server *Server) udpForget(client *Client) {
+	server.udpMutex.Lock()
+	if server.udpSessions[client.id] == client {
+		delete(server.udpSessions, client.id)
+	}
+	server.udpMutex.Unlock()
+}
+
+// Called from Disconnect once the server no longer broadcasts to client
+func (server *Server) udpRemove(client *Client) {
+	session := client.udp
+	server.udpForget(client)
+	close(session.done)
+
+	session.mutex.Lock()
+	Printf("%s received %d frames, %d lost, %d late, %d duplicate, "+
+		"%d resyncs\n", client.id, session.rx.received, session.rx.lost,
+		session.rx.late, session.rx.duplicate, session.rx.resyncs)
+	session.mutex.Unlock()
+}